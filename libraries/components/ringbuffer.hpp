@@ -32,9 +32,13 @@ public:
   Ringbuffer();
 
   inline int read(T* dest, unsigned size = 1);
-  inline int write(T* src, unsigned size = 1);
+  /** Like read(), but does not remove the elements from the buffer. */
+  inline int peek(T* dest, unsigned size = 1) const;
+  inline int write(const T* src, unsigned size = 1);
   inline int write_zeros(unsigned size);
   inline int available() const;
+  /** Returns the number of elements that can be written right now. */
+  inline int write_space() const;
   inline int available_contiguous() const;
   inline int get_read_pos() const;
   inline int get_write_pos() const;
@@ -70,11 +74,15 @@ int Ringbuffer<T, S>::read(T* dest, unsigned size) {
   if (size == 0)
     return 0;
   
+  // make sure that we see the data that the writer has committed
+  __sync_synchronize();
+  
   if (m_read_pos > m_write_pos) {
     n = S - m_read_pos;
     n = (n > size ? size : n);
     if (dest)
       std::memcpy(dest, data + m_read_pos, n * sizeof(T));
+    __sync_synchronize();
     m_read_pos = (m_read_pos + n) % S;
   }
   
@@ -83,6 +91,7 @@ int Ringbuffer<T, S>::read(T* dest, unsigned size) {
     m = (m > size - n ? size - n : m);
     if (dest)
       std::memcpy(dest + n, data + m_read_pos, m * sizeof(T));
+    __sync_synchronize();
     m_read_pos = (m_read_pos + m) % S;
     n += m;
   }
@@ -99,8 +108,38 @@ int Ringbuffer<T, S>::read(T* dest, unsigned size) {
 }
 
 
+template <class T, unsigned S> 
+int Ringbuffer<T, S>::peek(T* dest, unsigned size) const {
+  
+  unsigned n = 0;
+  const T* data = (const T*)m_data;
+  int read_pos = m_read_pos;
+  
+  if (size == 0)
+    return 0;
+  
+  __sync_synchronize();
+  
+  if (read_pos > m_write_pos) {
+    n = S - read_pos;
+    n = (n > size ? size : n);
+    std::memcpy(dest, data + read_pos, n * sizeof(T));
+    read_pos = (read_pos + n) % S;
+  }
+  
+  if (read_pos < m_write_pos && n < size) {
+    unsigned m = m_write_pos - read_pos;
+    m = (m > size - n ? size - n : m);
+    std::memcpy(dest + n, data + read_pos, m * sizeof(T));
+    n += m;
+  }
+  
+  return n;
+}
+
+
 template <class T, unsigned S>
-int Ringbuffer<T, S>::write(T* src, unsigned size) {
+int Ringbuffer<T, S>::write(const T* src, unsigned size) {
   unsigned n = 0;
   T* data = (T*)(m_data);
 
@@ -113,6 +152,8 @@ int Ringbuffer<T, S>::write(T* src, unsigned size) {
       --n;
     n = (n > size ? size : n);
     std::memcpy(data + m_write_pos, src, n * sizeof(T));
+    // the data must be visible before the new write position is
+    __sync_synchronize();
     m_write_pos = (m_write_pos + n) % S;
   }
   
@@ -120,6 +161,7 @@ int Ringbuffer<T, S>::write(T* src, unsigned size) {
     unsigned m = m_read_pos - m_write_pos - 1;
     m = (m > size - n ? size - n : m);
     std::memcpy(data + m_write_pos, src + n, m * sizeof(T));
+    __sync_synchronize();
     m_write_pos = (m_write_pos + m) % S;
     n += m;
   }
@@ -150,6 +192,7 @@ int Ringbuffer<T, S>::write_zeros(unsigned size) {
       --n;
     n = (n > size ? size : n);
     std::memset(data + m_write_pos, 0, n * sizeof(T));
+    __sync_synchronize();
     m_write_pos = (m_write_pos + n) % S;
   }
   
@@ -157,6 +200,7 @@ int Ringbuffer<T, S>::write_zeros(unsigned size) {
     unsigned m = m_read_pos - m_write_pos - 1;
     m = (m > size - n ? size - n : m);
     std::memset(data + m_write_pos, 0, m * sizeof(T));
+    __sync_synchronize();
     m_write_pos = (m_write_pos + m) % S;
     n += m;
   }
@@ -182,6 +226,12 @@ int Ringbuffer<T, S>::available() const {
 }
 
 
+template <class T, unsigned S>
+int Ringbuffer<T, S>::write_space() const {
+  return S - 1 - available();
+}
+
+
 template <class T, unsigned S>
 int Ringbuffer<T, S>::available_contiguous() const {
   if (m_read_pos <= m_write_pos)
@@ -0,0 +1,100 @@
+/****************************************************************************
+    
+    automation.cpp - Control port automation for offline rendering
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "automation.hpp"
+#include "debug.hpp"
+
+
+using namespace std;
+
+
+namespace {
+  
+  bool earlier(const AutomationEvent& a, const AutomationEvent& b) {
+    return a.frame < b.frame;
+  }
+  
+}
+
+
+bool Automation::read(const std::string& filename, const LV2Host& host) {
+  
+  m_events.clear();
+  
+  ifstream ifs(filename.c_str());
+  if (!ifs.good()) {
+    DBG0("Could not open "<<filename);
+    return false;
+  }
+  
+  const vector<LV2Port>& ports = host.get_ports();
+  double rate = host.get_frame_rate();
+  string line;
+  unsigned lineno = 0;
+  while (getline(ifs, line)) {
+    
+    ++lineno;
+    istringstream iss(line);
+    string first;
+    if (!(iss>>first) || first[0] == '#')
+      continue;
+    
+    istringstream time(first);
+    double seconds;
+    string symbol;
+    AutomationEvent e;
+    if (!(time>>seconds) || seconds < 0 || !(iss>>symbol>>e.value)) {
+      DBG0("Error on line "<<lineno<<" in "<<filename);
+      return false;
+    }
+    
+    for (e.port = 0; e.port < ports.size(); ++e.port) {
+      if (ports[e.port].symbol == symbol)
+	break;
+    }
+    if (e.port == ports.size() || ports[e.port].type != ControlType ||
+	ports[e.port].direction != InputPort || 
+	ports[e.port].context != AudioContext) {
+      DBG0(symbol<<" is not a control input on line "<<lineno
+	   <<" in "<<filename);
+      return false;
+    }
+    
+    e.frame = uint64_t(seconds * rate + 0.5);
+    m_events.push_back(e);
+  }
+  
+  stable_sort(m_events.begin(), m_events.end(), &earlier);
+  DBG2("Read "<<m_events.size()<<" control changes from "<<filename);
+  
+  return true;
+}
+
+
+const std::vector<AutomationEvent>& Automation::get_events() const {
+  return m_events;
+}
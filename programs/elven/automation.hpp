@@ -0,0 +1,66 @@
+/****************************************************************************
+    
+    automation.hpp - Control port automation for offline rendering
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef AUTOMATION_HPP
+#define AUTOMATION_HPP
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "lv2host.hpp"
+
+
+/** A control port value with its time in frames. */
+struct AutomationEvent {
+  uint64_t frame;
+  uint32_t port;
+  float value;
+};
+
+
+/** This class reads a text file with control port changes for a plugin.
+    Each line has a time in seconds, a port symbol and a value, separated by
+    whitespace. Empty lines and lines starting with '#' are ignored. The 
+    lines do not have to be sorted. */
+class Automation {
+public:
+  
+  /** Read the file and look up the port symbols in @c host. Returns false
+      if the file could not be read or refers to a port that is not an
+      audio context control input. */
+  bool read(const std::string& filename, const LV2Host& host);
+  
+  /** Returns the events, sorted by time. Events for the same frame keep
+      the order they had in the file. */
+  const std::vector<AutomationEvent>& get_events() const;
+  
+protected:
+  
+  std::vector<AutomationEvent> m_events;
+  
+};
+
+
+#endif
@@ -0,0 +1,212 @@
+/****************************************************************************
+    
+    batch.cpp - Parallel processing of sound files through a plugin
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <climits>
+#include <cstdlib>
+#include <set>
+
+#include "batch.hpp"
+#include "debug.hpp"
+
+
+using namespace std;
+
+
+BatchProcessor::BatchProcessor(const std::string& uri, unsigned long rate,
+			       uint32_t block_size, unsigned threads)
+  : m_valid(false),
+    m_files(0),
+    m_tail(0),
+    m_next_file(0),
+    m_failed(0) {
+  
+  for (unsigned i = 0; i < threads; ++i) {
+    Worker w;
+    w.host = new LV2Host(uri, rate);
+    w.renderer = 0;
+    w.batch = this;
+    m_workers.push_back(w);
+    if (!w.host->is_valid()) {
+      DBG0("Could not load the plugin "<<uri);
+      return;
+    }
+    m_workers.back().renderer = new OfflineRenderer(*w.host, block_size);
+    if (!m_workers.back().renderer->is_valid())
+      return;
+  }
+  
+  m_valid = !m_workers.empty();
+}
+
+
+BatchProcessor::~BatchProcessor() {
+  for (unsigned i = 0; i < m_workers.size(); ++i) {
+    delete m_workers[i].renderer;
+    delete m_workers[i].host;
+  }
+}
+
+
+bool BatchProcessor::is_valid() const {
+  return m_valid;
+}
+
+
+bool BatchProcessor::set_control(const std::string& symbol, float value) {
+  if (!m_valid)
+    return false;
+  const vector<LV2Port>& ports = m_workers[0].host->get_ports();
+  for (uint32_t p = 0; p < ports.size(); ++p) {
+    if (ports[p].symbol == symbol && ports[p].type == ControlType &&
+	ports[p].direction == InputPort) {
+      for (unsigned i = 0; i < m_workers.size(); ++i)
+	m_workers[i].host->set_control(p, value);
+      return true;
+    }
+  }
+  DBG0("The plugin has no control input called \""<<symbol<<"\"");
+  return false;
+}
+
+
+bool BatchProcessor::set_program(unsigned char program) {
+  if (!m_valid)
+    return false;
+  const map<unsigned, LV2Preset>& presets = m_workers[0].host->get_presets();
+  if (presets.find(program) == presets.end()) {
+    DBG0("The plugin has no program with number "<<int(program));
+    return false;
+  }
+  for (unsigned i = 0; i < m_workers.size(); ++i)
+    m_workers[i].host->set_program(program);
+  return true;
+}
+
+
+unsigned BatchProcessor::run(const std::vector<std::string>& files, 
+			     const std::string& directory, uint64_t tail) {
+  
+  if (!m_valid)
+    return files.size();
+  
+  m_files = &files;
+  m_directory = directory;
+  m_tail = tail;
+  m_next_file = 0;
+  m_failed = 0;
+  
+  // the calling thread is the last worker
+  for (unsigned i = 0; i + 1 < m_workers.size(); ++i) {
+    if (pthread_create(&m_workers[i].thread, 0, 
+		       &BatchProcessor::worker_thread, &m_workers[i])) {
+      DBG0("Could not start worker thread "<<i);
+      m_workers[i].thread = pthread_self();
+    }
+  }
+  const char* prefix = DebugInfo::thread_prefix();
+  worker_thread(&m_workers.back());
+  DebugInfo::thread_prefix() = prefix;
+  for (unsigned i = 0; i + 1 < m_workers.size(); ++i) {
+    if (!pthread_equal(m_workers[i].thread, pthread_self()))
+      pthread_join(m_workers[i].thread, 0);
+  }
+  
+  m_files = 0;
+  return m_failed;
+}
+
+
+unsigned BatchProcessor::get_threads() const {
+  return m_workers.size();
+}
+
+
+std::string BatchProcessor::get_output(const std::string& input, 
+				      const std::string& directory) {
+  string::size_type slash = input.rfind('/');
+  return directory + "/" + 
+    (slash == string::npos ? input : input.substr(slash + 1));
+}
+
+
+bool BatchProcessor::check_outputs(const std::vector<std::string>& files, 
+				   const std::string& directory) {
+  
+  char path[PATH_MAX];
+  if (!realpath(directory.c_str(), path)) {
+    DBG0("Could not find the output directory "<<directory);
+    return false;
+  }
+  string real_dir = path;
+  
+  // compare the real paths, so links and different ways of writing the 
+  // same directory are caught too
+  set<string> inputs;
+  for (unsigned i = 0; i < files.size(); ++i) {
+    if (realpath(files[i].c_str(), path))
+      inputs.insert(path);
+  }
+  set<string> outputs;
+  for (unsigned i = 0; i < files.size(); ++i) {
+    string output = get_output(files[i], real_dir);
+    if (realpath(output.c_str(), path))
+      output = path;
+    if (inputs.find(output) != inputs.end()) {
+      DBG0("The output for "<<files[i]<<" would overwrite the input file "
+	   <<output);
+      return false;
+    }
+    if (!outputs.insert(output).second) {
+      DBG0("More than one input file would be written to "<<output);
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+
+void* BatchProcessor::worker_thread(void* arg) {
+  
+  Worker* w = static_cast<Worker*>(arg);
+  BatchProcessor* me = w->batch;
+  DebugInfo::thread_prefix() = "W ";
+  
+  while (true) {
+    unsigned i = __sync_fetch_and_add(&me->m_next_file, 1);
+    if (i >= me->m_files->size())
+      break;
+    
+    const string& input = (*me->m_files)[i];
+    string output = get_output(input, me->m_directory);
+    
+    DBG1("Processing "<<input<<" -> "<<output);
+    w->renderer->reset();
+    if (!w->renderer->process(input, output, me->m_tail)) {
+      DBG0("Failed to process "<<input);
+      __sync_fetch_and_add(&me->m_failed, 1);
+    }
+  }
+  
+  return 0;
+}
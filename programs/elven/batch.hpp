@@ -0,0 +1,105 @@
+/****************************************************************************
+    
+    batch.hpp - Parallel processing of sound files through a plugin
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "lv2host.hpp"
+#include "render.hpp"
+
+
+/** This class runs a list of sound files through a plugin using a number
+    of worker threads. Every worker has its own plugin instance, and the
+    workers take files from the list until it is empty, so they never wait
+    for each other. All instances are created in the calling thread, since
+    loading plugins is not thread safe. */
+class BatchProcessor {
+public:
+  
+  /** Create @c threads instances of the plugin, running at @c rate and 
+      processing @c block_size frames at a time. */
+  BatchProcessor(const std::string& uri, unsigned long rate, 
+		 uint32_t block_size, unsigned threads);
+  
+  ~BatchProcessor();
+  
+  /** Returns true if all instances could be created. */
+  bool is_valid() const;
+  
+  /** Set a control input in all instances. Returns false if there is no
+      control input with that symbol. */
+  bool set_control(const std::string& symbol, float value);
+  
+  /** Switch all instances to a program. Returns false if there is no such
+      program. */
+  bool set_program(unsigned char program);
+  
+  /** Process all files and write the results, with the same names, to 
+      @c directory. After the end of each file the plugin runs for @c tail
+      more frames. Returns the number of files that failed. */
+  unsigned run(const std::vector<std::string>& files, 
+	       const std::string& directory, uint64_t tail);
+  
+  /** Returns the number of worker threads. */
+  unsigned get_threads() const;
+  
+  /** Returns the file in @c directory that the output for @c input is
+      written to. */
+  static std::string get_output(const std::string& input, 
+				const std::string& directory);
+  
+  /** Returns false if the output for one of the files would overwrite an
+      input file, or if two files would get the same output file. This 
+      should be checked before run() is called. */
+  static bool check_outputs(const std::vector<std::string>& files, 
+			    const std::string& directory);
+  
+protected:
+  
+  struct Worker {
+    LV2Host* host;
+    OfflineRenderer* renderer;
+    BatchProcessor* batch;
+    pthread_t thread;
+  };
+  
+  static void* worker_thread(void* arg);
+  
+  std::vector<Worker> m_workers;
+  bool m_valid;
+  
+  const std::vector<std::string>* m_files;
+  std::string m_directory;
+  uint64_t m_tail;
+  volatile unsigned m_next_file;
+  volatile unsigned m_failed;
+  
+};
+
+
+#endif
@@ -0,0 +1,339 @@
+/****************************************************************************
+    
+    bench.cpp - Benchmarking of plugins without JACK
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <algorithm>
+#include <iomanip>
+
+#include <time.h>
+
+#include "bench.hpp"
+#include <lv2_event_helpers.h>
+
+#include "debug.hpp"
+#include "graph.hpp"
+#include "lv2host.hpp"
+#include "render.hpp"
+#include "scheduler.hpp"
+#include "urimap.hpp"
+
+
+using namespace std;
+
+
+namespace {
+  
+  bool earlier(const MidiFileEvent& a, const MidiFileEvent& b) {
+    return a.frame < b.frame;
+  }
+  
+  
+  void add_event(std::vector<MidiFileEvent>& events, uint64_t frame,
+		 unsigned char status, unsigned char key, 
+		 unsigned char velocity) {
+    events.push_back(MidiFileEvent());
+    events.back().frame = frame;
+    events.back().data.push_back(status);
+    events.back().data.push_back(key);
+    events.back().data.push_back(velocity);
+  }
+  
+}
+
+
+Benchmark::Benchmark(unsigned long rate, double seconds, MidiInput input)
+  : m_rate(rate),
+    m_seconds(seconds),
+    m_input(input),
+    m_timer_overhead(0) {
+  
+  // measure the cost of reading the clock, it is subtracted from all times
+  m_timer_overhead = ~uint64_t(0);
+  for (unsigned i = 0; i < 1000; ++i) {
+    uint64_t t0 = now();
+    uint64_t t1 = now();
+    if (t1 - t0 < m_timer_overhead)
+      m_timer_overhead = t1 - t0;
+  }
+}
+
+
+bool Benchmark::run(const std::string& uri, std::ostream& os) {
+  
+  LV2Host host(uri, m_rate);
+  if (!host.is_valid()) {
+    DBG0("Could not load the plugin "<<uri);
+    return false;
+  }
+  OfflineRenderer renderer(host, MaxBlock);
+  if (!renderer.is_valid())
+    return false;
+  
+  // white noise on all audio inputs, the renderer never overwrites it
+  vector<LV2Port>& ports = host.get_ports();
+  uint32_t seed = 1;
+  for (unsigned p = 0; p < ports.size(); ++p) {
+    if (ports[p].type != AudioType || ports[p].direction != InputPort)
+      continue;
+    float* buf = static_cast<float*>(ports[p].buffer);
+    for (uint32_t f = 0; f < MaxBlock; ++f) {
+      seed = seed * 1664525 + 1013904223;
+      buf[f] = 0.5f * int32_t(seed) / 2147483648.0f;
+    }
+  }
+  
+  uint64_t warmup = m_rate / 4;
+  uint64_t frames = uint64_t(m_seconds * m_rate);
+  make_events(warmup + frames + MaxBlock);
+  
+  double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+  unsigned points = 0;
+  
+  os<<fixed<<setprecision(1);
+  for (uint32_t n = 1; n <= MaxBlock; n *= 2) {
+    
+    renderer.reset();
+    renderer.set_events(&m_events);
+    while (renderer.get_frame() < warmup) {
+      renderer.run_block(n);
+      host.run_main();
+    }
+    
+    // time every call
+    uint64_t calls = (frames + n - 1) / n;
+    m_times.resize(calls);
+    uint64_t total = 0;
+    for (uint64_t c = 0; c < calls; ++c) {
+      uint64_t t0 = now();
+      renderer.run_block(n);
+      uint64_t t1 = now();
+      uint64_t t = t1 - t0;
+      m_times[c] = (t > m_timer_overhead ? t - m_timer_overhead : 0);
+      total += m_times[c];
+      host.run_main();
+    }
+    
+    double mean = double(total) / calls;
+    uint64_t p50, p99, max;
+    get_percentiles(calls, p50, p99, max);
+    
+    os<<"block uri="<<uri<<" size="<<n<<" calls="<<calls
+      <<" frames="<<(calls * n)
+      <<" ns_per_frame="<<(double(total) / (calls * n))
+      <<" ns_per_call="<<mean
+      <<" p50_ns="<<p50<<" p99_ns="<<p99<<" max_ns="<<max<<endl;
+    
+    sum_x += n;
+    sum_y += mean;
+    sum_xx += double(n) * n;
+    sum_xy += n * mean;
+    ++points;
+  }
+  
+  // call time = overhead + n * cost per frame
+  double slope = (points * sum_xy - sum_x * sum_y) / 
+    (points * sum_xx - sum_x * sum_x);
+  double intercept = (sum_y - slope * sum_x) / points;
+  os<<"fit uri="<<uri<<" overhead_ns="<<intercept
+    <<" ns_per_frame="<<slope<<endl;
+  
+  return true;
+}
+
+
+bool Benchmark::run_graph(const std::string& filename, 
+			  unsigned max_threads, uint32_t block_size, 
+			  std::ostream& os) {
+  
+  PluginGraph graph(m_rate);
+  if (!graph.load(filename) || 
+      !graph.allocate_buffers(block_size, 8192, true))
+    return false;
+  
+  // white noise on the external audio inputs, and somewhere to write the
+  // external audio outputs
+  const vector<PluginGraph::Node>& nodes = graph.get_nodes();
+  const vector<PluginGraph::ExternalPort>& external = 
+    graph.get_external_ports();
+  vector<float> audio(external.size() * block_size);
+  vector<LV2_Event_Buffer*> midi;
+  uint32_t seed = 1;
+  for (unsigned j = 0; j < external.size(); ++j) {
+    LV2Port& port = nodes[external[j].node].host->get_ports()[external[j].port];
+    if (port.type == AudioType) {
+      float* buf = &audio[j * block_size];
+      port.buffer = buf;
+      for (uint32_t f = 0; port.direction == InputPort && f < block_size; ++f) {
+	seed = seed * 1664525 + 1013904223;
+	buf[f] = 0.5f * int32_t(seed) / 2147483648.0f;
+      }
+    }
+    else if (port.direction == InputPort)
+      midi.push_back(static_cast<LV2_Event_Buffer*>(port.buffer));
+  }
+  graph.activate();
+  
+  uint64_t warmup = m_rate / 4;
+  uint64_t calls = (uint64_t(m_seconds * m_rate) + block_size - 1) / 
+    block_size;
+  make_events(warmup + calls * block_size + block_size);
+  
+  vector<unsigned> counts;
+  for (unsigned t = 1; t < max_threads; t *= 2)
+    counts.push_back(t);
+  counts.push_back(max_threads);
+  
+  os<<fixed<<setprecision(1);
+  double single = 0;
+  for (unsigned k = 0; k < counts.size(); ++k) {
+    
+    GraphScheduler scheduler(graph, counts[k]);
+    scheduler.start();
+    
+    uint64_t frame = 0;
+    size_t next = 0;
+    for ( ; frame < warmup; frame += block_size) {
+      write_events(midi, frame, block_size, next);
+      scheduler.run(block_size);
+      graph.run_main();
+    }
+    
+    m_times.resize(calls);
+    uint64_t total = 0;
+    for (uint64_t c = 0; c < calls; ++c, frame += block_size) {
+      write_events(midi, frame, block_size, next);
+      uint64_t t0 = now();
+      scheduler.run(block_size);
+      uint64_t t1 = now();
+      uint64_t t = t1 - t0;
+      m_times[c] = (t > m_timer_overhead ? t - m_timer_overhead : 0);
+      total += m_times[c];
+      graph.run_main();
+    }
+    scheduler.stop();
+    
+    double mean = double(total) / calls;
+    uint64_t p50, p99, max;
+    get_percentiles(calls, p50, p99, max);
+    if (k == 0)
+      single = mean;
+    
+    os<<"graph file="<<filename<<" threads="<<scheduler.get_threads()
+      <<" size="<<block_size<<" calls="<<calls
+      <<" ns_per_call="<<mean
+      <<" p50_ns="<<p50<<" p99_ns="<<p99<<" max_ns="<<max
+      <<" steals="<<scheduler.get_steals()
+      <<" speedup="<<setprecision(2)<<(mean > 0 ? single / mean : 0)
+      <<setprecision(1)<<endl;
+  }
+  
+  graph.deactivate();
+  
+  return true;
+}
+
+
+void Benchmark::write_header(std::ostream& os) const {
+  os<<"# rate="<<m_rate<<" seconds="<<m_seconds
+    <<" midi="<<(m_input == Chords ? "chords" : "notes")
+    <<" timer_ns="<<m_timer_overhead<<endl;
+}
+
+
+void Benchmark::make_events(uint64_t frames) {
+  
+  m_events.clear();
+  
+  // four note chords that change every half second
+  if (m_input == Chords) {
+    static const unsigned char chord[] = { 48, 55, 64, 71 };
+    uint64_t period = m_rate / 2;
+    for (uint64_t k = 0; k * period < frames; ++k) {
+      unsigned char root = k % 12;
+      for (unsigned j = 0; j < 4; ++j) {
+	add_event(m_events, k * period, 0x90, chord[j] + root, 100);
+	add_event(m_events, (k + 1) * period - 1, 0x80, chord[j] + root, 64);
+      }
+    }
+  }
+  
+  // a new 50 ms note every millisecond
+  else {
+    uint64_t period = m_rate / 1000;
+    uint64_t length = m_rate / 20;
+    if (period == 0)
+      period = 1;
+    for (uint64_t k = 0; k * period < frames; ++k) {
+      unsigned char key = 36 + (k * 7) % 60;
+      add_event(m_events, k * period, 0x90, key, 100);
+      add_event(m_events, k * period + length, 0x80, key, 64);
+    }
+  }
+  
+  stable_sort(m_events.begin(), m_events.end(), &earlier);
+}
+
+
+void Benchmark::write_events(const std::vector<LV2_Event_Buffer*>& buffers,
+			     uint64_t frame, uint32_t nframes, 
+			     size_t& next) const {
+  
+  uint64_t end = frame + nframes;
+  size_t last = next;
+  while (last < m_events.size() && m_events[last].frame < end)
+    ++last;
+  
+  for (unsigned j = 0; j < buffers.size(); ++j) {
+    lv2_event_buffer_reset(buffers[j], LV2_EVENT_AUDIO_STAMP, 
+			   buffers[j]->data);
+    LV2_Event_Iterator iter;
+    lv2_event_begin(&iter, buffers[j]);
+    for (size_t k = next; k < last; ++k) {
+      const MidiFileEvent& e = m_events[k];
+      uint32_t offset = e.frame > frame ? uint32_t(e.frame - frame) : 0;
+      if (!lv2_event_write(&iter, offset, 0, URIMap::MidiEvent, 
+			   e.data.size(), &e.data[0]))
+	break;
+    }
+  }
+  
+  next = last;
+}
+
+
+void Benchmark::get_percentiles(uint64_t calls, uint64_t& p50, 
+				uint64_t& p99, uint64_t& max) {
+  nth_element(m_times.begin(), m_times.begin() + calls / 2, 
+	      m_times.begin() + calls);
+  p50 = m_times[calls / 2];
+  nth_element(m_times.begin(), m_times.begin() + calls * 99 / 100, 
+	      m_times.begin() + calls);
+  p99 = m_times[calls * 99 / 100];
+  max = *max_element(m_times.begin(), m_times.begin() + calls);
+}
+
+
+uint64_t Benchmark::now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
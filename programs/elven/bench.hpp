@@ -0,0 +1,106 @@
+/****************************************************************************
+    
+    bench.hpp - Benchmarking of plugins without JACK
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <lv2_event.h>
+
+#include "midifile.hpp"
+
+
+/** This class measures how long a plugin takes to run, for all block sizes
+    that are powers of two from 1 to MaxBlock. The audio inputs get white
+    noise and the default MIDI input gets either sustained chords or a 
+    dense stream of short notes. The results are written as lines of 
+    "key=value" pairs, one "block" line per block size and a "fit" line
+    with the per-call overhead and the cost per frame from a least squares
+    fit of the call times against the block size. 
+    
+    A plugin graph can be measured too, with a fixed block size and 
+    different numbers of worker threads, to see how well it scales. */
+class Benchmark {
+public:
+  
+  /** The largest block size. */
+  static const uint32_t MaxBlock = 8192;
+  
+  /** The kinds of MIDI input. */
+  enum MidiInput {
+    Chords,
+    Notes
+  };
+  
+  /** Set up a benchmark that runs each block size for @c seconds seconds
+      of audio at @c rate. */
+  Benchmark(unsigned long rate, double seconds, MidiInput input);
+  
+  /** Benchmark a plugin and write the results. Returns false if the plugin
+      could not be loaded. */
+  bool run(const std::string& uri, std::ostream& os);
+  
+  /** Benchmark a plugin graph with 1, 2, 4... up to @c max_threads worker
+      threads and write one "graph" line per thread count. All external
+      MIDI inputs get the same events. Returns false if the graph could 
+      not be loaded. */
+  bool run_graph(const std::string& filename, unsigned max_threads,
+		 uint32_t block_size, std::ostream& os);
+  
+  /** Write a comment line with the settings. */
+  void write_header(std::ostream& os) const;
+  
+protected:
+  
+  /** Generate the MIDI events for @c frames frames. */
+  void make_events(uint64_t frames);
+  
+  /** Write the events for the block that starts at @c frame to all the
+      buffers. @c next is the index of the first event that has not been
+      written yet. */
+  void write_events(const std::vector<LV2_Event_Buffer*>& buffers,
+		    uint64_t frame, uint32_t nframes, size_t& next) const;
+  
+  /** Find the median, 99th percentile and maximum of the first @c calls
+      times (this reorders them). */
+  void get_percentiles(uint64_t calls, uint64_t& p50, uint64_t& p99, 
+		       uint64_t& max);
+  
+  static uint64_t now();
+  
+  unsigned long m_rate;
+  double m_seconds;
+  MidiInput m_input;
+  uint64_t m_timer_overhead;
+  std::vector<MidiFileEvent> m_events;
+  std::vector<uint64_t> m_times;
+  
+};
+
+
+#endif
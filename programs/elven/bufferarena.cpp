@@ -0,0 +1,135 @@
+/****************************************************************************
+    
+    bufferarena.cpp - A single memory block for the port buffers of a plugin
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/mman.h>
+
+#include "bufferarena.hpp"
+#include "debug.hpp"
+
+
+using namespace std;
+
+
+BufferArena::BufferArena()
+  : m_memory(0),
+    m_size(0),
+    m_reserved(0),
+    m_locked(false) {
+
+}
+
+
+BufferArena::~BufferArena() {
+  clear();
+}
+
+
+size_t BufferArena::reserve(size_t size, size_t alignment) {
+  size_t offset = (m_reserved + alignment - 1) & ~(alignment - 1);
+  m_reserved = offset + size;
+  return offset;
+}
+
+
+void BufferArena::new_group() {
+  m_reserved = (m_reserved + CacheLine - 1) & ~(CacheLine - 1);
+}
+
+
+bool BufferArena::allocate() {
+
+  if (m_memory) {
+    if (m_locked)
+      munlock(m_memory, m_size);
+    free(m_memory);
+    m_memory = 0;
+    m_locked = false;
+  }
+
+  new_group();
+  m_size = m_reserved;
+  void* memory = 0;
+  if (posix_memalign(&memory, CacheLine, m_size ? m_size : CacheLine)) {
+    DBG0("Could not allocate "<<m_size<<" bytes for the port buffers");
+    m_size = 0;
+    return false;
+  }
+  m_memory = static_cast<char*>(memory);
+  memset(m_memory, 0, m_size);
+  DBG2("Allocated "<<m_size<<" bytes for the port buffers");
+
+  return true;
+}
+
+
+void* BufferArena::get(size_t offset) const {
+  return m_memory + offset;
+}
+
+
+size_t BufferArena::size() const {
+  return m_size;
+}
+
+
+bool BufferArena::lock() {
+  if (!m_memory || m_locked)
+    return m_locked;
+  if (mlock(m_memory, m_size)) {
+    DBG1("Could not lock the port buffers in memory: "<<strerror(errno));
+    return false;
+  }
+  m_locked = true;
+  return true;
+}
+
+
+bool BufferArena::is_locked() const {
+  return m_locked;
+}
+
+
+void BufferArena::swap(BufferArena& other) {
+  std::swap(m_memory, other.m_memory);
+  std::swap(m_size, other.m_size);
+  std::swap(m_reserved, other.m_reserved);
+  std::swap(m_locked, other.m_locked);
+}
+
+
+void BufferArena::clear() {
+  if (m_memory) {
+    if (m_locked)
+      munlock(m_memory, m_size);
+    free(m_memory);
+  }
+  m_memory = 0;
+  m_size = 0;
+  m_reserved = 0;
+  m_locked = false;
+}
@@ -0,0 +1,85 @@
+/****************************************************************************
+    
+    bufferarena.hpp - A single memory block for the port buffers of a plugin
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef BUFFERARENA_HPP
+#define BUFFERARENA_HPP
+
+#include <cstddef>
+
+
+/** A single block of memory that holds all the buffers for a plugin
+    instance. Space is first reserved in groups with reserve() and
+    new_group(), then allocate() allocates the whole block and get() turns
+    the reserved offsets into pointers.
+
+    The block itself and every group start on a cache line boundary, so
+    buffers in different groups never share a cache line. Within a group,
+    buffers are packed with the alignment given to reserve(). */
+class BufferArena {
+public:
+
+  /** The size of a cache line, and the alignment of every group. */
+  static const size_t CacheLine = 64;
+
+  BufferArena();
+  ~BufferArena();
+
+  /** Reserve @c size bytes aligned to @c alignment (which must be a power
+      of two no larger than CacheLine) and return the offset. */
+  size_t reserve(size_t size, size_t alignment);
+
+  /** Start a new group on a new cache line. */
+  void new_group();
+
+  /** Allocate the reserved memory, zeroed. Any earlier block is freed. */
+  bool allocate();
+
+  /** Returns a pointer to the memory at a reserved offset. */
+  void* get(size_t offset) const;
+
+  /** Returns the size of the block. */
+  size_t size() const;
+
+  /** Lock the block in memory so it will never be paged out. */
+  bool lock();
+
+  /** Returns true if the block is locked in memory. */
+  bool is_locked() const;
+
+  /** Exchange the blocks and reservations of two arenas. */
+  void swap(BufferArena& other);
+
+  /** Free the block and forget all reservations. */
+  void clear();
+
+protected:
+
+  char* m_memory;
+  size_t m_size;
+  size_t m_reserved;
+  bool m_locked;
+
+};
+
+
+#endif
@@ -24,11 +24,95 @@
 #ifndef DEBUG_HPP
 #define DEBUG_HPP
 
+#include <cstring>
 #include <iostream>
 #include <iomanip>
+#include <streambuf>
 #include <string>
-#include <map>
 #include <pthread.h>
+#include <unistd.h>
+
+
+/** The maximal length of a message that is logged from a realtime thread. */
+#define DEBUG_RECORD_TEXT 200
+
+/** The number of messages that can be waiting to be written. */
+#define DEBUG_QUEUE_SIZE 1024
+
+
+/** A message from a realtime thread, waiting to be written by the debug
+    thread. */
+struct DebugRecord {
+  const char* file;
+  const char* thread_prefix;
+  int line;
+  int level;
+  char text[DEBUG_RECORD_TEXT];
+};
+
+
+/** A bounded lock-free queue for DebugRecords. Any number of threads can 
+    write to it, but only the debug thread reads from it. */
+struct DebugQueue {
+  
+  DebugQueue() 
+    : write_pos(0), 
+      read_pos(0), 
+      dropped(0),
+      running(false) {
+    for (unsigned i = 0; i < DEBUG_QUEUE_SIZE; ++i)
+      cells[i].sequence = i;
+  }
+  
+  /** Reserve a record, or return 0 if the queue is full. The record must
+      be passed to commit() when it has been filled in. */
+  DebugRecord* reserve(unsigned& pos) {
+    pos = write_pos;
+    while (true) {
+      Cell& cell = cells[pos % DEBUG_QUEUE_SIZE];
+      int diff = int(cell.sequence - pos);
+      if (diff == 0) {
+	if (__sync_bool_compare_and_swap(&write_pos, pos, pos + 1))
+	  return &cell.record;
+      }
+      else if (diff < 0) {
+	__sync_fetch_and_add(&dropped, 1);
+	return 0;
+      }
+      pos = write_pos;
+    }
+  }
+  
+  void commit(unsigned pos) {
+    __sync_synchronize();
+    cells[pos % DEBUG_QUEUE_SIZE].sequence = pos + 1;
+  }
+  
+  /** Read the next record, if there is one. */
+  bool read(DebugRecord& record) {
+    Cell& cell = cells[read_pos % DEBUG_QUEUE_SIZE];
+    if (int(cell.sequence - (read_pos + 1)) < 0)
+      return false;
+    __sync_synchronize();
+    record = cell.record;
+    __sync_synchronize();
+    cell.sequence = read_pos + DEBUG_QUEUE_SIZE;
+    ++read_pos;
+    return true;
+  }
+  
+  struct Cell {
+    volatile unsigned sequence;
+    DebugRecord record;
+  };
+  
+  Cell cells[DEBUG_QUEUE_SIZE];
+  volatile unsigned write_pos;
+  unsigned read_pos;
+  volatile unsigned dropped;
+  volatile bool running;
+  pthread_t thread;
+};
 
 
 /** This structs holds information about the current debug state, such
@@ -47,15 +131,158 @@ struct DebugInfo {
     return dprefix;
   }
   
-  /** Returns a reference to the thread message prefix map. */
-  static inline std::map<pthread_t, std::string>& thread_prefix() {
-    static std::map<pthread_t, std::string> dthread_prefix;
+  /** Returns a reference to the message prefix for the calling thread. */
+  static inline const char*& thread_prefix() {
+    static __thread const char* dthread_prefix = "";
     return dthread_prefix;
   }
   
+  /** Returns a reference to a flag that should be set in realtime threads.
+      If the deferred debug thread is running, messages from those threads
+      are queued and written by the debug thread instead. */
+  static inline bool& realtime() {
+    static __thread bool drealtime = false;
+    return drealtime;
+  }
+  
+  /** Returns the queue for messages from realtime threads. */
+  static inline DebugQueue& queue() {
+    static DebugQueue dqueue;
+    return dqueue;
+  }
+  
+  /** Returns true if messages from the calling thread should be queued. */
+  static inline bool deferred() {
+    return realtime() && queue().running;
+  }
+  
+  /** Start the thread that writes the queued messages. */
+  static inline bool start_deferred() {
+    DebugQueue& q = queue();
+    if (q.running)
+      return true;
+    q.running = true;
+    if (pthread_create(&q.thread, 0, &DebugInfo::deferred_thread, 0)) {
+      q.running = false;
+      return false;
+    }
+    return true;
+  }
+  
+  /** Stop the debug thread, after writing all queued messages. */
+  static inline void stop_deferred() {
+    DebugQueue& q = queue();
+    if (q.running) {
+      q.running = false;
+      pthread_join(q.thread, 0);
+    }
+  }
+  
+  static inline void* deferred_thread(void*);
+  
+};
+
+
+/** A stream buffer that writes to a fixed-size array and silently drops 
+    anything that doesn't fit. */
+class DebugRecordBuf : public std::streambuf {
+public:
+  DebugRecordBuf(char* buffer, size_t size) {
+    setp(buffer, buffer + size - 1);
+  }
+  size_t length() const {
+    return pptr() - pbase();
+  }
+protected:
+  int overflow(int c) {
+    return traits_type::not_eof(c);
+  }
 };
 
+
+/** An output stream that formats a message into a DebugRecord without 
+    allocating any memory, and queues it for the debug thread when it is
+    destroyed. */
+class DebugRecordStream : public std::ostream {
+public:
+  
+  DebugRecordStream(const char* file, int line, int level)
+    : std::ostream(0),
+      m_record(DebugInfo::queue().reserve(m_pos)),
+      m_buf(m_record ? m_record->text : m_dummy, 
+	    m_record ? DEBUG_RECORD_TEXT : sizeof(m_dummy)) {
+    rdbuf(&m_buf);
+    if (m_record) {
+      m_record->file = file;
+      m_record->line = line;
+      m_record->level = level;
+      m_record->thread_prefix = DebugInfo::thread_prefix();
+    }
+  }
+  
+  ~DebugRecordStream() {
+    if (m_record) {
+      m_record->text[m_buf.length()] = '\0';
+      DebugInfo::queue().commit(m_pos);
+    }
+  }
+  
+protected:
   
+  unsigned m_pos;
+  DebugRecord* m_record;
+  char m_dummy[1];
+  DebugRecordBuf m_buf;
+  
+};
+
+
+/** Write the colour codes and the source location that start a message.
+    This is a plain inline function and not in an anonymous namespace since
+    DebugInfo::deferred_thread() uses it. */
+inline std::ostream& debug_print_prefix(std::ostream& os, const char* file,
+					int line, int level, 
+					const char* thread_prefix) {
+  if (level <= 0)
+    os<<"\033[31;1m";
+  else if (level == 1)
+    os<<"\033[33;1m";
+  else if (level == 2)
+    os<<"\033[32;1m";
+  else
+    os<<"\033[1m";
+  return os<<'['<<DebugInfo::prefix()
+	   <<thread_prefix
+	   <<std::setw(16)<<std::setfill(' ')
+	   <<file<<':'<<std::setw(3)<<std::setfill('0')
+	   <<line<<"] "<<"\033[0m";
+}
+
+
+void* DebugInfo::deferred_thread(void*) {
+  DebugQueue& q = queue();
+  DebugRecord record;
+  unsigned dropped = 0;
+  bool running = true;
+  while (running) {
+    running = q.running;
+    while (q.read(record)) {
+      debug_print_prefix(std::cerr, record.file, record.line, record.level,
+			 record.thread_prefix)<<record.text<<std::endl;
+    }
+    if (q.dropped != dropped) {
+      dropped = q.dropped;
+      debug_print_prefix(std::cerr, __FILE__, __LINE__, 1, "")
+	<<"Dropped messages from realtime threads, "<<dropped
+	<<" in total"<<std::endl;
+    }
+    if (running)
+      usleep(10000);
+  }
+  return 0;
+}
+
+
 #ifdef NDEBUG
 
 
@@ -72,28 +299,20 @@ struct DebugInfo {
 namespace {
   
   inline std::ostream& debug_print(const char* file, int line, int level) {
-    if (level <= 0)
-      std::cerr<<"\033[31;1m";
-    else if (level == 1)
-      std::cerr<<"\033[33;1m";
-    else if (level == 2)
-      std::cerr<<"\033[32;1m";
-    else
-      std::cerr<<"\033[1m";
-    return std::cerr<<'['<<DebugInfo::prefix()
-                    <<DebugInfo::thread_prefix()[pthread_self()]
-                    <<std::setw(16)<<std::setfill(' ')
-                    <<file<<':'<<std::setw(3)<<std::setfill('0')
-                    <<line<<"] "<<"\033[0m";
+    return debug_print_prefix(std::cerr, file, line, level,
+			      DebugInfo::thread_prefix());
   }
 
 }
 
-#define DBG0(A) do { if (DebugInfo::level() >= 0) debug_print(__FILE__, __LINE__, 0)<<A<<std::endl; } while (false)
-#define DBG1(A) do { if (DebugInfo::level() >= 1) debug_print(__FILE__, __LINE__, 1)<<A<<std::endl; } while (false)
-#define DBG2(A) do { if (DebugInfo::level() >= 2) debug_print(__FILE__, __LINE__, 2)<<A<<std::endl; } while (false)
-#define DBG3(A) do { if (DebugInfo::level() >= 3) debug_print(__FILE__, __LINE__, 3)<<A<<std::endl; } while (false)
-#define DBG4(A) do { if (DebugInfo::level() >= 4) debug_print(__FILE__, __LINE__, 4)<<A<<std::endl; } while (false)
+
+#define DBG_MESSAGE(L, A) do { if (DebugInfo::level() >= L) { if (DebugInfo::deferred()) { DebugRecordStream dbg_stream(__FILE__, __LINE__, L); dbg_stream<<A; } else debug_print(__FILE__, __LINE__, L)<<A<<std::endl; } } while (false)
+
+#define DBG0(A) DBG_MESSAGE(0, A)
+#define DBG1(A) DBG_MESSAGE(1, A)
+#define DBG2(A) DBG_MESSAGE(2, A)
+#define DBG3(A) DBG_MESSAGE(3, A)
+#define DBG4(A) DBG_MESSAGE(4, A)
 
 
 #endif
@@ -0,0 +1,532 @@
+/****************************************************************************
+    
+    graph.cpp - A graph of plugins that runs in a single process callback
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include <lv2_event_helpers.h>
+
+#include "debug.hpp"
+#include "graph.hpp"
+
+
+using namespace std;
+
+
+PluginGraph::PluginGraph(unsigned long frame_rate)
+  : m_rate(frame_rate),
+    m_shared_buffers(0),
+    m_parallel(false) {
+
+}
+
+
+PluginGraph::~PluginGraph() {
+  for (unsigned i = 0; i < m_nodes.size(); ++i)
+    delete m_nodes[i].host;
+}
+
+
+bool PluginGraph::load(const std::string& filename) {
+  
+  ifstream ifs(filename.c_str());
+  if (!ifs.good()) {
+    DBG0("Could not open "<<filename);
+    return false;
+  }
+  
+  string line;
+  unsigned lineno = 0;
+  while (getline(ifs, line)) {
+    
+    ++lineno;
+    istringstream iss(line);
+    string keyword;
+    if (!(iss>>keyword) || keyword[0] == '#')
+      continue;
+    
+    string a, b;
+    bool ok = false;
+    if (keyword == "plugin") {
+      if (iss>>a>>b)
+	ok = add_node(a, b);
+    }
+    else if (keyword == "connect") {
+      if (iss>>a>>b)
+	ok = connect(a, b);
+    }
+    else if (keyword == "set") {
+      Setting s;
+      if (iss>>a>>s.value && find_port(a, s.node, s.port)) {
+	const LV2Port& port = m_nodes[s.node].host->get_ports()[s.port];
+	if (port.type == ControlType && port.direction == InputPort) {
+	  m_settings.push_back(s);
+	  ok = true;
+	}
+	else
+	  DBG0(a<<" is not a control input");
+      }
+    }
+    else
+      DBG0("Unknown statement \""<<keyword<<"\"");
+    
+    if (!ok) {
+      DBG0("Error on line "<<lineno<<" in "<<filename);
+      return false;
+    }
+  }
+  
+  if (m_nodes.empty()) {
+    DBG0("There are no plugins in "<<filename);
+    return false;
+  }
+  
+  if (!sort_nodes())
+    return false;
+  find_external_ports();
+  
+  return true;
+}
+
+
+bool PluginGraph::allocate_buffers(uint32_t max_frames, 
+				   uint32_t event_capacity, bool parallel) {
+  
+  for (unsigned i = 0; i < m_nodes.size(); ++i) {
+    if (!m_nodes[i].host->allocate_buffers(event_capacity))
+      return false;
+  }
+  m_parallel = parallel;
+  if (!connect_buffers(max_frames))
+    return false;
+  
+  for (unsigned s = 0; s < m_settings.size(); ++s) {
+    m_nodes[m_settings[s].node].host->set_control(m_settings[s].port, 
+						  m_settings[s].value);
+  }
+  
+  return true;
+}
+
+
+bool PluginGraph::resize_buffers(uint32_t max_frames, 
+				 uint32_t event_capacity) {
+  for (unsigned i = 0; i < m_nodes.size(); ++i) {
+    if (!m_nodes[i].host->resize_buffers(event_capacity))
+      return false;
+  }
+  return connect_buffers(max_frames);
+}
+
+
+void PluginGraph::set_frame_rate(unsigned long frame_rate) {
+  m_rate = frame_rate;
+  for (unsigned i = 0; i < m_nodes.size(); ++i)
+    m_nodes[i].host->set_frame_rate(frame_rate);
+}
+
+
+bool PluginGraph::connect_buffers(uint32_t max_frames) {
+  
+  bool parallel = m_parallel;
+  
+  // find the nodes that read each audio output, and the last one of them
+  typedef pair<unsigned, uint32_t> PortID;
+  map<PortID, vector<unsigned> > readers;
+  map<PortID, unsigned> last_use;
+  for (unsigned c = 0; c < m_connections.size(); ++c) {
+    const Connection& con = m_connections[c];
+    const vector<LV2Port>& ports = m_nodes[con.from_node].host->get_ports();
+    if (ports[con.from_port].type != AudioType)
+      continue;
+    PortID id(con.from_node, con.from_port);
+    readers[id].push_back(con.to_node);
+    if (last_use.find(id) == last_use.end() || last_use[id] < con.to_node)
+      last_use[id] = con.to_node;
+  }
+  
+  // if independent nodes can run at the same time a buffer can only be
+  // reused by a node that depends on everyone who used it before
+  vector<vector<bool> > ancestor(m_nodes.size(), 
+				 vector<bool>(m_nodes.size(), false));
+  for (unsigned n = 0; n < m_nodes.size(); ++n) {
+    const vector<unsigned>& succ = m_nodes[n].successors;
+    for (unsigned j = 0; j < succ.size(); ++j) {
+      ancestor[succ[j]][n] = true;
+      for (unsigned a = 0; a < m_nodes.size(); ++a) {
+	if (ancestor[n][a])
+	  ancestor[succ[j]][a] = true;
+      }
+    }
+  }
+  
+  // give every connected audio output a buffer, and put it back in the
+  // free list after the last node that reads it (but not before that node
+  // has got buffers for its own outputs, plugins may not support in-place
+  // processing)
+  map<PortID, unsigned> buffer_index;
+  vector<unsigned> free_buffers;
+  vector<vector<unsigned> > users;
+  m_shared_buffers = 0;
+  for (unsigned n = 0; n < m_nodes.size(); ++n) {
+    map<PortID, unsigned>::const_iterator iter;
+    for (iter = last_use.begin(); iter != last_use.end(); ++iter) {
+      if (iter->first.first != n)
+	continue;
+      unsigned f;
+      for (f = 0; parallel && f < free_buffers.size(); ++f) {
+	const vector<unsigned>& u = users[free_buffers[f]];
+	unsigned k;
+	for (k = 0; k < u.size() && ancestor[n][u[k]]; ++k);
+	if (k == u.size())
+	  break;
+      }
+      unsigned b;
+      if (f < free_buffers.size()) {
+	b = free_buffers[f];
+	free_buffers.erase(free_buffers.begin() + f);
+      }
+      else {
+	b = m_shared_buffers++;
+	users.push_back(vector<unsigned>());
+      }
+      buffer_index[iter->first] = b;
+      users[b] = readers[iter->first];
+      users[b].push_back(n);
+    }
+    for (iter = last_use.begin(); iter != last_use.end(); ++iter) {
+      if (iter->second == n)
+	free_buffers.push_back(buffer_index[iter->first]);
+    }
+  }
+  
+  // the new block replaces the old one only if it can be allocated
+  BufferArena arena;
+  vector<size_t> offsets;
+  for (unsigned b = 0; b < m_shared_buffers; ++b) {
+    offsets.push_back(arena.reserve(max_frames * sizeof(float), 
+				    BufferArena::CacheLine));
+    arena.new_group();
+  }
+  if (!arena.allocate())
+    return false;
+  if (m_arena.is_locked())
+    arena.lock();
+  
+  DBG2("Using "<<m_shared_buffers<<" shared audio buffers for "
+       <<last_use.size()<<" connected audio outputs");
+  
+  // connect the ports to the buffers
+  for (unsigned n = 0; n < m_nodes.size(); ++n)
+    m_nodes[n].event_inputs.clear();
+  for (unsigned c = 0; c < m_connections.size(); ++c) {
+    const Connection& con = m_connections[c];
+    vector<LV2Port>& from_ports = m_nodes[con.from_node].host->get_ports();
+    vector<LV2Port>& to_ports = m_nodes[con.to_node].host->get_ports();
+    if (from_ports[con.from_port].type == AudioType) {
+      void* buffer = 
+	arena.get(offsets[buffer_index[PortID(con.from_node, 
+						con.from_port)]]);
+      from_ports[con.from_port].buffer = buffer;
+      to_ports[con.to_port].buffer = buffer;
+      m_nodes[con.from_node].host->set_buffer(con.from_port, buffer);
+      m_nodes[con.to_node].host->set_buffer(con.to_port, buffer);
+    }
+    
+    // the worker thread of the plugin owns the message context buffers
+    else if (from_ports[con.from_port].context != AudioContext ||
+	     to_ports[con.to_port].context != AudioContext) {
+      DBG1("Ignoring the connection to "<<to_ports[con.to_port].symbol
+	   <<", message context ports can't be connected");
+    }
+    
+    else {
+      EventCopy ec;
+      ec.from = 
+	static_cast<LV2_Event_Buffer*>(from_ports[con.from_port].buffer);
+      ec.to = static_cast<LV2_Event_Buffer*>(to_ports[con.to_port].buffer);
+      m_nodes[con.to_node].event_inputs.push_back(ec);
+    }
+  }
+  
+  for (unsigned n = 0; n < m_nodes.size(); ++n) {
+    m_nodes[n].event_outputs.clear();
+    const vector<LV2Port>& ports = m_nodes[n].host->get_ports();
+    for (unsigned p = 0; p < ports.size(); ++p) {
+      if (ports[p].type == MidiType && ports[p].direction == OutputPort &&
+	  ports[p].context == AudioContext)
+	m_nodes[n].event_outputs.
+	  push_back(static_cast<LV2_Event_Buffer*>(ports[p].buffer));
+    }
+  }
+  
+  // the old block is freed when arena goes out of scope
+  m_arena.swap(arena);
+  
+  return true;
+}
+
+
+void PluginGraph::activate() {
+  m_arena.lock();
+  for (unsigned n = 0; n < m_nodes.size(); ++n)
+    m_nodes[n].host->activate();
+}
+
+
+void PluginGraph::deactivate() {
+  for (unsigned n = 0; n < m_nodes.size(); ++n)
+    m_nodes[n].host->deactivate();
+}
+
+
+void PluginGraph::run(uint32_t nframes) {
+  for (unsigned n = 0; n < m_nodes.size(); ++n)
+    run_node(n, nframes);
+}
+
+
+void PluginGraph::run_node(unsigned n, uint32_t nframes) {
+  Node& node = m_nodes[n];
+  for (unsigned j = 0; j < node.event_outputs.size(); ++j) {
+    LV2_Event_Buffer* buf = node.event_outputs[j];
+    lv2_event_buffer_reset(buf, LV2_EVENT_AUDIO_STAMP, buf->data);
+  }
+  for (unsigned j = 0; j < node.event_inputs.size(); ++j)
+    copy_events(node.event_inputs[j].from, node.event_inputs[j].to);
+  node.host->run(nframes);
+}
+
+
+void PluginGraph::run_main() {
+  for (unsigned n = 0; n < m_nodes.size(); ++n)
+    m_nodes[n].host->run_main();
+}
+
+
+const std::vector<PluginGraph::Node>& PluginGraph::get_nodes() const {
+  return m_nodes;
+}
+
+
+const std::vector<PluginGraph::ExternalPort>& 
+PluginGraph::get_external_ports() const {
+  return m_external;
+}
+
+
+unsigned PluginGraph::get_shared_buffers() const {
+  return m_shared_buffers;
+}
+
+
+bool PluginGraph::add_node(const std::string& name, const std::string& uri) {
+  
+  if (name.find('.') != string::npos) {
+    DBG0("Plugin names can not contain '.'");
+    return false;
+  }
+  for (unsigned n = 0; n < m_nodes.size(); ++n) {
+    if (m_nodes[n].name == name) {
+      DBG0("There is already a plugin called "<<name);
+      return false;
+    }
+  }
+  
+  Node node;
+  node.name = name;
+  node.dependencies = 0;
+  node.host = new LV2Host(uri, m_rate);
+  if (!node.host->is_valid()) {
+    DBG0("Could not load the plugin "<<uri);
+    delete node.host;
+    return false;
+  }
+  m_nodes.push_back(node);
+  
+  return true;
+}
+
+
+bool PluginGraph::find_port(const std::string& spec, unsigned& node, 
+			    uint32_t& port) {
+  string::size_type dot = spec.find('.');
+  if (dot == string::npos) {
+    DBG0("\""<<spec<<"\" is not of the form PLUGIN.SYMBOL");
+    return false;
+  }
+  string name = spec.substr(0, dot);
+  string symbol = spec.substr(dot + 1);
+  for (node = 0; node < m_nodes.size(); ++node) {
+    if (m_nodes[node].name != name)
+      continue;
+    const vector<LV2Port>& ports = m_nodes[node].host->get_ports();
+    for (port = 0; port < ports.size(); ++port) {
+      if (ports[port].symbol == symbol)
+	return true;
+    }
+    DBG0("The plugin "<<name<<" has no port called "<<symbol);
+    return false;
+  }
+  DBG0("There is no plugin called "<<name);
+  return false;
+}
+
+
+bool PluginGraph::connect(const std::string& from, const std::string& to) {
+  
+  Connection c;
+  if (!find_port(from, c.from_node, c.from_port) ||
+      !find_port(to, c.to_node, c.to_port))
+    return false;
+  
+  const LV2Port& out = m_nodes[c.from_node].host->get_ports()[c.from_port];
+  const LV2Port& in = m_nodes[c.to_node].host->get_ports()[c.to_port];
+  if (out.direction != OutputPort || in.direction != InputPort) {
+    DBG0("Can only connect outputs to inputs");
+    return false;
+  }
+  if (out.type != in.type || (in.type != AudioType && in.type != MidiType)) {
+    DBG0("Can only connect audio ports to audio ports and MIDI ports to "
+	 "MIDI ports");
+    return false;
+  }
+  if (c.from_node == c.to_node) {
+    DBG0("Can not connect a plugin to itself");
+    return false;
+  }
+  for (unsigned i = 0; i < m_connections.size(); ++i) {
+    if (m_connections[i].to_node == c.to_node && 
+	m_connections[i].to_port == c.to_port) {
+      DBG0(to<<" is already connected");
+      return false;
+    }
+  }
+  
+  m_connections.push_back(c);
+  return true;
+}
+
+
+bool PluginGraph::sort_nodes() {
+  
+  // Kahn's algorithm
+  vector<unsigned> incoming(m_nodes.size(), 0);
+  for (unsigned c = 0; c < m_connections.size(); ++c)
+    ++incoming[m_connections[c].to_node];
+  vector<unsigned> order;
+  vector<bool> done(m_nodes.size(), false);
+  while (order.size() < m_nodes.size()) {
+    unsigned n;
+    for (n = 0; n < m_nodes.size(); ++n) {
+      if (!done[n] && incoming[n] == 0)
+	break;
+    }
+    if (n == m_nodes.size()) {
+      DBG0("The plugin graph has a cycle");
+      return false;
+    }
+    done[n] = true;
+    order.push_back(n);
+    for (unsigned c = 0; c < m_connections.size(); ++c) {
+      if (m_connections[c].from_node == n)
+	--incoming[m_connections[c].to_node];
+    }
+  }
+  
+  // put the nodes in that order and renumber everything
+  vector<unsigned> position(m_nodes.size());
+  vector<Node> nodes;
+  for (unsigned i = 0; i < order.size(); ++i) {
+    position[order[i]] = i;
+    nodes.push_back(m_nodes[order[i]]);
+  }
+  m_nodes.swap(nodes);
+  for (unsigned c = 0; c < m_connections.size(); ++c) {
+    m_connections[c].from_node = position[m_connections[c].from_node];
+    m_connections[c].to_node = position[m_connections[c].to_node];
+  }
+  for (unsigned s = 0; s < m_settings.size(); ++s)
+    m_settings[s].node = position[m_settings[s].node];
+  
+  // the dependencies between the nodes, for parallel scheduling
+  for (unsigned n = 0; n < m_nodes.size(); ++n) {
+    m_nodes[n].successors.clear();
+    m_nodes[n].dependencies = 0;
+  }
+  for (unsigned c = 0; c < m_connections.size(); ++c) {
+    vector<unsigned>& succ = m_nodes[m_connections[c].from_node].successors;
+    unsigned to = m_connections[c].to_node;
+    if (find(succ.begin(), succ.end(), to) == succ.end()) {
+      succ.push_back(to);
+      ++m_nodes[to].dependencies;
+    }
+  }
+  
+  for (unsigned n = 0; n < m_nodes.size(); ++n)
+    DBG2("Plugin "<<n<<": "<<m_nodes[n].name);
+  
+  return true;
+}
+
+
+void PluginGraph::find_external_ports() {
+  m_external.clear();
+  for (unsigned n = 0; n < m_nodes.size(); ++n) {
+    const vector<LV2Port>& ports = m_nodes[n].host->get_ports();
+    for (uint32_t p = 0; p < ports.size(); ++p) {
+      if (ports[p].type != AudioType && ports[p].type != MidiType)
+	continue;
+      bool connected = false;
+      for (unsigned c = 0; c < m_connections.size() && !connected; ++c) {
+	const Connection& con = m_connections[c];
+	connected = ((con.from_node == n && con.from_port == p) ||
+		     (con.to_node == n && con.to_port == p));
+      }
+      if (!connected) {
+	ExternalPort e;
+	e.node = n;
+	e.port = p;
+	e.name = m_nodes[n].name + "." + ports[p].symbol;
+	m_external.push_back(e);
+      }
+    }
+  }
+}
+
+
+void PluginGraph::copy_events(const LV2_Event_Buffer* from, 
+			      LV2_Event_Buffer* to) {
+  if (from->size > to->capacity) {
+    lv2_event_buffer_reset(to, from->stamp_type, to->data);
+    return;
+  }
+  memcpy(to->data, from->data, from->size);
+  to->stamp_type = from->stamp_type;
+  to->event_count = from->event_count;
+  to->size = from->size;
+}
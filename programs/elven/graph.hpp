@@ -0,0 +1,177 @@
+/****************************************************************************
+    
+    graph.hpp - A graph of plugins that runs in a single process callback
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef GRAPH_HPP
+#define GRAPH_HPP
+
+#include <string>
+#include <vector>
+
+#include <lv2_event.h>
+
+#include "bufferarena.hpp"
+#include "lv2host.hpp"
+
+
+/** A set of plugin instances with connections between their audio and 
+    MIDI ports, loaded from a text file with one statement per line:
+    
+    @code
+    # comment
+    plugin NAME URI
+    connect NAME.SYMBOL NAME.SYMBOL
+    set NAME.SYMBOL VALUE
+    @endcode
+    
+    The plugins are run in topological order. Audio connections share 
+    buffers that are only used inside the graph, and a buffer is reused as
+    soon as the last plugin that reads it has run, so the number of buffers
+    is the largest number of signals that are alive at the same time and
+    not the number of connections. MIDI connections are made by copying the
+    event buffer of the output to the input just before the reading plugin
+    runs. An input can only have one connection. All audio and MIDI ports
+    that are not connected inside the graph are external ports, and it is 
+    up to the caller to give them buffers. */
+class PluginGraph {
+public:
+  
+  /** A port that is not connected inside the graph. */
+  struct ExternalPort {
+    unsigned node;
+    uint32_t port;
+    std::string name;
+  };
+  
+  /** An event buffer that is copied to an input before a node runs. */
+  struct EventCopy {
+    LV2_Event_Buffer* from;
+    LV2_Event_Buffer* to;
+  };
+  
+  /** A plugin instance in the graph. */
+  struct Node {
+    std::string name;
+    LV2Host* host;
+    std::vector<EventCopy> event_inputs;
+    std::vector<LV2_Event_Buffer*> event_outputs;
+    /** The nodes that read the outputs of this node. */
+    std::vector<unsigned> successors;
+    /** The number of nodes whose outputs this node reads. */
+    unsigned dependencies;
+  };
+  
+  PluginGraph(unsigned long frame_rate);
+  ~PluginGraph();
+  
+  /** Load the plugins and connections from a graph file and sort the 
+      plugins in the order they should run. */
+  bool load(const std::string& filename);
+  
+  /** Allocate the port buffers of all plugins and the shared audio buffers
+      for the connections, with room for @c max_frames frames. This must
+      be done before the graph is activated. If @c parallel is true 
+      buffers are only reused in ways that are safe when independent 
+      nodes run at the same time. */
+  bool allocate_buffers(uint32_t max_frames, uint32_t event_capacity,
+			bool parallel = false);
+  
+  /** Allocate new port buffers and shared audio buffers for periods of 
+      @c max_frames frames, keeping the control values. This is meant to
+      be called when the JACK period size changes, while the graph is not
+      running. */
+  bool resize_buffers(uint32_t max_frames, uint32_t event_capacity);
+  
+  /** Replace all plugin instances with instances that run at 
+      @c frame_rate. See LV2Host::set_frame_rate(). */
+  void set_frame_rate(unsigned long frame_rate);
+  
+  /** Activate all plugins. */
+  void activate();
+  
+  /** Deactivate all plugins. */
+  void deactivate();
+  
+  /** Run all plugins in order. The external ports must have buffers. */
+  void run(uint32_t nframes);
+  
+  /** Run a single node. The nodes it depends on must have been run in the
+      same cycle. */
+  void run_node(unsigned n, uint32_t nframes);
+  
+  /** Call LV2Host::run_main() for all plugins. */
+  void run_main();
+  
+  /** Returns the plugins, in the order they are run. */
+  const std::vector<Node>& get_nodes() const;
+  
+  /** Returns the ports that are not connected inside the graph. */
+  const std::vector<ExternalPort>& get_external_ports() const;
+  
+  /** Returns the number of shared audio buffers. */
+  unsigned get_shared_buffers() const;
+  
+protected:
+  
+  struct Connection {
+    unsigned from_node;
+    uint32_t from_port;
+    unsigned to_node;
+    uint32_t to_port;
+  };
+  
+  struct Setting {
+    unsigned node;
+    uint32_t port;
+    float value;
+  };
+  
+  bool add_node(const std::string& name, const std::string& uri);
+  
+  bool find_port(const std::string& spec, unsigned& node, uint32_t& port);
+  
+  bool connect(const std::string& from, const std::string& to);
+  
+  bool sort_nodes();
+  
+  /** Give the connected audio ports shared buffers and set up the event
+      copies for the MIDI connections. */
+  bool connect_buffers(uint32_t max_frames);
+  
+  void find_external_ports();
+  
+  static void copy_events(const LV2_Event_Buffer* from, 
+			  LV2_Event_Buffer* to);
+  
+  unsigned long m_rate;
+  std::vector<Node> m_nodes;
+  std::vector<Connection> m_connections;
+  std::vector<Setting> m_settings;
+  std::vector<ExternalPort> m_external;
+  BufferArena m_arena;
+  unsigned m_shared_buffers;
+  bool m_parallel;
+  
+};
+
+
+#endif
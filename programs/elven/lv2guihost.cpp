@@ -30,6 +30,7 @@
 
 #include "debug.hpp"
 #include "lv2guihost.hpp"
+#include "urimap.hpp"
 
 
 using namespace std;
@@ -230,15 +231,11 @@ void LV2GUIHost::_save_program(LV2UI_Controller ctrl, uint32_t number,
 
 uint32_t LV2GUIHost::uri_to_id(LV2_URI_Map_Callback_Data callback_data,
 			       const char* umap, const char* uri) {
+  // the event port format is 1 in the GUI context, _write_port() expects
+  // that, everything else comes from the map that the plugin host uses
   if (umap && !strcmp(umap, "http://lv2plug.in/ns/extensions/ui") &&
       !strcmp(uri, "http://lv2plug.in/ns/extensions/ui#Events"))
     return 1;
-  else if (umap && !strcmp(umap, LV2_EVENT_URI)) {
-    if (!strcmp(uri, "http://lv2plug.in/ns/ext/midi#MidiEvent"))
-      return 1;
-    else if (!strcmp(uri, "http://lv2plug.in/ns/ext/osc#OscEvent"))
-      return 2;
-  }
-  return 0;
+  return URIMap::get().map(uri);
 }
 
@@ -27,9 +27,13 @@
 #include <cstring>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -43,6 +47,8 @@
 #include "lv2host.hpp"
 #include "debug.hpp"
 #include "midiutils.hpp"
+#include "trace.hpp"
+#include "urimap.hpp"
 
 
 using namespace std;
@@ -52,6 +58,48 @@ using namespace sigc;
 
 std::string LV2Host::m_user_data_bundle(Glib::getenv("HOME") + 
 					"/.lv2/elven_user_data.lv2");
+std::map<std::string, LV2Host::SharedData*> LV2Host::m_shared_data;
+pthread_mutex_t LV2Host::m_shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+namespace {
+  
+  /** Write a file by writing a temporary file next to it and renaming that,
+      so anyone who reads the file sees either the old or the new version,
+      never a partly written one. */
+  bool write_file_atomically(const std::string& path, 
+			     const std::string& contents) {
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      DBG0("Could not open "<<tmp<<" for writing: "<<strerror(errno));
+      return false;
+    }
+    const char* data = contents.data();
+    size_t left = contents.size();
+    while (left > 0) {
+      ssize_t n = write(fd, data, left);
+      if (n == -1 && errno == EINTR)
+	continue;
+      if (n == -1) {
+	DBG0("Could not write "<<tmp<<": "<<strerror(errno));
+	close(fd);
+	unlink(tmp.c_str());
+	return false;
+      }
+      data += n;
+      left -= n;
+    }
+    if (fsync(fd) == -1 || close(fd) == -1 || 
+	rename(tmp.c_str(), path.c_str()) == -1) {
+      DBG0("Could not replace "<<path<<": "<<strerror(errno));
+      unlink(tmp.c_str());
+      return false;
+    }
+    return true;
+  }
+  
+}
 
 
 LV2Host::LV2Host(const string& uri, unsigned long frame_rate) 
@@ -61,10 +109,42 @@ LV2Host::LV2Host(const string& uri, unsigned long frame_rate)
     m_desc(0),
     m_sr_desc(0),
     m_msg_desc(0),
+    m_active(false),
     m_ports_used(0),
+    m_skipped_connects(0),
     m_midimap(128, -1),
-    m_ports_updated(false),
-    m_next_free_preset(0) {
+    m_event_stage(16384),
+    m_event_stage_used(0),
+    m_merge_buffer(0),
+    m_change_stage(ChangeStageSize),
+    m_change_stage_used(0),
+    m_min_segment(32),
+    m_midi_control_ramp(0),
+    m_program_table(0),
+    m_run_cycles(0),
+    m_program_request(0),
+    m_midi_bank(0),
+    m_midi_program(0),
+    m_program_changed(0),
+    m_trace_buffer(0),
+    m_worker_running(false),
+    m_message_requested(0),
+    m_worker_quit(0),
+    m_message_changes_lost(0),
+    m_interrupted_job(0),
+    m_pending_jobs(0),
+    m_pause_request(0),
+    m_pause_ack(0),
+    m_offline(false),
+    m_snapshot_seq(0),
+    m_notification_fd(-1),
+    m_wakeup_pending(0),
+    m_port_changes_lost(0),
+    m_lost_port_changes(0),
+    m_dropped_events(0),
+    m_frame(0),
+    m_next_free_preset(0),
+    m_shared(0) {
 
   DBG2("Creating user data bundle...");
   if (!create_user_data_bundle())
@@ -72,9 +152,9 @@ LV2Host::LV2Host(const string& uri, unsigned long frame_rate)
 
   DBG2("Creating plugin loader...");
   
-  pthread_mutex_init(&m_mutex, 0);
-  
-  sem_init(&m_notification_sem, 0, 0);
+  m_notification_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_notification_fd == -1)
+    DBG1("Could not create eventfd: "<<strerror(errno));
   
   m_urimap_host_desc.callback_data = 0;
   m_urimap_host_desc.uri_to_id = &LV2Host::uri_to_id;
@@ -85,35 +165,31 @@ LV2Host::LV2Host(const string& uri, unsigned long frame_rate)
   m_context_host_desc.host_handle = this;
   m_context_host_desc.request_run = &LV2Host::request_run;
   
-  // get the directories to look in
-  vector<string> search_dirs = get_search_dirs();
-  
-  // iterate over all directories
-  scan_manifests(search_dirs, mem_fun(*this, &LV2Host::match_uri));
-  
-  // if we didn't find it, assume that we were given a partial URI
-  // XXX lots of scanning here, we shouldn't need to do 3 passes
-  if (m_rdffiles.size() == 0) {
-    DBG1("Did not find a complete match, looking for partial match");
-    if (scan_manifests(search_dirs, 
-		       mem_fun(*this, &LV2Host::match_partial_uri))) {
-      DBG2("Found matching URI, re-scanning manifests");
-      scan_manifests(search_dirs, mem_fun(*this, &LV2Host::match_uri));
-    }
-  }
+  sem_init(&m_worker_sem, 0, 0);
   
   load_plugin();
 }
   
   
 LV2Host::~LV2Host() {
+  stop_worker();
+  sem_destroy(&m_worker_sem);
+  delete m_interrupted_job;
+  StateJob* job;
+  while (m_state_jobs.read(&job) == 1)
+    delete job;
+  while (m_finished_jobs.read(&job) == 1)
+    delete job;
   if (m_handle) {
     DBG2("Destroying plugin instance");
     if (m_desc->cleanup)
       m_desc->cleanup(m_handle);
-    dlclose(m_libhandle);
-    sem_destroy(&m_notification_sem);
   }
+  release_shared_data();
+  delete m_program_table;
+  free(m_rt.memory);
+  if (m_notification_fd != -1)
+    close(m_notification_fd);
 }
 
 
@@ -128,18 +204,132 @@ void LV2Host::list_plugins() {
 }
 
 
+std::vector<std::string> LV2Host::get_bundle_plugins(const string& bundle) {
+  
+  vector<string> uris;
+  string dir = bundle;
+  if (dir.size() && dir[dir.size() - 1] != '/')
+    dir += "/";
+  
+  // parse
+  TurtleParser tp;
+  RDFData data;
+  if (!tp.parse_ttl_file(dir + "manifest.ttl", data)) {
+    DBG1("Could not parse "<<dir<<"manifest.ttl");
+    return uris;
+  }
+  
+  // query
+  Namespace lv2("<http://lv2plug.in/ns/lv2core#>");
+  Variable uriref;
+  vector<QueryResult> qr = select(uriref)
+    .where(uriref, rdf("type"), lv2("Plugin"))
+    .run(data);
+  for (unsigned i = 0; i < qr.size(); ++i) {
+    const string& name = qr[i][uriref]->name;
+    if (name.size() > 2 && name[0] == '<')
+      uris.push_back(name.substr(1, name.size() - 2));
+  }
+  
+  return uris;
+}
+
+
 void LV2Host::run_main() {
-  if (!sem_trywait(&m_notification_sem)) {
-    DBG2("Got notification from realtime thread about port change");
-    while (!sem_trywait(&m_notification_sem));
+  
+  trace_begin(TraceRunMain);
+  
+  // reset the wakeup before reading the changes, so we don't miss any
+  if (m_notification_fd != -1) {
+    eventfd_t count;
+    eventfd_read(m_notification_fd, &count);
+  }
+  m_wakeup_pending = 0;
+  __sync_synchronize();
+  
+  if (m_notify_pending.size() < m_ports.size()) {
+    m_notify_values.resize(m_ports.size(), 0);
+    m_notify_pending.resize(m_ports.size(), false);
+    m_notify_list.reserve(m_ports.size());
+  }
+  
+  // take back the finished state jobs
+  StateJob* job;
+  while (m_finished_jobs.read(&job) == 1)
+    finish_state_job(job);
+  
+  // a program change goes first, the port changes were probably made after
+  // it (it happens at the start of a block)
+  uint32_t program = __sync_lock_test_and_set(&m_program_changed, 0);
+  if (program)
+    finish_program((program & ~MidiProgramFlag) - 1, program & MidiProgramFlag);
+  
+  // collect the changes, only the last value for each port is sent
+  PortChange c;
+  while (m_port_changes.read(&c) == 1) {
+    DBG3("Port "<<c.port<<" changed to "<<c.value<<" at frame "<<c.frame);
+    // input ports change here when queue_control() changes are applied
+    if (m_ports[c.port].direction == InputPort)
+      m_ports[c.port].value = c.value;
+    m_notify_values[c.port] = c.value;
+    if (!m_notify_pending[c.port]) {
+      m_notify_pending[c.port] = true;
+      m_notify_list.push_back(c.port);
+    }
+  }
+  
+  // and the ones from the worker thread
+  while (m_message_changes.read(&c) == 1) {
+    DBG3("Message context port "<<c.port<<" changed to "<<c.value);
+    m_notify_values[c.port] = c.value;
+    if (!m_notify_pending[c.port]) {
+      m_notify_pending[c.port] = true;
+      m_notify_list.push_back(c.port);
+    }
+  }
+  if (__sync_fetch_and_and(&m_message_changes_lost, 0)) {
+    DBG1("Lost port changes from the worker thread");
     for (unsigned i = 0; i < m_ports.size(); ++i) {
-      if (m_ports[i].notify) {
-        // XXX this should only happen if the port value has actually changed
-        DBG2("Sending port event for output port "<<i);
-        signal_port_event(i, sizeof(float), 0, &m_ports[i].old_value);
+      if (m_ports[i].type == ControlType && 
+	  m_ports[i].direction == OutputPort && 
+	  m_ports[i].context == MessageContext) {
+	m_notify_values[i] = *static_cast<float*>(m_ports[i].buffer);
+	if (!m_notify_pending[i]) {
+	  m_notify_pending[i] = true;
+	  m_notify_list.push_back(i);
+	}
       }
     }
   }
+  
+  // if the ringbuffer overflowed we don't know which ports changed
+  if (__sync_fetch_and_and(&m_port_changes_lost, 0)) {
+    DBG1("Lost port changes from the realtime thread, updating all ports");
+    for (unsigned i = 0; i < m_ports.size(); ++i) {
+      if (m_ports[i].notify && m_ports[i].context == AudioContext) {
+	m_notify_values[i] = m_rt.old_values[i];
+	if (!m_notify_pending[i]) {
+	  m_notify_pending[i] = true;
+	  m_notify_list.push_back(i);
+	}
+      }
+    }
+  }
+  
+  for (unsigned i = 0; i < m_notify_list.size(); ++i) {
+    uint32_t p = m_notify_list[i];
+    DBG2("Sending port event for port "<<p);
+    m_notify_pending[p] = false;
+    signal_port_event(p, sizeof(float), 0, &m_notify_values[p]);
+  }
+  m_notify_list.clear();
+  
+  trace_end(TraceRunMain);
+}
+
+
+int LV2Host::get_notification_fd() const {
+  return m_notification_fd;
 }
 
 
@@ -165,156 +355,1233 @@ long LV2Host::get_default_midi_port() const {
 }
 
 
+unsigned long LV2Host::get_frame_rate() const {
+  return m_rate;
+}
+
+
+bool LV2Host::allocate_buffers(uint32_t event_capacity, 
+			       uint32_t audio_frames) {
+  
+  assert(m_handle);
+  
+  const size_t line = BufferArena::CacheLine;
+  vector<size_t> offsets(m_ports.size(), 0);
+  
+  // the new block replaces the old one only if it can be allocated, until
+  // then the ports still use the old buffers
+  BufferArena arena;
+  
+  // control ports are grouped by the thread that writes them: the realtime
+  // thread for audio context inputs, the plugin for outputs and the GUI
+  // thread for message context inputs
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type == ControlType && m_ports[i].direction == InputPort &&
+	m_ports[i].context == AudioContext)
+      offsets[i] = arena.reserve(sizeof(float), sizeof(float));
+  }
+  arena.new_group();
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type == ControlType && m_ports[i].direction == OutputPort)
+      offsets[i] = arena.reserve(sizeof(float), sizeof(float));
+  }
+  arena.new_group();
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type == ControlType && m_ports[i].direction == InputPort &&
+	m_ports[i].context != AudioContext)
+      offsets[i] = arena.reserve(sizeof(float), sizeof(float));
+  }
+  arena.new_group();
+  
+  // event buffers have the header on a line of its own, followed by the data
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type == MidiType)
+      offsets[i] = arena.reserve(line + event_capacity, line);
+  }
+  size_t merge_offset = arena.reserve(line + event_capacity, line);
+  
+  // scratch event buffers for running parts of a block
+  vector<size_t> segment_offsets(m_ports.size(), 0);
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type == MidiType && m_ports[i].context == AudioContext)
+      segment_offsets[i] = arena.reserve(line + event_capacity, line);
+  }
+  
+  // scratch audio buffers
+  if (audio_frames > 0) {
+    for (unsigned i = 0; i < m_ports.size(); ++i) {
+      if (m_ports[i].type == AudioType)
+	offsets[i] = arena.reserve(audio_frames * sizeof(float), line);
+    }
+  }
+  
+  if (!arena.allocate())
+    return false;
+  
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type == ControlType) {
+      m_ports[i].buffer = arena.get(offsets[i]);
+      *static_cast<float*>(m_ports[i].buffer) = m_ports[i].default_value;
+      m_ports[i].value = m_ports[i].default_value;
+    }
+    else if (m_ports[i].type == MidiType) {
+      LV2_Event_Buffer* buf = 
+	static_cast<LV2_Event_Buffer*>(arena.get(offsets[i]));
+      buf->capacity = event_capacity;
+      lv2_event_buffer_reset(buf, LV2_EVENT_AUDIO_STAMP, 
+			     reinterpret_cast<uint8_t*>(buf) + line);
+      m_ports[i].buffer = buf;
+    }
+    else if (m_ports[i].type == AudioType && audio_frames > 0)
+      m_ports[i].buffer = arena.get(offsets[i]);
+  }
+  
+  m_merge_buffer = static_cast<LV2_Event_Buffer*>(arena.get(merge_offset));
+  m_merge_buffer->capacity = event_capacity;
+  lv2_event_buffer_reset(m_merge_buffer, LV2_EVENT_AUDIO_STAMP, 
+			 reinterpret_cast<uint8_t*>(m_merge_buffer) + line);
+  
+  m_segment_events.assign(m_ports.size(), 0);
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type == MidiType && m_ports[i].context == AudioContext) {
+      LV2_Event_Buffer* buf = 
+	static_cast<LV2_Event_Buffer*>(arena.get(segment_offsets[i]));
+      buf->capacity = event_capacity;
+      lv2_event_buffer_reset(buf, LV2_EVENT_AUDIO_STAMP, 
+			     reinterpret_cast<uint8_t*>(buf) + line);
+      m_segment_events[i] = buf;
+    }
+  }
+  
+  // the old block is freed when arena goes out of scope
+  m_arena.swap(arena);
+  
+  return true;
+}
+
+
+bool LV2Host::resize_buffers(uint32_t event_capacity, uint32_t audio_frames) {
+  
+  assert(m_handle);
+  
+  // the worker thread writes the message context buffers
+  stop_worker();
+  
+  // the new control buffers start at the default values
+  vector<float> values(m_ports.size(), 0);
+  vector<float> main_values(m_ports.size(), 0);
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type == ControlType) {
+      values[i] = *static_cast<float*>(m_ports[i].buffer);
+      main_values[i] = m_ports[i].value;
+    }
+  }
+  
+  // if this fails the old buffers are still there and still connected
+  if (!allocate_buffers(event_capacity, audio_frames)) {
+    if (m_active)
+      start_worker();
+    return false;
+  }
+  
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type == ControlType) {
+      *static_cast<float*>(m_ports[i].buffer) = values[i];
+      m_ports[i].value = main_values[i];
+    }
+    if (m_ports[i].type != AudioType || audio_frames > 0)
+      m_rt.buffers[i] = m_ports[i].buffer;
+  }
+  DBG2("Resized the port buffers, "<<event_capacity<<" bytes per event "
+       <<"buffer");
+  
+  if (!m_active)
+    return true;
+  
+  // run() only reconnects the audio and event ports, so connect the rest
+  // here (the audio ports are reconnected when run() sees the new buffers)
+  m_arena.lock();
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type != AudioType) {
+      m_desc->connect_port(m_handle, i, m_rt.buffers[i]);
+      m_rt.connected[i] = m_rt.buffers[i];
+    }
+  }
+  start_worker();
+  
+  return true;
+}
+
+
+void LV2Host::set_frame_rate(unsigned long frame_rate) {
+  StateJob* job = new StateJob;
+  job->type = StateJob::Reinstantiate;
+  job->rate = frame_rate;
+  queue_state_job(job);
+}
+
+
 void LV2Host::activate() {
   assert(m_handle);
+  
+  m_arena.lock();
+  m_active = true;
+  
+  // connect all ports, run() will only reconnect the ones that change
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    m_desc->connect_port(m_handle, i, m_ports[i].buffer);
+    m_rt.buffers[i] = m_ports[i].buffer;
+    m_rt.connected[i] = m_ports[i].buffer;
+    if (m_ports[i].type == ControlType && m_ports[i].buffer)
+      m_rt.old_values[i] = *static_cast<float*>(m_ports[i].buffer);
+  }
+  
+  // both snapshots start with the current values
+  m_snapshots[0].assign(m_ports.size(), 0);
+  m_snapshots[1].assign(m_ports.size(), 0);
+  for (unsigned j = 0; j < m_rt.control_in.size(); ++j) {
+    uint32_t i = m_rt.control_in[j];
+    float value = *static_cast<float*>(m_rt.buffers[i]);
+    m_snapshots[0][i] = m_snapshots[1][i] = value;
+  }
+  
   DBG2("Activating plugin instance");
   if (m_desc->activate)
     m_desc->activate(m_handle);
+  
+  start_worker();
 }
 
 
 void LV2Host::run(unsigned long nframes) {
   
-  assert(m_handle);
+  assert(m_handle);
+  
+  // the main thread waits for this to be even before it deletes an old 
+  // program table
+  __sync_fetch_and_add(&m_run_cycles, 1);
+  
+  // the worker thread is calling save() or restore() in the plugin, which
+  // must not run at the same time as run(), so output silence until it's
+  // done (the inputs stay queued) - or wait for it if we're offline
+  unsigned pause = m_pause_request;
+  if (pause & 1) {
+    m_pause_ack = pause;
+    if (!m_offline) {
+      silence_outputs(nframes);
+      m_frame += nframes;
+      __sync_fetch_and_add(&m_run_cycles, 1);
+      return;
+    }
+    while (m_pause_request == pause)
+      usleep(500);
+    __sync_synchronize();
+  }
+  
+  // copy the control port values that have changed into the port buffers
+  bool inputs_changed = false;
+  trace_begin(TraceControls);
+  for (unsigned w = 0; w < m_dirty_controls.size(); ++w) {
+    if (!*static_cast<volatile uint32_t*>(&m_dirty_controls[w]))
+      continue;
+    uint32_t dirty = __sync_fetch_and_and(&m_dirty_controls[w], 0);
+    inputs_changed = inputs_changed || dirty;
+    while (dirty) {
+      unsigned i = 32 * w + __builtin_ctz(dirty);
+      dirty &= dirty - 1;
+      DBG3("Setting control input "<<i<<" to "<<m_rt.values[i]);
+      *static_cast<float*>(m_rt.buffers[i]) = m_rt.values[i];
+    }
+  }
+  trace_end(TraceControls);
+  
+  // switch programs, one from the MIDI input came after one from the main 
+  // thread
+  bool changed = false;
+  uint32_t request = __sync_lock_test_and_set(&m_program_request, 0);
+  if (request)
+    changed = apply_program(request - 1, false);
+  if (m_midi_program) {
+    changed = apply_program(m_midi_program - 1, true) || changed;
+    m_midi_program = 0;
+  }
+  
+  // add the events from other threads to the input event buffers
+  merge_queued_events(nframes);
+  
+  // if no controls change in this block the plugin is run for the whole
+  // block, otherwise it is split at the changes
+  size_t due = collect_control_changes(nframes);
+  changed = changed || (due > 0);
+  inputs_changed = inputs_changed || changed;
+  if (due == 0) {
+    
+    // only connect the ports whose buffers have changed (usually the audio
+    // ports, if JACK gives us new buffers)
+    size_t nports = m_ports.size();
+    for (size_t i = 0; i < nports; ++i) {
+      if (m_rt.connected[i] != m_rt.buffers[i]) {
+	m_desc->connect_port(m_handle, i, m_rt.buffers[i]);
+	m_rt.connected[i] = m_rt.buffers[i];
+      }
+      else
+	++m_skipped_connects;
+    }
+    
+    trace_begin(TraceRun);
+    m_desc->run(m_handle, nframes);
+    trace_end(TraceRun);
+  }
+  else
+    run_segments(nframes, due);
+  
+  // send the changed port values to the main thread
+  for (unsigned j = 0; j < m_rt.notify.size(); ++j) {
+    uint32_t i = m_rt.notify[j];
+    float value = *static_cast<float*>(m_rt.buffers[i]);
+    if (m_rt.old_values[i] != value) {
+      DBG3("Port "<<i<<" changed - notifying main thread");
+      PortChange c = { i, value, m_frame };
+      if (m_port_changes.write(&c) != 1) {
+	m_port_changes_lost = 1;
+	++m_lost_port_changes;
+      }
+      m_rt.old_values[i] = value;
+      changed = true;
+    }
+  }
+  m_frame += nframes;
+  if (inputs_changed)
+    publish_snapshot();
+  __sync_fetch_and_add(&m_run_cycles, 1);
+  
+  // wake up the main thread, unless it has been woken up already
+  if (changed && m_notification_fd != -1 &&
+      __sync_bool_compare_and_swap(&m_wakeup_pending, 0, 1))
+    eventfd_write(m_notification_fd, 1);
+}
+
+
+void LV2Host::deactivate() {
+  assert(m_handle);
+  DBG2("Skipped "<<m_skipped_connects<<" connect_port() calls");
+  stop_worker();
+  m_active = false;
+  DBG2("Deactivating the plugin instance");
+  if (m_desc->deactivate)
+    m_desc->deactivate(m_handle);
+}
+
+
+const LV2RTPorts& LV2Host::get_rt_ports() const {
+  return m_rt;
+}
+
+
+uint64_t LV2Host::get_skipped_connects() const {
+  return m_skipped_connects;
+}
+
+
+uint32_t LV2Host::get_dropped_events() const {
+  return m_dropped_events;
+}
+
+
+uint32_t LV2Host::get_lost_port_changes() const {
+  return m_lost_port_changes;
+}
+
+
+void LV2Host::set_control(uint32_t index, float value) {
+  if (index < m_ports.size() && m_ports[index].type == ControlType &&
+      m_ports[index].direction == InputPort) {
+    if (m_ports[index].context == AudioContext) {
+      // the value must be written before the dirty bit is set, the atomic
+      // operation works as a memory barrier
+      m_ports[index].value = value;
+      m_rt.values[index] = value;
+      __sync_fetch_and_or(&m_dirty_controls[index / 32], 1U << (index % 32));
+    }
+    else if (m_ports[index].context == MessageContext) {
+      m_ports[index].value = value;
+      m_message_values[index] = value;
+      __sync_fetch_and_or(&m_dirty_messages[index / 32], 1U << (index % 32));
+      message_run();
+    }
+    signal_port_event(index, sizeof(float), 0, &value);
+  }
+}
+
+
+bool LV2Host::queue_control(uint32_t index, float value, uint64_t frame) {
+  if (index < m_ports.size() && m_ports[index].type == ControlType &&
+      m_ports[index].direction == InputPort && 
+      m_ports[index].context == AudioContext) {
+    ControlChange c = { index, value, frame };
+    if (m_control_changes.write(&c) != 1) {
+      DBG1("The control change queue is full, dropping change for port "
+	   <<index);
+      return false;
+    }
+    return true;
+  }
+  DBG0("Trying to queue a control change for invalid port "<<index);
+  return false;
+}
+
+
+void LV2Host::set_min_segment(uint32_t frames) {
+  m_min_segment = (frames > 0 ? frames : 1);
+}
+
+
+void LV2Host::set_offline(bool offline) {
+  m_offline = offline;
+}
+
+
+void LV2Host::wait_for_state_jobs() {
+  
+  // a job can't be done if the worker isn't running, and it pauses the
+  // plugin, which is safe to acknowledge here since run() isn't running
+  while (m_pending_jobs && m_worker_running) {
+    unsigned pause = m_pause_request;
+    if (pause & 1)
+      m_pause_ack = pause;
+    usleep(500);
+  }
+  __sync_synchronize();
+}
+
+
+uint64_t LV2Host::get_frame() const {
+  return m_frame;
+}
+
+
+bool LV2Host::handle_midi_control(const unsigned char* data, uint32_t size,
+				  uint32_t offset) {
+  
+  if (size != 3 || (data[0] & 0xF0) != 0xB0 || m_midi_controls.empty())
+    return false;
+  const MidiControlTarget& t = 
+    m_midi_controls[128 * (data[0] & 0x0F) + (data[1] & 0x7F)];
+  if (t.port == -1)
+    return false;
+  
+  uint32_t port = t.port;
+  uint64_t frame = m_frame + offset;
+  float value = t.min + t.range * (data[2] & 0x7F) / 127.0f;
+  DBG3("Mapped CC event to port "<<port<<" at frame "<<frame);
+  
+  // the new value replaces the changes that were staged for later frames
+  // by an earlier controller event (the rest of its ramp), and a ramp 
+  // starts where the port will be at this frame
+  float start = *static_cast<float*>(m_rt.buffers[port]);
+  size_t used = 0;
+  for (size_t j = 0; j < m_change_stage_used; ++j) {
+    const ControlChange& c = m_change_stage[j];
+    if (c.port == port) {
+      if (c.frame > frame)
+	continue;
+      start = c.value;
+    }
+    m_change_stage[used++] = c;
+  }
+  m_change_stage_used = used;
+  
+  uint32_t steps = 1;
+  if (m_midi_control_ramp > 0) {
+    steps = (m_midi_control_ramp + m_min_segment - 1) / m_min_segment;
+    if (steps > MaxRampSteps)
+      steps = MaxRampSteps;
+  }
+  uint64_t ramp = m_midi_control_ramp;
+  for (uint32_t k = 1; k <= steps; ++k) {
+    ControlChange c = { port, start + (value - start) * k / steps,
+			frame + ramp * (k - 1) / steps };
+    if (!stage_control_change(c)) {
+      DBG3("The control change stage is full, dropping CC event");
+      __sync_fetch_and_add(&m_dropped_events, 1);
+      break;
+    }
+  }
+  
+  return true;
+}
+
+
+void LV2Host::set_midi_control_ramp(uint32_t frames) {
+  m_midi_control_ramp = frames;
+}
+
+
+void LV2Host::set_program(unsigned char program) {
+  
+  DBG2("Switch to program "<<program<<" requested");
+  
+  std::map<unsigned, LV2Preset>::const_iterator iter = m_presets.find(program);
+  
+  if (iter != m_presets.end()) {
+    
+    DBG2("Found preset \""<<iter->second.name
+	 <<"\" with program number "<<program);
+    
+    // the realtime thread sets the audio context inputs
+    const ProgramTable::Entry* e = 0;
+    if (m_program_table)
+      e = find_program(*m_program_table, program);
+    if (e) {
+      for (uint32_t j = e->begin; j < e->end; ++j)
+	m_ports[m_program_table->ports[j]].value = m_program_table->values[j];
+      __sync_lock_test_and_set(&m_program_request, program + 1);
+    }
+    
+    restore_preset_data(iter->second);
+  }
+}
+
+
+bool LV2Host::handle_midi_program(const unsigned char* data, uint32_t size) {
+  
+  // bank select MSB and LSB
+  if (size == 3 && (data[0] & 0xF0) == 0xB0 && data[1] == 0) {
+    m_midi_bank = (m_midi_bank & 0x7F) | ((data[2] & 0x7F) << 7);
+    return true;
+  }
+  if (size == 3 && (data[0] & 0xF0) == 0xB0 && data[1] == 32) {
+    m_midi_bank = (m_midi_bank & (0x7F << 7)) | (data[2] & 0x7F);
+    return true;
+  }
+  
+  // program change
+  if (size == 2 && (data[0] & 0xF0) == 0xC0) {
+    DBG3("Program change to "<<int(data[1] & 0x7F)<<" in bank "<<m_midi_bank);
+    m_midi_program = 128 * m_midi_bank + (data[1] & 0x7F) + 1;
+    return true;
+  }
+  
+  return false;
+}
+
+
+void LV2Host::save_program(unsigned char program, const char* name) {
+  if (program > 127) {
+    DBG0("Can not save program with number "<<int(program));
+    return;
+  }
+  
+  // the audio context inputs are taken from the realtime thread's 
+  // snapshot, so they are all from the same block
+  vector<float> snapshot;
+  bool has_snapshot = get_control_snapshot(snapshot);
+  LV2Preset preset;
+  preset.name = name;
+  preset.elven_override = true;
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type == ControlType && m_ports[i].direction == InputPort) {
+      if (has_snapshot && m_ports[i].context == AudioContext)
+	preset.values[i] = snapshot[i];
+      else
+	preset.values[i] = m_ports[i].value;
+    }
+  }
+  DBG2("Program \""<<name<<"\" added with number "<<int(program));
+  m_presets[program] = preset;
+  compile_programs();
+  signal_program_added(program, name);
+  signal_program_changed(program);
+  
+  // the worker thread saves the plugin state and writes the preset file
+  StateJob* job = new StateJob;
+  job->type = StateJob::Save;
+  job->program = program;
+  map<unsigned, LV2Preset>::const_iterator iter;
+  for (iter = m_presets.begin(); iter != m_presets.end(); ++iter) {
+    if (!iter->second.elven_override)
+      continue;
+    PresetRecord record;
+    record.program = iter->first;
+    record.name = iter->second.name;
+    record.values = iter->second.values;
+    if (iter->second.files && iter->first != program) {
+      for (LV2SR_File** f = iter->second.files; *f; ++f)
+	record.files.push_back(StateFile((*f)->name, (*f)->path));
+    }
+    job->presets.push_back(record);
+  }
+  queue_state_job(job);
+}
+
+
+const std::vector<int>& LV2Host::get_midi_map() const {
+  return m_midimap;
+}
+
+
+const std::string& LV2Host::get_icon_path() const {
+  return m_iconpath;
+}
+
+
+const std::string& LV2Host::get_gui_path() const {
+  return m_plugingui;
+}
+
+
+const std::string& LV2Host::get_gui_uri() const {
+  return m_guiuri;
+}
+
+
+const std::string& LV2Host::get_bundle_dir() const {
+  return m_bundledir;
+}
+
+
+const std::string& LV2Host::get_name() const {
+  return m_name;
+}
+
+
+void LV2Host::message_run() {
+  if (!m_msg_desc) {
+    DBG2("Plugin has no message context.");
+    return;
+  }
+  // only wake the worker if it doesn't have a request already, it will 
+  // pick up everything that has been queued when it runs
+  if (__sync_bool_compare_and_swap(&m_message_requested, 0, 1) &&
+      m_worker_running)
+    sem_post(&m_worker_sem);
+}
+
+
+void LV2Host::queue_event(uint32_t port, uint16_t type, uint32_t size, 
+			  const uint8_t* data, uint32_t frames) {
+  if (!type) {
+    DBG0("Trying to queue event of type 0, which is not allowed");
+  }
+  else if (size > 0xFFFF || sizeof(EventHeader) + size > m_event_stage.size()) {
+    DBG0("Trying to queue an event of size "<<size<<", which is too large");
+  }
+  else if (port < m_ports.size() && m_ports[port].type == MidiType && 
+	   m_ports[port].direction == InputPort) {
+    DBG2("Queueing type "<<type<<" event for port "<<port);
+    if (m_event_queue.write_space() < int(sizeof(EventHeader) + size)) {
+      DBG0("The event queue is full, dropping event for port "<<port);
+      __sync_fetch_and_add(&m_dropped_events, 1);
+      return;
+    }
+    EventHeader hdr;
+    hdr.port = port;
+    hdr.frames = frames;
+    hdr.type = type;
+    hdr.size = size;
+    // the realtime thread will not read the event until the data is there too
+    m_event_queue.write(reinterpret_cast<unsigned char*>(&hdr), sizeof(hdr));
+    m_event_queue.write(data, size);
+  }
+  else
+    DBG0("Trying to write event to invalid port "<<port);
+}
+
+
+void LV2Host::merge_queued_events(unsigned long nframes) {
+  
+  // move all complete events that fit from the queue to the stage
+  EventHeader hdr;
+  while (m_event_queue.available() >= int(sizeof(EventHeader))) {
+    m_event_queue.peek(reinterpret_cast<unsigned char*>(&hdr), sizeof(hdr));
+    size_t total = sizeof(hdr) + hdr.size;
+    if (m_event_queue.available() < int(total) ||
+	m_event_stage.size() - m_event_stage_used < total)
+      break;
+    m_event_queue.read(&m_event_stage[m_event_stage_used], total);
+    m_event_stage_used += total;
+  }
+  
+  if (m_event_stage_used == 0 || !m_merge_buffer)
+    return;
+  
+  for (unsigned i = 0; i < m_rt.midi_in.size(); ++i)
+    merge_port_events(m_rt.midi_in[i], nframes);
+  
+  // remove the written events from the stage, the rest will be retried at
+  // the start of the next cycle
+  size_t used = 0;
+  for (size_t offset = 0; offset < m_event_stage_used; ) {
+    memcpy(&hdr, &m_event_stage[offset], sizeof(hdr));
+    size_t total = sizeof(hdr) + hdr.size;
+    if (hdr.port != WrittenEvent) {
+      hdr.frames = 0;
+      memcpy(&m_event_stage[offset], &hdr, sizeof(hdr));
+      if (used != offset)
+	memmove(&m_event_stage[used], &m_event_stage[offset], total);
+      used += total;
+    }
+    offset += total;
+  }
+  m_event_stage_used = used;
+}
+
+
+void LV2Host::merge_port_events(uint32_t port, unsigned long nframes) {
+  
+  // find the first staged event for this port
+  EventHeader hdr;
+  size_t offset;
+  for (offset = 0; offset < m_event_stage_used; 
+       offset += sizeof(hdr) + hdr.size) {
+    memcpy(&hdr, &m_event_stage[offset], sizeof(hdr));
+    if (hdr.port == port)
+      break;
+  }
+  if (offset >= m_event_stage_used)
+    return;
+  
+  // merge the events already in the port buffer with the staged ones, in
+  // timestamp order (the ones in the buffer go first for equal timestamps)
+  LV2_Event_Buffer* buf = static_cast<LV2_Event_Buffer*>(m_rt.buffers[port]);
+  lv2_event_buffer_reset(m_merge_buffer, buf->stamp_type, m_merge_buffer->data);
+  uint32_t capacity = m_merge_buffer->capacity;
+  m_merge_buffer->capacity = buf->capacity;
+  LV2_Event_Iterator in_iter;
+  LV2_Event_Iterator out_iter;
+  lv2_event_begin(&in_iter, buf);
+  lv2_event_begin(&out_iter, m_merge_buffer);
+  
+  while (true) {
+    
+    LV2_Event* ev = 0;
+    uint8_t* data = 0;
+    if (lv2_event_is_valid(&in_iter))
+      ev = lv2_event_get(&in_iter, &data);
+    bool staged = (offset < m_event_stage_used);
+    if (!ev && !staged)
+      break;
+    
+    uint32_t frames = 0;
+    if (staged && nframes > 0)
+      frames = (hdr.frames < nframes ? hdr.frames : nframes - 1);
+    
+    if (ev && (!staged || ev->frames <= frames)) {
+      if (!lv2_event_write(&out_iter, ev->frames, ev->subframes, 
+			   ev->type, ev->size, data)) {
+	DBG3("Event buffer for port "<<port<<" is full, dropping event");
+	__sync_fetch_and_add(&m_dropped_events, 1);
+      }
+      lv2_event_increment(&in_iter);
+    }
+    
+    else {
+      DBG3("Received event from the main thread for port "
+	   <<m_ports[port].symbol<<": "
+	   <<midi2str(hdr.size, &m_event_stage[offset + sizeof(hdr)]));
+      // events that don't fit stay in the stage until the next cycle
+      if (lv2_event_write(&out_iter, frames, 0, hdr.type, hdr.size, 
+			  &m_event_stage[offset + sizeof(hdr)])) {
+	hdr.port = WrittenEvent;
+	memcpy(&m_event_stage[offset], &hdr, sizeof(hdr));
+      }
+      for (offset += sizeof(hdr) + hdr.size; offset < m_event_stage_used;
+	   offset += sizeof(hdr) + hdr.size) {
+	memcpy(&hdr, &m_event_stage[offset], sizeof(hdr));
+	if (hdr.port == port)
+	  break;
+      }
+    }
+  }
+  
+  memcpy(buf->data, m_merge_buffer->data, m_merge_buffer->size);
+  buf->size = m_merge_buffer->size;
+  buf->event_count = m_merge_buffer->event_count;
+  m_merge_buffer->capacity = capacity;
+}
+
+
+size_t LV2Host::collect_control_changes(unsigned long nframes) {
+  
+  // insert the queued changes in the stage in frame order, changes for the
+  // same frame keep the order they were queued in
+  ControlChange c;
+  while (m_change_stage_used < m_change_stage.size() &&
+	 m_control_changes.read(&c) == 1)
+    stage_control_change(c);
+  
+  size_t due = 0;
+  uint64_t end = m_frame + nframes;
+  while (due < m_change_stage_used && m_change_stage[due].frame < end)
+    ++due;
+  return due;
+}
+
+
+bool LV2Host::stage_control_change(const ControlChange& c) {
+  if (m_change_stage_used == m_change_stage.size())
+    return false;
+  size_t j = m_change_stage_used;
+  for ( ; j > 0 && m_change_stage[j - 1].frame > c.frame; --j)
+    m_change_stage[j] = m_change_stage[j - 1];
+  m_change_stage[j] = c;
+  ++m_change_stage_used;
+  return true;
+}
+
+
+void LV2Host::run_segments(unsigned long nframes, size_t due) {
+  
+  size_t next = 0;
+  uint32_t pos = 0;
+  while (pos < nframes) {
+    
+    // apply the changes that belong at the start of this segment
+    for ( ; next < due && m_change_stage[next].frame <= m_frame + pos; ++next)
+      apply_control_change(m_change_stage[next]);
+    
+    // the segment ends at the next change, but is never shorter than the
+    // minimum segment size unless it is the last one
+    uint32_t end = nframes;
+    if (next < due)
+      end = uint32_t(m_change_stage[next].frame - m_frame);
+    if (end - pos < m_min_segment)
+      end = pos + m_min_segment;
+    if (end > nframes || nframes - end < m_min_segment)
+      end = nframes;
+    
+    run_segment(pos, end - pos, end == nframes);
+    pos = end;
+  }
+  
+  // changes that were too close to the end of the block are applied now,
+  // so the plugin sees them at the start of the next block
+  for ( ; next < due; ++next)
+    apply_control_change(m_change_stage[next]);
+  
+  m_change_stage_used -= due;
+  for (size_t j = 0; j < m_change_stage_used; ++j)
+    m_change_stage[j] = m_change_stage[j + due];
+}
+
+
+void LV2Host::run_segment(uint32_t offset, uint32_t nframes, bool last) {
+  
+  // audio ports point into the block buffers
+  for (unsigned j = 0; j < m_rt.audio.size(); ++j) {
+    uint32_t i = m_rt.audio[j];
+    void* buf = static_cast<float*>(m_rt.buffers[i]) + offset;
+    if (m_rt.connected[i] != buf) {
+      m_desc->connect_port(m_handle, i, buf);
+      m_rt.connected[i] = buf;
+    }
+  }
+  
+  // input events for this segment are copied to the scratch buffers with
+  // the offset subtracted, the last segment gets all the remaining events
+  for (unsigned j = 0; j < m_rt.midi_in.size(); ++j) {
+    uint32_t i = m_rt.midi_in[j];
+    LV2_Event_Buffer* seg = m_segment_events[i];
+    if (!seg)
+      continue;
+    lv2_event_buffer_reset(seg, LV2_EVENT_AUDIO_STAMP, seg->data);
+    LV2_Event_Iterator in_iter;
+    LV2_Event_Iterator out_iter;
+    lv2_event_begin(&in_iter, static_cast<LV2_Event_Buffer*>(m_rt.buffers[i]));
+    lv2_event_begin(&out_iter, seg);
+    for ( ; lv2_event_is_valid(&in_iter); lv2_event_increment(&in_iter)) {
+      uint8_t* data;
+      LV2_Event* ev = lv2_event_get(&in_iter, &data);
+      if (ev->frames < offset)
+	continue;
+      if (!last && ev->frames >= offset + nframes)
+	break;
+      lv2_event_write(&out_iter, ev->frames - offset, ev->subframes,
+		      ev->type, ev->size, data);
+    }
+    if (m_rt.connected[i] != seg) {
+      m_desc->connect_port(m_handle, i, seg);
+      m_rt.connected[i] = seg;
+    }
+  }
+  
+  for (unsigned j = 0; j < m_rt.midi_out.size(); ++j) {
+    uint32_t i = m_rt.midi_out[j];
+    LV2_Event_Buffer* seg = m_segment_events[i];
+    if (!seg)
+      continue;
+    lv2_event_buffer_reset(seg, LV2_EVENT_AUDIO_STAMP, seg->data);
+    if (m_rt.connected[i] != seg) {
+      m_desc->connect_port(m_handle, i, seg);
+      m_rt.connected[i] = seg;
+    }
+  }
+  
+  trace_begin(TraceRun);
+  m_desc->run(m_handle, nframes);
+  trace_end(TraceRun);
+  
+  // append the output events to the block buffers with the offset added,
+  // the first segment replaces what was there like a plugin would
+  for (unsigned j = 0; j < m_rt.midi_out.size(); ++j) {
+    uint32_t i = m_rt.midi_out[j];
+    LV2_Event_Buffer* seg = m_segment_events[i];
+    if (!seg)
+      continue;
+    LV2_Event_Buffer* buf = static_cast<LV2_Event_Buffer*>(m_rt.buffers[i]);
+    if (offset == 0)
+      lv2_event_buffer_reset(buf, buf->stamp_type, buf->data);
+    LV2_Event_Iterator in_iter;
+    LV2_Event_Iterator out_iter;
+    lv2_event_begin(&in_iter, seg);
+    lv2_event_begin(&out_iter, buf);
+    while (lv2_event_is_valid(&out_iter))
+      lv2_event_increment(&out_iter);
+    for ( ; lv2_event_is_valid(&in_iter); lv2_event_increment(&in_iter)) {
+      uint8_t* data;
+      LV2_Event* ev = lv2_event_get(&in_iter, &data);
+      if (!lv2_event_write(&out_iter, ev->frames + offset, ev->subframes, 
+			   ev->type, ev->size, data)) {
+	DBG3("Event buffer for port "<<i<<" is full, dropping event");
+	__sync_fetch_and_add(&m_dropped_events, 1);
+      }
+    }
+  }
+}
+
+
+void LV2Host::apply_control_change(const ControlChange& c) {
+  DBG3("Setting control input "<<c.port<<" to "<<c.value
+       <<" at frame "<<c.frame);
+  *static_cast<float*>(m_rt.buffers[c.port]) = c.value;
+  
+  // tell the main thread so the GUI gets the new value
+  PortChange p = { c.port, c.value, c.frame };
+  if (m_port_changes.write(&p) != 1) {
+    m_port_changes_lost = 1;
+    ++m_lost_port_changes;
+  }
+}
+
+
+void LV2Host::compile_programs() {
+  
+  ProgramTable* table = new ProgramTable;
+  std::map<unsigned, LV2Preset>::const_iterator iter;
+  for (iter = m_presets.begin(); iter != m_presets.end(); ++iter) {
+    ProgramTable::Entry e = { iter->first, uint32_t(table->ports.size()), 0 };
+    const std::map<uint32_t, float>& values = iter->second.values;
+    std::map<uint32_t, float>::const_iterator piter;
+    for (piter = values.begin(); piter != values.end(); ++piter) {
+      uint32_t p = piter->first;
+      if (p < m_ports.size() && m_ports[p].type == ControlType &&
+	  m_ports[p].direction == InputPort && 
+	  m_ports[p].context == AudioContext) {
+	table->ports.push_back(p);
+	table->values.push_back(piter->second);
+      }
+    }
+    e.end = table->ports.size();
+    table->programs.push_back(e);
+  }
+  DBG2("Compiled "<<table->programs.size()<<" programs with "
+       <<table->ports.size()<<" control values");
+  
+  ProgramTable* old = m_program_table;
+  __sync_synchronize();
+  m_program_table = table;
+  __sync_synchronize();
+  
+  // if the realtime thread is in run() it may have the old table, wait
+  // until it's done (the next call will see the new table)
+  unsigned cycles = m_run_cycles;
+  if (cycles & 1) {
+    while (m_run_cycles == cycles)
+      usleep(500);
+  }
+  
+  delete old;
+}
+
+
+const LV2Host::ProgramTable::Entry* 
+LV2Host::find_program(const ProgramTable& table, uint32_t program) {
+  size_t begin = 0;
+  size_t end = table.programs.size();
+  while (begin < end) {
+    size_t middle = begin + (end - begin) / 2;
+    if (table.programs[middle].program < program)
+      begin = middle + 1;
+    else
+      end = middle;
+  }
+  if (begin < table.programs.size() && table.programs[begin].program == program)
+    return &table.programs[begin];
+  return 0;
+}
+
+
+bool LV2Host::apply_program(uint32_t program, bool midi) {
+  const ProgramTable* table = m_program_table;
+  const ProgramTable::Entry* e = (table ? find_program(*table, program) : 0);
+  if (!e) {
+    DBG3("There is no program with number "<<program);
+    return false;
+  }
+  for (uint32_t j = e->begin; j < e->end; ++j)
+    *static_cast<float*>(m_rt.buffers[table->ports[j]]) = table->values[j];
+  m_program_changed = (program + 1) | (midi ? MidiProgramFlag : 0);
+  return true;
+}
+
+
+void LV2Host::finish_program(uint32_t program, bool midi) {
+  
+  std::map<unsigned, LV2Preset>::const_iterator iter = m_presets.find(program);
+  if (iter == m_presets.end() || !m_program_table)
+    return;
+  DBG2("Switched to program "<<program);
+  
+  if (midi)
+    restore_preset_data(iter->second);
+  
+  // send all the new values at once
+  const ProgramTable::Entry* e = find_program(*m_program_table, program);
+  if (e) {
+    for (uint32_t j = e->begin; j < e->end; ++j) {
+      uint32_t p = m_program_table->ports[j];
+      m_ports[p].value = m_program_table->values[j];
+      signal_port_event(p, sizeof(float), 0, &m_ports[p].value);
+    }
+  }
+  signal_program_changed(program);
+}
+
+
+void LV2Host::restore_preset_data(const LV2Preset& preset) {
+  
+  // the message context inputs are set in this thread
+  const std::map<uint32_t, float>& values = preset.values;
+  std::map<uint32_t, float>::const_iterator piter;
+  for (piter = values.begin(); piter != values.end(); ++piter) {
+    if (piter->first < m_ports.size() && 
+	m_ports[piter->first].type == ControlType &&
+	m_ports[piter->first].direction == InputPort &&
+	m_ports[piter->first].context != AudioContext)
+      set_control(piter->first, piter->second);
+  }
+  
+  // the worker thread calls restore() in the plugin if there are any
+  // files in the preset
+  if (preset.files) {
+    DBG2("Preset has data files, restoring");
+    StateJob* job = new StateJob;
+    job->type = StateJob::Restore;
+    for (LV2SR_File** iter = preset.files; *iter; ++iter)
+      job->files.push_back(StateFile((*iter)->name, (*iter)->path));
+    queue_state_job(job);
+  }
+}
+
+
+void LV2Host::queue_state_job(StateJob* job) {
+  job->ok = false;
+  if (m_state_jobs.write(&job) != 1) {
+    DBG0("The state job queue is full, dropping job");
+    delete job;
+    return;
+  }
+  __sync_fetch_and_add(&m_pending_jobs, 1);
+  if (m_worker_running)
+    sem_post(&m_worker_sem);
+}
+
+
+bool LV2Host::run_state_job(StateJob& job) {
+  
+  if (job.type == StateJob::Reinstantiate) {
+    if (job.rate == m_rate) {
+      job.ok = true;
+      return true;
+    }
+    if (!pause_plugin())
+      return false;
+    job.ok = reinstantiate(job.rate);
+    resume_plugin();
+    return true;
+  }
+  
+  if (job.type == StateJob::Restore) {
+    vector<LV2SR_File> files(job.files.size());
+    vector<const LV2SR_File*> pointers(job.files.size() + 1, 0);
+    for (unsigned i = 0; i < job.files.size(); ++i) {
+      files[i].name = const_cast<char*>(job.files[i].first.c_str());
+      files[i].path = const_cast<char*>(job.files[i].second.c_str());
+      files[i].must_copy = 0;
+      pointers[i] = &files[i];
+    }
+    if (!pause_plugin())
+      return false;
+    job.ok = restore(&pointers[0]);
+    resume_plugin();
+    if (!job.ok)
+      DBG0("Failed to completely restore preset");
+    return true;
+  }
   
-  for (size_t i = 0; i < m_ports.size(); ++i)
-    m_desc->connect_port(m_handle, i, m_ports[i].buffer);
+  // find the preset that is saved
+  PresetRecord* record = 0;
+  for (unsigned i = 0; i < job.presets.size(); ++i) {
+    if (job.presets[i].program == job.program)
+      record = &job.presets[i];
+  }
   
-  if (!pthread_mutex_trylock(&m_mutex)) {
-    
-    // copy any updated control port values into the port buffers
-    if (m_ports_updated) {
-      m_ports_updated = false;
-      for (unsigned i = 0; i < m_ports.size(); ++i) {
-	if (m_ports[i].type == ControlType && 
-	    m_ports[i].direction == InputPort) {
-	  DBG3("Setting control input "<<i<<" to "<<m_ports[i].value);
-	  memcpy(m_ports[i].buffer, &m_ports[i].value, sizeof(float));
-	}
-      }
+  // save the plugin state to a directory of its own for this preset
+  if (record && m_sr_desc && m_sr_desc->save) {
+    string filename = uri_to_preset_filename(m_uri);
+    ostringstream oss;
+    oss<<m_user_data_bundle<<'/'
+       <<filename.substr(0, filename.size() - 4)<<'-'<<job.program;
+    string directory = oss.str();
+    if (mkdir(directory.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) && 
+	errno != EEXIST) {
+      DBG0("Could not create "<<directory<<": "<<strerror(errno));
+      return true;
     }
-    
-    // read events from the vector
-    for (unsigned i = 0; i < m_midi_events.size(); ++i) {
-      if (m_midi_events[i]->written)
-	continue;
-      Event* e = m_midi_events[i];
-      DBG3("Received MIDI event from the main thread for port "
-	   <<m_ports[e->port].symbol<<": "
-	   <<midi2str(e->event_size, e->data));
-      LV2_Event_Buffer* midi = 
-	static_cast<LV2_Event_Buffer*>(m_ports[e->port].buffer);
-      // XXX DANGER! Can't start from the beginning of the buffer since other 
-      // events may have been written to the buffer already!
-      LV2_Event_Iterator iter;
-      lv2_event_begin(&iter, midi);
-      if (!lv2_event_write(&iter, 0, 0, e->type, e->event_size, e->data))
-	break;
-      e->written = true;
+    LV2SR_File** files = 0;
+    if (!pause_plugin())
+      return false;
+    bool saved = save(directory, &files);
+    resume_plugin();
+    if (!saved)
+      return true;
+    if (files) {
+      for (LV2SR_File** iter = files; *iter; ++iter) {
+	record->files.push_back(StateFile((*iter)->name, (*iter)->path));
+	free((*iter)->name);
+	free((*iter)->path);
+	free(*iter);
+      }
+      free(files);
     }
-    
-    pthread_mutex_unlock(&m_mutex);
   }
   
-  m_desc->run(m_handle, nframes);
+  job.ok = write_user_presets(job.presets);
+  return true;
+}
+
+
+void LV2Host::finish_state_job(StateJob* job) {
   
-  // send port notifications
-  for (unsigned i = 0; i < m_ports.size(); ++i) {
-    if (m_ports[i].notify && 
-	m_ports[i].old_value != *static_cast<float*>(m_ports[i].buffer)) {
-      DBG3("Port "<<i<<" changed - notifying main thread");
-      sem_post(&m_notification_sem);
+  // the saved preset gets the data files that the plugin wrote
+  if (job->type == StateJob::Save && job->ok) {
+    std::map<unsigned, LV2Preset>::iterator iter = 
+      m_presets.find(job->program);
+    for (unsigned i = 0; i < job->presets.size(); ++i) {
+      const PresetRecord& record = job->presets[i];
+      if (record.program != job->program || iter == m_presets.end() ||
+	  record.files.empty())
+	continue;
+      DBG2("Saved "<<record.files.size()<<" data files for program "
+	   <<job->program);
+      LV2Preset& preset = iter->second;
+      if (preset.files) {
+	for (LV2SR_File** f = preset.files; *f; ++f) {
+	  free((*f)->name);
+	  free((*f)->path);
+	  free(*f);
+	}
+	free(preset.files);
+      }
+      preset.files = 
+	(LV2SR_File**)calloc(record.files.size() + 1, sizeof(LV2SR_File*));
+      for (unsigned k = 0; k < record.files.size(); ++k) {
+	LV2SR_File* file = (LV2SR_File*)calloc(1, sizeof(LV2SR_File));
+	file->name = strdup(record.files[k].first.c_str());
+	file->path = strdup(record.files[k].second.c_str());
+	preset.files[k] = file;
+      }
     }
-    m_ports[i].old_value = *static_cast<float*>(m_ports[i].buffer);
   }
+  
+  delete job;
 }
 
 
-void LV2Host::deactivate() {
-  assert(m_handle);
-  DBG2("Deactivating the plugin instance");
-  if (m_desc->deactivate)
-    m_desc->deactivate(m_handle);
+bool LV2Host::pause_plugin() {
+  unsigned token = __sync_add_and_fetch(&m_pause_request, 1);
+  while (m_pause_ack != token) {
+    if (m_worker_quit) {
+      __sync_fetch_and_add(&m_pause_request, 1);
+      return false;
+    }
+    usleep(500);
+  }
+  return true;
 }
 
 
-void LV2Host::set_control(uint32_t index, float value) {
-  if (index < m_ports.size() && m_ports[index].type == ControlType &&
-      m_ports[index].direction == InputPort) {
-    if (m_ports[index].context == AudioContext) {
-      pthread_mutex_lock(&m_mutex);
-      m_ports[index].value = value;
-      m_ports_updated = true;
-      pthread_mutex_unlock(&m_mutex);
-    }
-    else if (m_ports[index].context == MessageContext) {
-      m_ports[index].value = value;
-      *static_cast<float*>(m_ports[index].buffer) = value;
-      message_run();
-    }
-    signal_port_event(index, sizeof(float), 0, &value);
-  }
+void LV2Host::resume_plugin() {
+  __sync_fetch_and_add(&m_pause_request, 1);
 }
 
 
-void LV2Host::set_program(unsigned char program) {
+bool LV2Host::reinstantiate(unsigned long rate) {
   
-  DBG2("Switch to program "<<program<<" requested");
+  // the plugin state goes through a temporary directory if the plugin can
+  // save it, the control values stay in the port buffers
+  char directory[] = "/tmp/elven-XXXXXX";
+  LV2SR_File** files = 0;
+  bool saved = (m_sr_desc && m_sr_desc->save && m_sr_desc->restore &&
+		mkdtemp(directory) && save(directory, &files));
   
-  std::map<unsigned, LV2Preset>::const_iterator iter = m_presets.find(program);
+  DBG2("Reinstantiating the plugin at "<<rate<<" Hz");
+  LV2_Handle old_handle = m_handle;
+  unsigned long old_rate = m_rate;
+  if (m_desc->deactivate)
+    m_desc->deactivate(old_handle);
+  m_rate = rate;
+  bool ok = instantiate();
+  if (!ok) {
+    DBG0("Could not instantiate the plugin at "<<rate<<" Hz, keeping the "
+	 <<"instance that runs at "<<old_rate<<" Hz");
+    m_handle = old_handle;
+    m_rate = old_rate;
+  }
+  else if (m_desc->cleanup)
+    m_desc->cleanup(old_handle);
   
-  if (iter != m_presets.end()) {
-    
-    DBG2("Found preset \""<<iter->second.name
-	 <<"\" with program number "<<program);
-    
-    // tell the GUI that the program has changed
-    signal_program_changed(program);
-    
-    // set all port values in the preset
-    const std::map<uint32_t, float>& preset = iter->second.values;
-    std::map<uint32_t, float>::const_iterator piter;
-    for (piter = preset.begin(); piter != preset.end(); ++piter) {
-      if (piter->first < m_ports.size() && 
-	  m_ports[piter->first].type == ControlType &&
-	  m_ports[piter->first].direction == InputPort)
-	set_control(piter->first, piter->second);
-    }
-    
-    // call restore() in the plugin if there are any files in the preset
-    if (iter->second.files) {
-      DBG2("Preset has data files, restoring");
-      if (!restore(const_cast<const LV2SR_File**>(iter->second.files)))
-	DBG0("Failed to completely restore preset");
+  for (unsigned i = 0; i < m_ports.size(); ++i)
+    m_desc->connect_port(m_handle, i, m_rt.connected[i]);
+  if (m_desc->activate)
+    m_desc->activate(m_handle);
+  if (ok && saved && files)
+    restore(const_cast<const LV2SR_File**>(files));
+  
+  if (files) {
+    for (LV2SR_File** iter = files; *iter; ++iter) {
+      unlink((*iter)->path);
+      free((*iter)->name);
+      free((*iter)->path);
+      free(*iter);
     }
-    
+    free(files);
   }
+  rmdir(directory);
+  
+  return ok;
 }
 
 
-void LV2Host::save_program(unsigned char program, const char* name) {
-  if (program > 127) {
-    DBG0("Can not save program with number "<<int(program));
-    return;
-  }
-  LV2Preset preset;
-  preset.name = name;
-  preset.elven_override = true;
-  for (unsigned i = 0; i < m_ports.size(); ++i) {
-    if (m_ports[i].type == ControlType && m_ports[i].direction == InputPort)
-      preset.values[i] = m_ports[i].value;
-  }
-  DBG2("Program \""<<name<<"\" added with number "<<int(program));
-  m_presets[program] = preset;
-  signal_program_added(program, name);
-  signal_program_changed(program);
+bool LV2Host::write_user_presets(const std::vector<PresetRecord>& presets) {
   
   TurtleParser tp;
   RDFData data;
-  if (!tp.parse_ttl_file(m_user_data_bundle + "/manifest.ttl", data)) {
+  string manifest = m_user_data_bundle + "/manifest.ttl";
+  if (!tp.parse_ttl_file(manifest, data)) {
     DBG0("Failed to parse user data manifest!");
     DBG0("Will not be able to save user-defined presets");
-    return;
+    return false;
   }
   Variable presetfile;
   Namespace pr("<http://ll-plugins.nongnu.org/lv2/presets#>");
@@ -328,119 +1595,280 @@ void LV2Host::save_program(unsigned char program, const char* name) {
     DBG2("User data manifest already had preset file "<<filename);
   }
   else {
+    
+    // add the preset file to a copy of the manifest and replace it
     filename = uri_to_preset_filename(m_uri);
-    ofstream ofs;
-    ofs.open((m_user_data_bundle + "/manifest.ttl").c_str(), 
-	     ios_base::out | ios_base::app);
-    if (!ofs.good()) {
-      DBG0("Could not open user data manifest for writing!");
+    ifstream ifs(manifest.c_str());
+    ostringstream oss;
+    oss<<ifs.rdbuf();
+    if (!ifs.good()) {
+      DBG0("Could not read the user data manifest!");
       DBG0("Will not be able to save user-defined presets");
-      return;
+      return false;
     }
-    ofs<<"<"<<m_uri<<">"<<endl
+    oss<<"<"<<m_uri<<">"<<endl
        <<"  <http://www.w3.org/2000/01/rdf-schema#seeAlso> <>;"<<endl
        <<"  "<<pr("presetFile")<<" <"<<filename<<">."<<endl;
+    if (!write_file_atomically(manifest, oss.str())) {
+      DBG0("Will not be able to save user-defined presets");
+      return false;
+    }
     filename = m_user_data_bundle + "/" + filename;
   }
-  string fullpath = filename;
-  DBG2("Opening "<<fullpath);
-  ofstream ofs(fullpath.c_str());
-  if (!ofs.good()) {
-    DBG0("Could not open user preset file for writing!");
-    DBG0("Will not be able to save user-defined presets");
-    return;
-  }
+  
+  ostringstream ofs;
   ofs<<"# Generated by Elven "<<VERSION<<endl
      <<"@prefix rdfs: <http://www.w3.org/2000/01/rdf-schema#>."<<endl
      <<"@prefix pr: <http://ll-plugins.nongnu.org/lv2/presets#>."<<endl
      <<endl
      <<"<"<<m_uri<<">"<<endl;
-  map<unsigned, LV2Preset>::const_iterator iter;
-  bool first = true;
-  for (iter = m_presets.begin(); iter != m_presets.end(); ++iter) {
-    if (!iter->second.elven_override)
-      continue;
-    if (first) {
+  for (unsigned i = 0; i < presets.size(); ++i) {
+    const PresetRecord& record = presets[i];
+    if (i == 0)
       ofs<<"  pr:preset ";
-      first = false;
-    }
     else
       ofs<<","<<endl<<endl<<"  ";
     ofs<<"["<<endl
-       <<"    rdfs:label \""<<iter->second.name<<"\";"<<endl
-       <<"    pr:midiProgram "<<iter->first<<";"<<endl
-       <<"    pr:portValues \"";
-    map<uint32_t, float>::const_iterator iter2;
-    for (iter2 = iter->second.values.begin();
-	 iter2 != iter->second.values.end(); ++iter2) {
-      ofs<<iter2->first<<':'<<iter2->second<<' ';
+       <<"    rdfs:label \""<<record.name<<"\";"<<endl
+       <<"    pr:midiProgram "<<record.program<<";"<<endl;
+    for (unsigned k = 0; k < record.files.size(); ++k) {
+      ofs<<"    pr:hasFile [ pr:fileName \""<<record.files[k].first
+	 <<"\"; pr:filePath <file://"<<record.files[k].second<<"> ];"<<endl;
     }
+    ofs<<"    pr:portValues \"";
+    map<uint32_t, float>::const_iterator iter;
+    for (iter = record.values.begin(); iter != record.values.end(); ++iter)
+      ofs<<iter->first<<':'<<iter->second<<' ';
     ofs<<"\";"<<endl
        <<"  ]";
   }
   ofs<<"."<<endl;
+  
+  DBG2("Writing "<<filename);
+  return write_file_atomically(filename, ofs.str());
 }
 
 
-const std::vector<int>& LV2Host::get_midi_map() const {
-  return m_midimap;
+bool LV2Host::get_control_snapshot(std::vector<float>& values) const {
+  if (m_snapshots[0].empty())
+    return false;
+  values.resize(m_ports.size(), 0);
+  // retry if the realtime thread has started writing the copy we read
+  while (true) {
+    unsigned seq = m_snapshot_seq;
+    __sync_synchronize();
+    const vector<float>& snapshot = m_snapshots[seq & 1];
+    for (unsigned j = 0; j < m_rt.control_in.size(); ++j)
+      values[m_rt.control_in[j]] = snapshot[m_rt.control_in[j]];
+    __sync_synchronize();
+    if (m_snapshot_seq == seq)
+      return true;
+  }
 }
 
 
-const std::string& LV2Host::get_icon_path() const {
-  return m_iconpath;
+void LV2Host::publish_snapshot() {
+  unsigned seq = m_snapshot_seq;
+  vector<float>& snapshot = m_snapshots[(seq + 1) & 1];
+  for (unsigned j = 0; j < m_rt.control_in.size(); ++j) {
+    uint32_t i = m_rt.control_in[j];
+    snapshot[i] = *static_cast<float*>(m_rt.buffers[i]);
+  }
+  __sync_synchronize();
+  m_snapshot_seq = seq + 1;
 }
 
 
-const std::string& LV2Host::get_gui_path() const {
-  return m_plugingui;
+void LV2Host::silence_outputs(unsigned long nframes) {
+  for (unsigned j = 0; j < m_rt.audio.size(); ++j) {
+    uint32_t i = m_rt.audio[j];
+    if (m_ports[i].direction == OutputPort && m_rt.buffers[i])
+      memset(m_rt.buffers[i], 0, nframes * sizeof(float));
+  }
+  for (unsigned j = 0; j < m_rt.midi_out.size(); ++j) {
+    LV2_Event_Buffer* buf = 
+      static_cast<LV2_Event_Buffer*>(m_rt.buffers[m_rt.midi_out[j]]);
+    lv2_event_buffer_reset(buf, buf->stamp_type, buf->data);
+  }
 }
 
 
-const std::string& LV2Host::get_gui_uri() const {
-  return m_guiuri;
+void LV2Host::start_worker() {
+  
+  if (m_worker_running)
+    return;
+  
+  // the outputs start at the values the ports have now
+  m_message_outputs.assign(m_ports.size(), 0);
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type == ControlType && m_ports[i].buffer)
+      m_message_outputs[i] = *static_cast<float*>(m_ports[i].buffer);
+  }
+  
+  // resize_buffers() can restart the worker from the JACK thread, it must
+  // not inherit the realtime priority from that
+  pthread_attr_t attr;
+  sched_param param;
+  param.sched_priority = 0;
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+  pthread_attr_setschedparam(&attr, &param);
+  m_worker_quit = 0;
+  int error = pthread_create(&m_worker_thread, &attr, 
+			     &LV2Host::worker_thread, this);
+  pthread_attr_destroy(&attr);
+  if (error) {
+    DBG0("Could not start the worker thread");
+    return;
+  }
+  m_worker_running = true;
+  
+  // run the requests that were made before the thread started
+  if (m_message_requested || m_interrupted_job || 
+      m_state_jobs.available())
+    sem_post(&m_worker_sem);
 }
 
 
-const std::string& LV2Host::get_bundle_dir() const {
-  return m_bundledir;
+void LV2Host::stop_worker() {
+  if (!m_worker_running)
+    return;
+  m_worker_quit = 1;
+  sem_post(&m_worker_sem);
+  pthread_join(m_worker_thread, 0);
+  m_worker_running = false;
 }
 
 
-const std::string& LV2Host::get_name() const {
-  return m_name;
+void* LV2Host::worker_thread(void* arg) {
+  LV2Host* me = static_cast<LV2Host*>(arg);
+  // the worker is started again by every activate() and buffer resize, 
+  // it only takes a trace buffer the first time
+  if (me->m_trace_buffer)
+    Trace::use_buffer(me->m_trace_buffer);
+  else
+    me->m_trace_buffer = Trace::register_thread("Message");
+  me->worker_loop();
+  return 0;
 }
 
 
-void LV2Host::message_run() {
-  if (m_msg_desc)
+void LV2Host::worker_loop() {
+  
+  while (true) {
+    
+    if (sem_wait(&m_worker_sem) == -1 && errno == EINTR)
+      continue;
+    if (m_worker_quit)
+      break;
+    
+    // state jobs are finished even if the main thread is not there to take
+    // them back, a job that was interrupted because the worker is stopping
+    // is kept and runs first when it starts again
+    StateJob* job = m_interrupted_job;
+    m_interrupted_job = 0;
+    while (job || m_state_jobs.read(&job) == 1) {
+      if (!run_state_job(*job)) {
+	m_interrupted_job = job;
+	break;
+      }
+      __sync_fetch_and_sub(&m_pending_jobs, 1);
+      if (m_finished_jobs.write(&job) != 1)
+	delete job;
+      else if (m_notification_fd != -1 &&
+	       __sync_bool_compare_and_swap(&m_wakeup_pending, 0, 1))
+	eventfd_write(m_notification_fd, 1);
+      job = 0;
+    }
+    if (m_interrupted_job)
+      break;
+    
+    // clear the request before reading the inputs, so a request made while
+    // the plugin runs leads to another run
+    if (!__sync_bool_compare_and_swap(&m_message_requested, 1, 0))
+      continue;
+    
+    for (unsigned w = 0; w < m_dirty_messages.size(); ++w) {
+      uint32_t dirty = __sync_fetch_and_and(&m_dirty_messages[w], 0);
+      while (dirty) {
+	unsigned i = 32 * w + __builtin_ctz(dirty);
+	dirty &= dirty - 1;
+	DBG3("Setting message control input "<<i<<" to "
+	     <<m_message_values[i]);
+	*static_cast<float*>(m_ports[i].buffer) = m_message_values[i];
+      }
+    }
+    bool more = !write_message_events();
+    
+    trace_begin(TraceMessageRun);
     m_msg_desc->blocking_run(m_handle, 0);
-  else
-    DBG2("Plugin has no message context.");
+    trace_end(TraceMessageRun);
+    
+    // send the changed message context outputs to the main thread
+    bool changed = false;
+    for (unsigned i = 0; i < m_ports.size(); ++i) {
+      if (m_ports[i].type != ControlType || 
+	  m_ports[i].direction != OutputPort ||
+	  m_ports[i].context != MessageContext)
+	continue;
+      float value = *static_cast<float*>(m_ports[i].buffer);
+      if (value != m_message_outputs[i]) {
+	PortChange c = { i, value, 0 };
+	if (m_message_changes.write(&c) != 1)
+	  m_message_changes_lost = 1;
+	m_message_outputs[i] = value;
+	changed = true;
+      }
+    }
+    if (changed && m_notification_fd != -1 &&
+	__sync_bool_compare_and_swap(&m_wakeup_pending, 0, 1))
+      eventfd_write(m_notification_fd, 1);
+    
+    // run again if some events are still waiting
+    if (more)
+      message_run();
+  }
 }
 
 
-void LV2Host::queue_event(uint32_t port, uint16_t type, uint32_t size, 
-			  const uint8_t* data) {
-  if (!type) {
-    DBG0("Trying to queue event of type 0, which is not allowed");
+bool LV2Host::write_message_events() {
+  
+  vector<LV2_Event_Iterator> iters(m_ports.size());
+  for (unsigned i = 0; i < m_ports.size(); ++i) {
+    if (m_ports[i].type == MidiType && m_ports[i].direction == InputPort &&
+	m_ports[i].context == MessageContext) {
+      LV2_Event_Buffer* buf = static_cast<LV2_Event_Buffer*>(m_ports[i].buffer);
+      lv2_event_buffer_reset(buf, LV2_EVENT_AUDIO_STAMP, buf->data);
+      lv2_event_begin(&iters[i], buf);
+    }
   }
-  else if (port < m_ports.size() && m_ports[port].type == MidiType && 
-	   m_ports[port].direction == InputPort) {
-    DBG2("Queueing type "<<type<<" event for port "<<port);
-    pthread_mutex_lock(&m_mutex);
-    unsigned i;
-    for (i = 0; i < m_midi_events.size(); ++i) {
-      if (!m_midi_events[i]->written)
-	break;
-      delete m_midi_events[i];
+  
+  // the events stay in the queue until they fit in the port buffer
+  EventHeader hdr;
+  vector<unsigned char> event;
+  while (m_message_events.available() >= int(sizeof(hdr))) {
+    m_message_events.peek(reinterpret_cast<unsigned char*>(&hdr), sizeof(hdr));
+    size_t total = sizeof(hdr) + hdr.size;
+    if (m_message_events.available() < int(total))
+      break;
+    event.resize(total);
+    m_message_events.peek(&event[0], total);
+    if (!lv2_event_write(&iters[hdr.port], 0, 0, hdr.type, hdr.size,
+			 &event[sizeof(hdr)])) {
+      
+      // wait for the next run if there are other events in the buffer, but
+      // an event that doesn't fit in an empty buffer never will
+      if (iters[hdr.port].buf->event_count > 0)
+	return false;
+      DBG0("Event of "<<hdr.size<<" bytes does not fit in the buffer for "
+	   <<"port "<<hdr.port<<", dropping it");
+      __sync_fetch_and_add(&m_dropped_events, 1);
     }
-    m_midi_events.erase(m_midi_events.begin(), m_midi_events.begin() + i);
-    m_midi_events.push_back(new Event(port, type, size, data));
-    pthread_mutex_unlock(&m_mutex);
+    m_message_events.read(&event[0], total);
   }
-  else
-    DBG0("Trying to write event to invalid port "<<port);
+  
+  return true;
 }
 
 
@@ -448,11 +1876,33 @@ void LV2Host::queue_events(uint32_t port, const LV2_Event_Buffer* buffer) {
   if (port < m_ports.size() && m_ports[port].type == MidiType &&
       m_ports[port].direction == InputPort) {
     if (m_ports[port].context == MessageContext) {
-      m_desc->connect_port(m_handle, port, 
-			   const_cast<LV2_Event_Buffer*>(buffer));
-      DBG2("Passing entire event buffer to message port");
+      DBG2("Queueing event buffer for message port");
+      const LV2_Event_Buffer* port_buffer = 
+	static_cast<const LV2_Event_Buffer*>(m_ports[port].buffer);
+      LV2_Event_Iterator iter;
+      lv2_event_begin(&iter, const_cast<LV2_Event_Buffer*>(buffer));
+      for ( ; lv2_event_is_valid(&iter); lv2_event_increment(&iter)) {
+	uint8_t* data;
+	LV2_Event* ev = lv2_event_get(&iter, &data);
+	if (sizeof(LV2_Event) + ev->size > port_buffer->capacity) {
+	  DBG0("Event of "<<ev->size<<" bytes is too large for port "<<port
+	       <<", dropping it");
+	  __sync_fetch_and_add(&m_dropped_events, 1);
+	  continue;
+	}
+	if (m_message_events.write_space() < 
+	    int(sizeof(EventHeader) + ev->size)) {
+	  DBG0("The message event queue is full, dropping event for port "
+	       <<port);
+	  __sync_fetch_and_add(&m_dropped_events, 1);
+	  break;
+	}
+	EventHeader hdr = { port, 0, ev->type, ev->size };
+	m_message_events.write(reinterpret_cast<unsigned char*>(&hdr), 
+			       sizeof(hdr));
+	m_message_events.write(data, ev->size);
+      }
       message_run();
-      m_desc->connect_port(m_handle, port, m_ports[port].buffer);
     }
     else if (m_ports[port].context == AudioContext) {
       LV2_Event_Iterator iter;
@@ -802,7 +2252,93 @@ bool LV2Host::parse_ports(RDFData& data, const std::string& parent,
 }
 
 
-bool LV2Host::load_plugin() {
+LV2Host::SharedData* LV2Host::get_shared_data() {
+  
+  SharedData* shared;
+  
+  map<string, SharedData*>::iterator iter = m_shared_data.find(m_uri);
+  if (iter != m_shared_data.end()) {
+    shared = iter->second;
+    DBG2("Using the already parsed data for "<<shared->uri);
+  }
+  
+  else {
+    
+    string requested = m_uri;
+    
+    // get the directories to look in
+    vector<string> search_dirs = get_search_dirs();
+    
+    // iterate over all directories
+    scan_manifests(search_dirs, mem_fun(*this, &LV2Host::match_uri));
+    
+    // if we didn't find it, assume that we were given a partial URI
+    // XXX lots of scanning here, we shouldn't need to do 3 passes
+    if (m_rdffiles.size() == 0) {
+      DBG1("Did not find a complete match, looking for partial match");
+      if (scan_manifests(search_dirs, 
+			 mem_fun(*this, &LV2Host::match_partial_uri))) {
+	DBG2("Found matching URI, re-scanning manifests");
+	scan_manifests(search_dirs, mem_fun(*this, &LV2Host::match_uri));
+      }
+    }
+    
+    shared = new SharedData;
+    if (!parse_data(*shared)) {
+      delete shared;
+      return 0;
+    }
+    
+    // a partial URI finds the same data next time
+    m_shared_data[requested] = shared;
+    m_shared_data[shared->uri] = shared;
+  }
+  
+  // if we got this far the data is OK. time to load the library
+  if (!shared->libhandle) {
+    shared->libhandle = 
+      dlopen(shared->binary.substr(8, shared->binary.size() - 9).c_str(), 
+	     RTLD_NOW);
+    if (!shared->libhandle) {
+      DBG0("Could not dlopen "<<shared->binary<<": "<<dlerror());
+      return 0;
+    }
+  }
+  ++shared->users;
+  
+  m_uri = shared->uri;
+  m_bundle = shared->bundle;
+  m_rdffiles = shared->rdffiles;
+  m_binary = shared->binary;
+  m_name = shared->name;
+  m_ports = shared->ports;
+  m_midimap = shared->midimap;
+  m_default_midi_port = shared->default_midi_port;
+  m_iconpath = shared->iconpath;
+  m_plugingui = shared->plugingui;
+  m_guiuri = shared->guiuri;
+  m_bundledir = shared->bundle;
+  m_libhandle = shared->libhandle;
+  
+  return shared;
+}
+
+
+void LV2Host::release_shared_data() {
+  if (!m_shared)
+    return;
+  pthread_mutex_lock(&m_shared_mutex);
+  if (--m_shared->users == 0) {
+    DBG2("Unloading "<<m_shared->binary);
+    dlclose(m_shared->libhandle);
+    m_shared->libhandle = 0;
+  }
+  pthread_mutex_unlock(&m_shared_mutex);
+  m_shared = 0;
+}
+
+
+bool LV2Host::parse_data(SharedData& shared) {
   
   DBG2(__PRETTY_FUNCTION__);
 
@@ -1011,33 +2547,68 @@ bool LV2Host::load_plugin() {
     qr = select(preset_path)
       .where(uriref, pr("presetFile"), preset_path)
       .run(data);
-    // XXX this can be done faster
-    for (int pf = 0; pf < qr.size(); ++pf) {
-      string presetfile = qr[pf][preset_path]->name;
-      if (presetfile.substr(8, m_user_data_bundle.size()) == m_user_data_bundle)
-	load_presets_from_uri(presetfile, true);
-    }
-    for (int pf = 0; pf < qr.size(); ++pf) {
-      string presetfile = qr[pf][preset_path]->name;
-      if (presetfile.substr(8, m_user_data_bundle.size()) != m_user_data_bundle)
-	load_presets_from_uri(presetfile, false);
-    }
-    merge_presets();
+    for (int pf = 0; pf < qr.size(); ++pf)
+      shared.preset_files.push_back(qr[pf][preset_path]->name);
   }
   
-  // if we got this far the data is OK. time to load the library
-  m_libhandle = dlopen(m_binary.substr(8, m_binary.size() - 9).c_str(), 
-		       RTLD_NOW);
-  if (!m_libhandle) {
-    DBG0("Could not dlopen "<<m_binary<<": "<<dlerror());
+  
+  shared.uri = m_uri;
+  shared.bundle = m_bundle;
+  shared.rdffiles = m_rdffiles;
+  shared.binary = m_binary;
+  shared.name = m_name;
+  shared.ports = m_ports;
+  shared.midimap = m_midimap;
+  shared.default_midi_port = m_default_midi_port;
+  shared.iconpath = m_iconpath;
+  shared.plugingui = m_plugingui;
+  shared.guiuri = m_guiuri;
+  shared.saverestore = supported_features[LV2_SAVERESTORE_URI];
+  shared.message_context = uses_message_context;
+  shared.libhandle = 0;
+  shared.users = 0;
+  
+  return true;
+}
+
+
+bool LV2Host::load_plugin() {
+  
+  DBG2(__PRETTY_FUNCTION__);
+  
+  pthread_mutex_lock(&m_shared_mutex);
+  m_shared = get_shared_data();
+  pthread_mutex_unlock(&m_shared_mutex);
+  if (!m_shared)
     return false;
+  
+  // the presets can change when the user saves one, so they are read for
+  // every instance (the user's own presets first)
+  const vector<string>& preset_files = m_shared->preset_files;
+  for (unsigned pf = 0; pf < preset_files.size(); ++pf) {
+    const string& presetfile = preset_files[pf];
+    if (presetfile.substr(8, m_user_data_bundle.size()) == m_user_data_bundle)
+      load_presets_from_uri(presetfile, true);
   }
+  for (unsigned pf = 0; pf < preset_files.size(); ++pf) {
+    const string& presetfile = preset_files[pf];
+    if (presetfile.substr(8, m_user_data_bundle.size()) != m_user_data_bundle)
+      load_presets_from_uri(presetfile, false);
+  }
+  merge_presets();
+  compile_programs();
+  
+  // one dirty bit per port for control changes from other threads
+  m_dirty_controls.resize((m_ports.size() + 31) / 32, 0);
+  m_dirty_messages.resize((m_ports.size() + 31) / 32, 0);
+  m_message_values.resize(m_ports.size(), 0);
+  
+  init_rt_ports();
   
   // get the descriptor
   LV2_Descriptor_Function dfunc = get_symbol<LV2_Descriptor_Function>("lv2_descriptor");
   if (!dfunc) {
     DBG0(m_binary<<" has no LV2 descriptor function");
-    dlclose(m_libhandle);
     return false;
   }
   for (unsigned long j = 0; (m_desc = dfunc(j)); ++j) {
@@ -1046,12 +2617,11 @@ bool LV2Host::load_plugin() {
   }
   if (!m_desc) {
     DBG0(m_binary<<" does not contain the plugin "<<m_uri);
-    dlclose(m_libhandle);
     return false;
   }
   
   // get the save/restore descriptor (if there is one)
-  if (supported_features[LV2_SAVERESTORE_URI]) {
+  if (m_shared->saverestore) {
     if (m_desc->extension_data)
       m_sr_desc = (LV2SR_Descriptor*)(m_desc->
 				      extension_data(LV2_SAVERESTORE_URI));
@@ -1063,7 +2633,7 @@ bool LV2Host::load_plugin() {
   }
   
   // get the message context descriptor (if there is one)
-  if (uses_message_context) {
+  if (m_shared->message_context) {
     if (m_desc->extension_data)
       m_msg_desc = (LV2_Blocking_Context*)(m_desc->
 					   extension_data(LV2_CONTEXT_MESSAGE));
@@ -1074,7 +2644,17 @@ bool LV2Host::load_plugin() {
     }
   }
   
-  // instantiate the plugin
+  if (!instantiate()) {
+    m_desc = 0;
+    return false;
+  }
+  
+  return true;
+}
+
+
+bool LV2Host::instantiate() {
+  
   LV2_Feature urimap_feature = { LV2_URI_MAP_URI, &m_urimap_host_desc };
   LV2_Feature saverestore_feature = { LV2_SAVERESTORE_URI, 0 };
   LV2_Feature event_feature = { LV2_EVENT_URI, &m_event_host_desc };
@@ -1090,9 +2670,6 @@ bool LV2Host::load_plugin() {
   
   if (!m_handle) {
     DBG0("Could not instantiate the plugin");
-    dlclose(m_libhandle);
-    m_libhandle = 0;
-    m_desc = 0;
     return false;
   }
   
@@ -1100,6 +2677,62 @@ bool LV2Host::load_plugin() {
 }
 
 
+void LV2Host::init_rt_ports() {
+  
+  // put each array on its own cache line(s)
+  const size_t line = 64;
+  size_t n = m_ports.size();
+  size_t ptrs = (n * sizeof(void*) + line - 1) / line * line;
+  size_t floats = (n * sizeof(float) + line - 1) / line * line;
+  size_t size = 2 * ptrs + 2 * floats;
+  void* memory = 0;
+  if (posix_memalign(&memory, line, size ? size : line)) {
+    DBG0("Could not allocate the realtime port table");
+    return;
+  }
+  memset(memory, 0, size);
+  char* p = static_cast<char*>(memory);
+  m_rt.memory = memory;
+  m_rt.buffers = reinterpret_cast<void**>(p);
+  m_rt.connected = reinterpret_cast<void**>(p + ptrs);
+  m_rt.values = reinterpret_cast<float*>(p + 2 * ptrs);
+  m_rt.old_values = reinterpret_cast<float*>(p + 2 * ptrs + floats);
+  
+  for (uint32_t i = 0; i < n; ++i) {
+    if (m_ports[i].type == AudioType)
+      m_rt.audio.push_back(i);
+    else if (m_ports[i].type == MidiType && m_ports[i].direction == InputPort &&
+	     m_ports[i].context == AudioContext)
+      m_rt.midi_in.push_back(i);
+    else if (m_ports[i].type == MidiType && 
+	     m_ports[i].direction == OutputPort &&
+	     m_ports[i].context == AudioContext)
+      m_rt.midi_out.push_back(i);
+    else if (m_ports[i].type == ControlType && 
+	     m_ports[i].direction == InputPort && 
+	     m_ports[i].context == AudioContext)
+      m_rt.control_in.push_back(i);
+    if (m_ports[i].notify && m_ports[i].context == AudioContext)
+      m_rt.notify.push_back(i);
+  }
+  
+  // the MIDI map is the same for all channels
+  MidiControlTarget unmapped = { -1, 0, 0 };
+  m_midi_controls.assign(16 * 128, unmapped);
+  for (unsigned cc = 0; cc < 128 && cc < m_midimap.size(); ++cc) {
+    int p = m_midimap[cc];
+    if (p < 0 || p >= int(n) || m_ports[p].type != ControlType ||
+	m_ports[p].direction != InputPort || 
+	m_ports[p].context != AudioContext)
+      continue;
+    MidiControlTarget t = { p, m_ports[p].min_value, 
+			    m_ports[p].max_value - m_ports[p].min_value };
+    for (unsigned channel = 0; channel < 16; ++channel)
+      m_midi_controls[128 * channel + cc] = t;
+  }
+}
+
+
 bool LV2Host::print_uri(const string& bundle) {
   
   // parse
@@ -1125,13 +2758,8 @@ bool LV2Host::print_uri(const string& bundle) {
 
 uint32_t LV2Host::uri_to_id(LV2_URI_Map_Callback_Data callback_data,
 			    const char* umap, const char* uri) {
-  if (umap && !strcmp(umap, LV2_EVENT_URI)) {
-    if (!strcmp(uri, "http://lv2plug.in/ns/ext/midi#MidiEvent"))
-      return 1;
-    else if (!strcmp(uri, "http://lv2plug.in/ns/ext/osc#OscEvent"))
-      return 2;
-  }
-  return 0;
+  // the IDs are unique in all map contexts, so the context doesn't matter
+  return URIMap::get().map(uri);
 }
 
 
@@ -1149,8 +2777,9 @@ uint32_t LV2Host::event_unref(LV2_Event_Callback_Data, LV2_Event* ev) {
 
 void LV2Host::request_run(void* host_handle, const char* context_uri) {
   LV2Host* me = static_cast<LV2Host*>(host_handle);
-  if (string(context_uri) == LV2_CONTEXT_MESSAGE)
-    DBG0("Message context is not yet fully supported");
+  // this may be called in the realtime thread, so no std::string here
+  if (!strcmp(context_uri, LV2_CONTEXT_MESSAGE))
+    me->message_run();
   else
     DBG1("Asked to run unknown context "<<context_uri);
 }
@@ -1222,7 +2851,7 @@ void LV2Host::load_presets_from_uri(const std::string& presetfile, bool user) {
     qr3 = select(name, path)
       .where(preseturi, pr("hasFile"), fn)
       .where(fn, pr("fileName"), name)
-      .where(pv, pr("filePath"), path)
+      .where(fn, pr("filePath"), path)
       .run(preset_data);
     if (qr3.size() > 0) {
       tmp_p.files = 
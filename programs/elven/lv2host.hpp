@@ -32,6 +32,7 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <dlfcn.h>
+#include <stdint.h>
 
 #include <sigc++/slot.h>
 #include <sigc++/signal.h>
@@ -43,6 +44,8 @@
 #include <lv2_contexts.h>
 #include <query.hpp>
 #include "ringbuffer.hpp"
+#include "bufferarena.hpp"
+#include "trace.hpp"
 
 
 enum PortDirection {
@@ -67,7 +70,10 @@ enum PortContext {
 };
 
 
-/** A struct that holds information about a port in a LV2 plugin. */
+/** A struct that holds information about a port in a LV2 plugin. The
+    buffer is the one that the port is connected to when the plugin is
+    activated, after that the realtime thread uses the buffer in the 
+    LV2RTPorts table (they only differ for audio ports). */
 struct LV2Port {
   void* buffer;
   std::string symbol;
@@ -78,11 +84,37 @@ struct LV2Port {
   float min_value;
   float max_value;
   float value;
-  float old_value;
   bool notify;
 };
 
 
+/** The port data that is used in the realtime thread, kept apart from the
+    LV2Port objects so the run loops only touch what they need. The arrays
+    are indexed by port number and each one starts on a new cache line.
+    The index lists hold the port numbers for each kind of port. Message 
+    context ports are left out of the MIDI and control input lists, the 
+    worker thread owns their buffers. */
+struct LV2RTPorts {
+  LV2RTPorts() 
+    : buffers(0), 
+      connected(0), 
+      values(0), 
+      old_values(0), 
+      memory(0) { 
+  }
+  void** buffers;
+  void** connected;
+  float* values;
+  float* old_values;
+  std::vector<uint32_t> audio;
+  std::vector<uint32_t> midi_in;
+  std::vector<uint32_t> midi_out;
+  std::vector<uint32_t> control_in;
+  std::vector<uint32_t> notify;
+  void* memory;
+};
+
+
 struct LV2Preset {
   LV2Preset()
     : files(0),
@@ -127,10 +159,20 @@ public:
       ports. */
   std::vector<LV2Port>& get_ports();
   
+  /** Returns the port table used in the realtime thread. */
+  const LV2RTPorts& get_rt_ports() const;
+  
+  /** Set the buffer that a port should be connected to in the next call to
+      run(). This is meant to be called in the realtime thread. */
+  inline void set_buffer(uint32_t port, void* buffer);
+  
   /** Returns the index of the default MIDI port, or -1 if there is no default
       MIDI port. */
   long get_default_midi_port() const;
   
+  /** Returns the sample rate that the plugin was instantiated with. */
+  unsigned long get_frame_rate() const;
+  
   /** Return the MIDI controller mappings. */
   const std::vector<int>& get_midi_map() const;
   
@@ -152,6 +194,29 @@ public:
   /** Returns all found presets. */
   const std::map<unsigned, LV2Preset>& get_presets() const;
   
+  /** Allocate buffers for all control and event ports, with room for
+      @c event_capacity bytes of events in each event buffer. If 
+      @c audio_frames is larger than 0 all audio ports also get scratch 
+      buffers with room for that many frames. All buffers are placed in a
+      single block of memory that is locked when the plugin is activated.
+      Event and audio buffers are aligned to 64 bytes, and control ports
+      that are written by different threads never share a cache line. */
+  bool allocate_buffers(uint32_t event_capacity, uint32_t audio_frames = 0);
+  
+  /** Allocate new buffers like allocate_buffers() does, but keep the 
+      current control values and connect the plugin to the new buffers if
+      it is active. This is meant to be called when the period size changes,
+      while the realtime thread is not running the plugin. The worker thread
+      is stopped while the buffers are replaced. Audio ports that do not get
+      scratch buffers keep the buffers they have. */
+  bool resize_buffers(uint32_t event_capacity, uint32_t audio_frames = 0);
+  
+  /** Replace the plugin instance with one that runs at @c frame_rate. This
+      is done in the worker thread while the realtime thread outputs 
+      silence. The control values are kept, and so is the plugin state if
+      the plugin can save and restore it. */
+  void set_frame_rate(unsigned long frame_rate);
+  
   /** Activate the plugin. The plugin must be activated before you call the
       run() function. */
   void activate();
@@ -162,37 +227,124 @@ public:
   /** Deactivate the plugin. */
   void deactivate();
   
-  /** Set a control port value. */
+  /** Returns the number of connect_port() calls that run() has skipped
+      because the port buffer had not changed since the last call. */
+  uint64_t get_skipped_connects() const;
+  
+  /** Returns the number of events from other threads or in the input 
+      buffers that have been dropped because there was no room for them. */
+  uint32_t get_dropped_events() const;
+  
+  /** Returns the number of output port changes that could not be sent to
+      the main thread because the ringbuffer was full. */
+  uint32_t get_lost_port_changes() const;
+  
+  /** Set a control port value. The new value is passed to the plugin at the
+      start of the next call to run(), without blocking. */
   void set_control(uint32_t index, float value);
   
-  /** Set the plugin program. */
+  /** Set a control port value at the absolute frame @c frame (see 
+      get_frame()). run() splits the block at the frames where controls
+      change, so the plugin sees the new value at the right sample, unless
+      that would make a segment shorter than the minimum segment size - then
+      the change is delayed to the end of that segment. Changes for frames
+      that have already been run take effect at the start of the next 
+      block. This should only be called from a single thread, and does not
+      block. Returns false if the queue is full. */
+  bool queue_control(uint32_t index, float value, uint64_t frame);
+  
+  /** Set the shortest segment that run() will split a block into. */
+  void set_min_segment(uint32_t frames);
+  
+  /** Handle a MIDI event that arrives @c offset frames into the next block.
+      If it is a control change that is mapped to a control port the new
+      value is staged like a change from queue_control() and true is 
+      returned, otherwise false is returned and the event should be passed
+      on to the plugin. This must only be called from the thread that calls
+      run(), before run() is called for the block, and does not block. */
+  bool handle_midi_control(const unsigned char* data, uint32_t size,
+			   uint32_t offset);
+  
+  /** Make mapped MIDI controllers move their ports to new values in steps
+      over @c frames frames instead of jumping. 0 turns this off. */
+  void set_midi_control_ramp(uint32_t frames);
+  
+  /** In offline mode run() waits for the worker thread to finish saving or
+      restoring the plugin state, instead of outputting silence. */
+  void set_offline(bool offline);
+  
+  /** Wait until the worker thread has done all the state jobs that have
+      been queued, such as the data file restores that set_program() asks
+      for. The plugin is not run while this waits, so this must only be 
+      called from the thread that calls run(), between blocks. It is used
+      in offline mode to make the output independent of thread timing. */
+  void wait_for_state_jobs();
+  
+  /** Returns the number of frames that have been run since the plugin
+      was created. */
+  uint64_t get_frame() const;
+  
+  /** Handle a MIDI bank select or program change that arrives in the next
+      block. Returns true if it was one of those, and the program is then 
+      switched at the start of the next block. The same rules as for
+      handle_midi_control() apply. */
+  bool handle_midi_program(const unsigned char* data, uint32_t size);
+  
+  /** Set the plugin program. The control inputs in the audio context are
+      all switched at once at the start of the next call to run(), and the
+      GUI is told in the next call to run_main(). Message context inputs
+      and data files are restored now. */
   void set_program(unsigned char program);
   
   /** Save the current state as a program. */
   void save_program(unsigned char program, const char* name);
   
-  /** Run the blocking message context. */
+  /** Ask the worker thread to run the message context. Requests that are
+      made before the worker gets to them are merged into one run. This can
+      be called from any thread and does not block. */
   void message_run();
   
-  /** Queue an event. */
+  /** Queue an event. It will be merged into the event buffer for the port
+      in the next call to run(), at the given frame offset. This should only
+      be called from a single thread (normally the GUI thread). */
   void queue_event(uint32_t port, uint16_t type, 
-		   uint32_t size, const uint8_t* midi);
+		   uint32_t size, const uint8_t* midi, uint32_t frames = 0);
   
   /** Queue an entire event buffer. */
   void queue_events(uint32_t port, const LV2_Event_Buffer* buffer);
   
-  /** Save the current state of the plugin. */
+  /** Save the current state of the plugin. This calls the plugin directly,
+      so it must not be used while the plugin is active - save_program()
+      saves the state in the worker thread while the plugin is paused. */
   bool save(const std::string& directory, LV2SR_File*** files);
   
-  /** Restore the plugin to a previously saved state. */
+  /** Restore the plugin to a previously saved state. The same rules as 
+      for save() apply, set_program() restores the state in the worker
+      thread. */
   bool restore(const LV2SR_File** files);
   
+  /** Copy the values that the audio context control inputs had at the end
+      of the last block that changed any of them into @c values, which is 
+      indexed by port. This does not block the realtime thread. Returns
+      false if the plugin has not been activated. */
+  bool get_control_snapshot(std::vector<float>& values) const;
+  
   /** List all available plugins. */
   static void list_plugins();
   
-  /** Run some checks and fire signals in the main thread. */
+  /** Returns the URIs of all plugins in a bundle. */
+  static std::vector<std::string> get_bundle_plugins(const std::string& bundle);
+  
+  /** Send the output port changes from the realtime thread to the signals.
+      This should be called in the main thread when the notification file
+      descriptor becomes readable. */
   void run_main();
   
+  /** Returns a file descriptor that becomes readable when there are output
+      port changes for run_main() to handle, or -1 if the host can't provide
+      one (in which case run_main() has to be polled). */
+  int get_notification_fd() const;
+  
   sigc::signal<void, uint32_t, uint32_t, uint32_t, const void*> 
   signal_port_event;
   
@@ -206,20 +358,90 @@ protected:
   
   typedef sigc::slot<bool, const std::string&> scan_callback_t;
   
-  struct Event {
-    Event(uint32_t p, uint16_t t, uint32_t s, const uint8_t* d) 
-      : port(p), type(t), event_size(s), data(0), written(false) {
-      data = new uint8_t[event_size];
-      std::memcpy(data, d, event_size);
-    }
-    ~Event() {
-      delete [] data;
-    }
+  /** The header for events passed to the realtime thread through the event
+      queue. It is followed by @c size bytes of event data. */
+  struct EventHeader {
     uint32_t port;
+    uint32_t frames;
     uint16_t type;
-    uint32_t event_size;
-    uint8_t* data;
-    bool written;
+    uint16_t size;
+  };
+  
+  /** Port number used to mark events in the stage that have been written. */
+  static const uint32_t WrittenEvent = 0xFFFFFFFF;
+  
+  /** A changed output port value, sent from the realtime thread to the main
+      thread. @c frame is the position of the cycle where it changed. */
+  struct PortChange {
+    uint32_t port;
+    float value;
+    uint64_t frame;
+  };
+  
+  /** The parts of a plugin that are the same for all instances of it: the
+      parsed RDF data and the loaded library. They are kept in a static map
+      so only the first instance of a plugin has to scan the bundles, parse
+      the RDF and dlopen() the library. The library is closed when the last
+      instance is destroyed, the RDF data is kept. */
+  struct SharedData {
+    std::string uri;
+    std::string bundle;
+    std::vector<std::string> rdffiles;
+    std::string binary;
+    std::string name;
+    std::vector<LV2Port> ports;
+    std::vector<int> midimap;
+    long default_midi_port;
+    std::string iconpath;
+    std::string plugingui;
+    std::string guiuri;
+    std::vector<std::string> preset_files;
+    bool saverestore;
+    bool message_context;
+    void* libhandle;
+    unsigned users;
+  };
+  
+  /** A control change for a given absolute frame, queued by 
+      queue_control(). */
+  struct ControlChange {
+    uint32_t port;
+    float value;
+    uint64_t frame;
+  };
+  
+  /** The number of control changes that can wait for later blocks. */
+  static const size_t ChangeStageSize = 1024;
+  
+  /** The most steps a MIDI controller ramp is split into. */
+  static const uint32_t MaxRampSteps = 64;
+  
+  /** The audio context control values of all presets, compiled to flat 
+      arrays so the realtime thread can switch programs without looking 
+      anything up. Program @c programs[i].program uses the ports and values
+      from @c programs[i].begin to @c programs[i].end, and the programs are
+      sorted by number. */
+  struct ProgramTable {
+    struct Entry {
+      uint32_t program;
+      uint32_t begin;
+      uint32_t end;
+    };
+    std::vector<Entry> programs;
+    std::vector<uint32_t> ports;
+    std::vector<float> values;
+  };
+  
+  /** Set in m_program_changed when the program came from the MIDI input. */
+  static const uint32_t MidiProgramFlag = 0x80000000;
+  
+  /** The control port that a MIDI controller on a channel is mapped to,
+      with the port range so the realtime thread doesn't have to look it
+      up. @c port is -1 for controllers that are not mapped. */
+  struct MidiControlTarget {
+    int32_t port;
+    float min;
+    float range;
   };
   
   static bool scan_manifests(const std::vector<std::string>& search_dirs, 
@@ -232,8 +454,21 @@ protected:
   bool parse_ports(PAQ::RDFData& data, const std::string& parent, 
 		   const std::string& predicate, PortContext context);
   
+  /** Find or create the shared data for m_uri and copy it to this
+      instance. Must be called with m_shared_mutex locked. */
+  SharedData* get_shared_data();
+  
+  void release_shared_data();
+  
+  bool parse_data(SharedData& shared);
+  
   bool load_plugin();
   
+  /** Create the plugin instance at the current sample rate. */
+  bool instantiate();
+  
+  void init_rt_ports();
+  
   bool add_preset(const LV2Preset& preset, int program = -1);
   
   void merge_presets();
@@ -242,6 +477,131 @@ protected:
   
   static bool print_uri(const std::string& bundle);
   
+  void merge_queued_events(unsigned long nframes);
+  
+  void merge_port_events(uint32_t port, unsigned long nframes);
+  
+  /** Move queued control changes to the stage, and return the number of
+      them that are due in this block. */
+  size_t collect_control_changes(unsigned long nframes);
+  
+  /** Insert a control change in the stage, after the ones with the same or
+      earlier frames. Returns false if the stage is full. */
+  bool stage_control_change(const ControlChange& c);
+  
+  /** Run the plugin in segments that start where controls change. */
+  void run_segments(unsigned long nframes, size_t due);
+  
+  /** Run one segment of the block. */
+  void run_segment(uint32_t offset, uint32_t nframes, bool last);
+  
+  void apply_control_change(const ControlChange& c);
+  
+  /** Build a new program table from the presets and replace the old one
+      when the realtime thread can not be using it. */
+  void compile_programs();
+  
+  static const ProgramTable::Entry* find_program(const ProgramTable& table,
+						 uint32_t program);
+  
+  /** Switch the audio context control inputs to a program. Only called in
+      the realtime thread. Returns false if there is no such program. */
+  bool apply_program(uint32_t program, bool midi);
+  
+  /** Do the parts of a program change that the realtime thread can't do,
+      and tell the GUI about it. */
+  void finish_program(uint32_t program, bool midi);
+  
+  /** Set the message context inputs of a preset, and ask the worker 
+      thread to restore its data files. */
+  void restore_preset_data(const LV2Preset& preset);
+  
+  /** A data file of a preset: the name that the plugin knows it by, and
+      the path. */
+  typedef std::pair<std::string, std::string> StateFile;
+  
+  /** A user preset, as it is written to the preset file. */
+  struct PresetRecord {
+    unsigned program;
+    std::string name;
+    std::map<uint32_t, float> values;
+    std::vector<StateFile> files;
+  };
+  
+  /** Work that the worker thread does for the main thread. The plugin's
+      save() and restore() may not run at the same time as run(), so the
+      worker pauses the realtime thread for them. A restore job restores 
+      @c files. A save job saves the plugin state to files for @c program
+      if the plugin can do that, and writes @c presets (with the new files)
+      to the user preset file. A reinstantiate job replaces the plugin
+      instance with one that runs at @c rate. The finished jobs are sent
+      back to the main thread. */
+  struct StateJob {
+    enum Type {
+      Restore,
+      Save,
+      Reinstantiate
+    };
+    Type type;
+    std::vector<StateFile> files;
+    unsigned program;
+    unsigned long rate;
+    std::vector<PresetRecord> presets;
+    bool ok;
+  };
+  
+  /** Give a job to the worker thread. */
+  void queue_state_job(StateJob* job);
+  
+  /** Do a job in the worker thread. Returns false if the job could not 
+      pause the plugin because the worker is stopping, the job has not 
+      been done then and should run again when the worker is restarted. */
+  bool run_state_job(StateJob& job);
+  
+  /** Take a finished job back in the main thread. */
+  void finish_state_job(StateJob* job);
+  
+  /** Stop the realtime thread from running the plugin, and wait until it
+      has stopped. Returns false if the worker thread is asked to quit 
+      first. */
+  bool pause_plugin();
+  
+  void resume_plugin();
+  
+  /** Replace the plugin instance with a new one at another sample rate, in
+      the worker thread while the plugin is paused. If the new instance 
+      can't be created the old one is activated again. */
+  bool reinstantiate(unsigned long rate);
+  
+  /** Write the user presets to the user preset file, and add the file to
+      the user data manifest if it isn't there. Only called in the worker
+      thread. */
+  bool write_user_presets(const std::vector<PresetRecord>& presets);
+  
+  /** Copy the audio context control inputs to the snapshot that 
+      get_control_snapshot() doesn't read. Only called in run(). */
+  void publish_snapshot();
+  
+  /** Silence the outputs while the plugin is paused. */
+  void silence_outputs(unsigned long nframes);
+  
+  /** Start the worker thread that runs the message context and the state
+      jobs. */
+  void start_worker();
+  
+  void stop_worker();
+  
+  static void* worker_thread(void* arg);
+  
+  /** The worker thread: run the state jobs, and if the message context 
+      should run copy the new inputs to the ports, run the plugin and send
+      the changed outputs to the main thread. */
+  void worker_loop();
+  
+  /** Move queued events to the message context event ports. Returns false
+      if some of them did not fit. */
+  bool write_message_events();
+  
   static uint32_t uri_to_id(LV2_URI_Map_Callback_Data callback_data,
 			    const char* umap, const char* uri);
   
@@ -276,6 +636,7 @@ protected:
   const LV2_Descriptor* m_desc;
   const LV2SR_Descriptor* m_sr_desc;
   const LV2_Blocking_Context* m_msg_desc;
+  bool m_active;
   
   LV2_URI_Map_Feature m_urimap_host_desc;
   LV2_Event_Feature m_event_host_desc;
@@ -283,7 +644,10 @@ protected:
   
   std::vector<LV2Port> m_ports;
   size_t m_ports_used;
-  bool m_ports_updated;
+  LV2RTPorts m_rt;
+  uint64_t m_skipped_connects;
+  // bit i % 32 in word i / 32 is set when control port i has a new value
+  std::vector<uint32_t> m_dirty_controls;
   std::vector<int> m_midimap;
   long m_default_midi_port;
   std::string m_iconpath;
@@ -296,20 +660,109 @@ protected:
   bool m_program_is_valid;
   bool m_new_program;
   
-  std::vector<Event*> m_midi_events;
-  
-  // big lock
-  pthread_mutex_t m_mutex;
-  
-  // output notification semaphore
-  sem_t m_notification_sem;
+  // events from other threads, and the ones that did not fit in the
+  // port buffers yet (only touched by the realtime thread)
+  Ringbuffer<unsigned char, 65536> m_event_queue;
+  std::vector<unsigned char> m_event_stage;
+  size_t m_event_stage_used;
+  LV2_Event_Buffer* m_merge_buffer;
+  
+  // timestamped control changes from another thread, and the ones that
+  // are not due yet sorted by frame (only touched by the realtime thread)
+  Ringbuffer<ControlChange, 1024> m_control_changes;
+  std::vector<ControlChange> m_change_stage;
+  size_t m_change_stage_used;
+  uint32_t m_min_segment;
+  // the control port for each MIDI controller on each channel, 
+  // 128 * channel + controller
+  std::vector<MidiControlTarget> m_midi_controls;
+  uint32_t m_midi_control_ramp;
+  
+  // the compiled presets, replaced by the main thread when a preset is
+  // saved; m_run_cycles is odd while run() may be using the old table
+  ProgramTable* volatile m_program_table;
+  volatile unsigned m_run_cycles;
+  // program + 1 requested by the main thread and by the MIDI input (only
+  // touched by the realtime thread), or 0, and the last program that the
+  // realtime thread switched to for the main thread
+  volatile uint32_t m_program_request;
+  uint32_t m_midi_bank;
+  uint32_t m_midi_program;
+  volatile uint32_t m_program_changed;
+  // event buffers for running a part of a block, for each event port in
+  // the audio context (0 for other ports)
+  std::vector<LV2_Event_Buffer*> m_segment_events;
+  
+  // the worker thread and the trace buffer that it keeps when it is 
+  // restarted, the inputs from other threads that it should copy to the
+  // message context ports before it runs the plugin (bit i % 32 in word 
+  // i / 32 is set when m_message_values[i] is new), the events for the
+  // message context ports, and the changed outputs for the main thread
+  pthread_t m_worker_thread;
+  TraceBuffer* m_trace_buffer;
+  bool m_worker_running;
+  sem_t m_worker_sem;
+  volatile int m_message_requested;
+  volatile int m_worker_quit;
+  std::vector<uint32_t> m_dirty_messages;
+  std::vector<float> m_message_values;
+  Ringbuffer<unsigned char, 16384> m_message_events;
+  Ringbuffer<PortChange, 256> m_message_changes;
+  std::vector<float> m_message_outputs;
+  volatile int m_message_changes_lost;
+  
+  // state jobs for the worker thread and finished ones for the main thread,
+  // the job that was interrupted when the worker was stopped, the number of
+  // jobs that have been queued but not done yet, and the pause handshake:
+  // the worker makes m_pause_request odd to pause the plugin and the 
+  // realtime thread copies it to m_pause_ack when it has stopped running
+  // the plugin
+  Ringbuffer<StateJob*, 64> m_state_jobs;
+  Ringbuffer<StateJob*, 64> m_finished_jobs;
+  StateJob* m_interrupted_job;
+  volatile int m_pending_jobs;
+  volatile unsigned m_pause_request;
+  volatile unsigned m_pause_ack;
+  bool m_offline;
+  
+  // two copies of the audio context control input values, the one that is
+  // not being written is number m_snapshot_seq % 2
+  std::vector<float> m_snapshots[2];
+  volatile unsigned m_snapshot_seq;
+  
+  // the memory for all port buffers
+  BufferArena m_arena;
+  
+  // output port changes for the main thread, and the eventfd that tells it
+  // to read them
+  Ringbuffer<PortChange, 1024> m_port_changes;
+  int m_notification_fd;
+  volatile int m_wakeup_pending;
+  volatile int m_port_changes_lost;
+  volatile uint32_t m_lost_port_changes;
+  volatile uint32_t m_dropped_events;
+  uint64_t m_frame;
+  
+  // the last sent values, only used in the main thread
+  std::vector<float> m_notify_values;
+  std::vector<uint32_t> m_notify_list;
+  std::vector<bool> m_notify_pending;
   
   std::map<unsigned, LV2Preset> m_presets;
   std::vector<LV2Preset> m_tmp_presets;
   
   static std::string m_user_data_bundle;
   unsigned m_next_free_preset;
+  
+  SharedData* m_shared;
+  static std::map<std::string, SharedData*> m_shared_data;
+  static pthread_mutex_t m_shared_mutex;
 };
 
 
+void LV2Host::set_buffer(uint32_t port, void* buffer) {
+  m_rt.buffers[port] = buffer;
+}
+
+
 #endif
@@ -24,12 +24,14 @@
 #include <clocale>
 #include <csignal>
 #include <cstdlib>
+#include <ctime>
 #include <fstream>
 #include <iostream>
 #include <vector>
 #include <unistd.h>
 #include <sstream>
 
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <jack/jack.h>
@@ -39,8 +41,22 @@
 #include "lv2guihost.hpp"
 #include "lv2host.hpp"
 #include <lv2_event_helpers.h>
+#include "automation.hpp"
+#include "batch.hpp"
+#include "bench.hpp"
 #include "debug.hpp"
+#include "graph.hpp"
+#include "midifile.hpp"
 #include "midiutils.hpp"
+#include "oversampler.hpp"
+#include "render.hpp"
+#include "rtcheck.hpp"
+#include "rtprofile.hpp"
+#include "scheduler.hpp"
+#include "server.hpp"
+#include "telemetry.hpp"
+#include "trace.hpp"
+#include "urimap.hpp"
 
 
 using namespace std;
@@ -50,6 +66,15 @@ using namespace sigc;
 vector<jack_port_t*> jack_ports;
 jack_client_t* jack_client;
 bool still_running;
+RTProfile rt_profile;
+Telemetry telemetry;
+GraphScheduler* graph_scheduler = 0;
+Oversampler* oversampler = 0;
+volatile sig_atomic_t trace_requested = 0;
+double events_per_frame = 1;
+jack_nframes_t buffer_size = 0;
+jack_nframes_t sample_rate = 0;
+volatile jack_nframes_t new_sample_rate = 0;
 
 
 void autoconnect(jack_client_t* client) {
@@ -247,14 +272,21 @@ void lv2midi2jackmidi(LV2Port& port, jack_port_t* jack_port,
     LV2_Event* ev = lv2_event_get(&iter, &data);
     lv2_event_increment(&iter);
     
-    if (ev->type == 1) {
+    if (ev->type == URIMap::MidiEvent) {
       DBG3("Received MIDI event from the plugin on port "<<port.symbol
 	   <<": "<<midi2str(ev->size, data));
       
       // write JACK MIDI event
-      jack_midi_event_write(output_buf, jack_nframes_t(ev->frames), 
-			    reinterpret_cast<jack_midi_data_t*>(data), 
-			    ev->size);
+      if (jack_midi_event_write(output_buf, jack_nframes_t(ev->frames), 
+				reinterpret_cast<jack_midi_data_t*>(data), 
+				ev->size))
+	telemetry.count_midi_overflow();
+    }
+    
+    else {
+      const char* uri = URIMap::get().unmap(ev->type);
+      DBG3("Ignoring event of type "<<(uri ? uri : "unknown")
+	   <<" from the plugin on port "<<port.symbol);
     }
   }
 }
@@ -266,7 +298,7 @@ void jackmidi2lv2midi(jack_port_t* jack_port, LV2Port& port,
   
   DBG4("Translating MIDI events from JACK to LV2 for port "<<port.symbol);
   
-  static unsigned bank = 0;
+  unsigned factor = (oversampler ? oversampler->get_factor() : 1);
   
   void* input_buf = jack_port_get_buffer(jack_port, nframes);
   jack_midi_event_t input_event;
@@ -280,7 +312,6 @@ void jackmidi2lv2midi(jack_port_t* jack_port, LV2Port& port,
   output_buf->event_count = 0;
   
   // iterate over all incoming JACK MIDI events
-  unsigned char* data = output_buf->data;
   for (unsigned int i = 0; i < input_event_count; ++i) {
     
     // retrieve JACK MIDI event
@@ -289,49 +320,27 @@ void jackmidi2lv2midi(jack_port_t* jack_port, LV2Port& port,
     DBG3("Received MIDI event from JACK on port "<<port.symbol
          <<": "<<midi2str(input_event.size, input_event.buffer));
     
-    if ((data - output_buf->data) + sizeof(double) + 
-        sizeof(size_t) + input_event.size >= output_buf->capacity)
-      break;
-    
-    // check if it's a bank select MSB
-    if ((input_event.size == 3) && ((input_event.buffer[0] & 0xF0) == 0xB0) &&
-        (input_event.buffer[1] == 0)) {
-      bank = (bank & 0x7F) + (input_event.buffer[2] & 0x7F) << 7;
-    }
-    
-    // LSB
-    else if ((input_event.size == 3) && 
-             ((input_event.buffer[0] & 0xF0) == 0xB0) &&
-             (input_event.buffer[1] == 32)) {
-      bank = (bank & (0x7F << 7)) + (input_event.buffer[2] & 0x7F);
+    // check if it's a bank select or a program change, the host switches
+    // programs at the start of the next cycle
+    if (host.handle_midi_program(input_event.buffer, input_event.size)) {
+      DBG3("Passed bank select or program change to the host");
     }
     
-    // or a mapped CC
-    else if ((input_event.size == 3) && 
-             ((input_event.buffer[0] & 0xF0) == 0xB0) &&
-             (host.get_midi_map()[input_event.buffer[1]] != -1)) {
-      int port = host.get_midi_map()[input_event.buffer[1]];
-      float* pbuf = static_cast<float*>(host.get_ports()[port].buffer);
-      float& min = host.get_ports()[port].min_value;
-      float& max = host.get_ports()[port].max_value;
-      *pbuf = min + (max - min) * input_event.buffer[2] / 127.0;
-      DBG3("Mapped CC event to port "<<port);
-      // XXX notify the main thread somehow
-      //host.queue_control(port, *pbuf, false);
+    // or a mapped CC, which becomes a timestamped control change (the
+    // host runs at the oversampled rate if there is an oversampler)
+    else if (host.handle_midi_control(input_event.buffer, input_event.size,
+				      input_event.time * factor)) {
+      DBG4("Staged mapped CC event from port "<<port.symbol);
     }
     
-    // or a program change
-    /*
-      else if ((input_event.size == 2) && 
-      ((input_event.buffer[0] & 0xF0) == 0xC0)) {
-      host.select_program(128 * bank + input_event.buffer[1]);
-      }
-    */
-    
     else {
-      // write LV2 MIDI event
-      lv2_event_write(&iter, input_event.time, 0, 1, 
-		      input_event.size, input_event.buffer);
+      // write LV2 MIDI event, the rest of the events are still read if it
+      // doesn't fit since they may be program changes or mapped CCs
+      if (!lv2_event_write(&iter, input_event.time, 0, URIMap::MidiEvent,
+			   input_event.size, input_event.buffer)) {
+	DBG3("The event buffer for port "<<port.symbol<<" is full");
+	telemetry.count_midi_overflow();
+      }
       
       // XXX add normalisation again
       // normalise note events if needed
@@ -348,46 +357,271 @@ void jackmidi2lv2midi(jack_port_t* jack_port, LV2Port& port,
 /** The JACK process callback */
 int process(jack_nframes_t nframes, void* arg) {
   
+  RTCheck::enter();
+  telemetry.begin_cycle(nframes);
+  
   LV2Host* host = static_cast<LV2Host*>(arg);
+  const LV2RTPorts& rt = host->get_rt_ports();
   
-  // iterate over all ports and copy data from JACK ports to audio and MIDI
-  // ports in the plugin
-  for (size_t i = 0; i < host->get_ports().size(); ++i) {
-    
-    // does this plugin port have an associated JACK port?
-    if (jack_ports[i]) {
-
-      LV2Port& port = host->get_ports()[i];
-      
-      // audio port, just copy the buffer pointer.
-      if (port.type == AudioType)
-        port.buffer = jack_port_get_buffer(jack_ports[i], nframes);
-      
-      // MIDI input port, copy the events one by one
-      else if (port.type == MidiType && port.direction == InputPort)
-        jackmidi2lv2midi(jack_ports[i], port, *host, nframes);
-      
-    }
+  // audio ports, just copy the buffer pointers
+  for (size_t j = 0; j < rt.audio.size(); ++j) {
+    uint32_t i = rt.audio[j];
+    if (oversampler)
+      oversampler->set_buffer(i, jack_port_get_buffer(jack_ports[i], nframes));
+    else
+      host->set_buffer(i, jack_port_get_buffer(jack_ports[i], nframes));
   }
   
+  // MIDI input ports, copy the events one by one
+  trace_begin(TraceMidiIn);
+  for (size_t j = 0; j < rt.midi_in.size(); ++j) {
+    uint32_t i = rt.midi_in[j];
+    jackmidi2lv2midi(jack_ports[i], host->get_ports()[i], *host, nframes);
+  }
+  trace_end(TraceMidiIn);
+  telemetry.end_phase(Telemetry::InputPhase);
+  
   // run the plugin!
-  host->run(nframes);
+  if (oversampler)
+    oversampler->run(nframes);
+  else
+    host->run(nframes);
+  telemetry.end_phase(Telemetry::RunPhase);
   
   // Copy events from MIDI output ports to JACK ports
-  for (size_t i = 0; i < host->get_ports().size(); ++i) {
-    if (jack_ports[i]) {
-      LV2Port& port = host->get_ports()[i];
-      if (port.type == MidiType && port.direction == OutputPort)
-        lv2midi2jackmidi(port, jack_ports[i], nframes);
+  trace_begin(TraceMidiOut);
+  for (size_t j = 0; j < rt.midi_out.size(); ++j) {
+    uint32_t i = rt.midi_out[j];
+    lv2midi2jackmidi(host->get_ports()[i], jack_ports[i], nframes);
+  }
+  trace_end(TraceMidiOut);
+  telemetry.end_phase(Telemetry::OutputPhase);
+  
+  telemetry.end_cycle();
+  RTCheck::leave();
+  
+  return 0;
+}
+
+
+/** The JACK process callback for a plugin graph. The JACK ports are the
+    external ports of the graph, in the same order. */
+int graph_process(jack_nframes_t nframes, void* arg) {
+  
+  RTCheck::enter();
+  telemetry.begin_cycle(nframes);
+  
+  PluginGraph* graph = static_cast<PluginGraph*>(arg);
+  const vector<PluginGraph::Node>& nodes = graph->get_nodes();
+  const vector<PluginGraph::ExternalPort>& external = 
+    graph->get_external_ports();
+  
+  // audio buffers and MIDI input
+  trace_begin(TraceMidiIn);
+  for (size_t j = 0; j < external.size(); ++j) {
+    LV2Host* host = nodes[external[j].node].host;
+    LV2Port& port = host->get_ports()[external[j].port];
+    if (port.type == AudioType)
+      host->set_buffer(external[j].port, 
+		       jack_port_get_buffer(jack_ports[j], nframes));
+    else if (port.direction == InputPort && port.context == AudioContext)
+      jackmidi2lv2midi(jack_ports[j], port, *host, nframes);
+  }
+  trace_end(TraceMidiIn);
+  telemetry.end_phase(Telemetry::InputPhase);
+  
+  if (graph_scheduler)
+    graph_scheduler->run(nframes);
+  else
+    graph->run(nframes);
+  telemetry.end_phase(Telemetry::RunPhase);
+  
+  // MIDI output
+  trace_begin(TraceMidiOut);
+  for (size_t j = 0; j < external.size(); ++j) {
+    LV2Port& port = 
+      nodes[external[j].node].host->get_ports()[external[j].port];
+    if (port.type == MidiType && port.direction == OutputPort &&
+	port.context == AudioContext)
+      lv2midi2jackmidi(port, jack_ports[j], nframes);
+  }
+  trace_end(TraceMidiOut);
+  telemetry.end_phase(Telemetry::OutputPhase);
+  
+  telemetry.end_cycle();
+  RTCheck::leave();
+  
+  return 0;
+}
+
+
+/** The JACK process callback for the server mode. */
+int server_process(jack_nframes_t nframes, void* arg) {
+  
+  RTCheck::enter();
+  telemetry.begin_cycle(nframes);
+  
+  HostServer* server = static_cast<HostServer*>(arg);
+  const HostServer::InstanceList& instances = server->begin_cycle();
+  
+  // audio buffers and MIDI input
+  trace_begin(TraceMidiIn);
+  for (size_t k = 0; k < instances.size(); ++k) {
+    LV2Host* host = instances[k]->host;
+    const vector<jack_port_t*>& ports = instances[k]->ports;
+    const LV2RTPorts& rt = host->get_rt_ports();
+    for (size_t j = 0; j < rt.audio.size(); ++j) {
+      uint32_t i = rt.audio[j];
+      host->set_buffer(i, jack_port_get_buffer(ports[i], nframes));
+    }
+    for (size_t j = 0; j < rt.midi_in.size(); ++j) {
+      uint32_t i = rt.midi_in[j];
+      jackmidi2lv2midi(ports[i], host->get_ports()[i], *host, nframes);
     }
   }
+  trace_end(TraceMidiIn);
+  telemetry.end_phase(Telemetry::InputPhase);
   
+  for (size_t k = 0; k < instances.size(); ++k)
+    instances[k]->host->run(nframes);
+  telemetry.end_phase(Telemetry::RunPhase);
+  
+  // MIDI output
+  trace_begin(TraceMidiOut);
+  for (size_t k = 0; k < instances.size(); ++k) {
+    LV2Host* host = instances[k]->host;
+    const LV2RTPorts& rt = host->get_rt_ports();
+    for (size_t j = 0; j < rt.midi_out.size(); ++j) {
+      uint32_t i = rt.midi_out[j];
+      lv2midi2jackmidi(host->get_ports()[i], instances[k]->ports[i], nframes);
+    }
+  }
+  trace_end(TraceMidiOut);
+  telemetry.end_phase(Telemetry::OutputPhase);
+  
+  server->end_cycle();
+  telemetry.end_cycle();
+  RTCheck::leave();
+  
+  return 0;
+}
+
+
+/** Returns the size of the event buffers for periods of @c nframes frames.
+    A MIDI event takes 16 bytes in an LV2 event buffer (a 12 byte header
+    and 3 bytes of data, padded to 8 bytes), and there is room for at least
+    256 events. */
+uint32_t event_capacity(jack_nframes_t nframes) {
+  double events = nframes * events_per_frame;
+  if (events < 256)
+    events = 256;
+  return 16 * uint32_t(events + 0.5);
+}
+
+
+/** The JACK buffer size callback. JACK does not run the process callback
+    while this is called, so the buffers can be replaced. */
+int buffer_size_changed(jack_nframes_t nframes, void* arg) {
+  if (nframes == buffer_size)
+    return 0;
+  DBG1("The JACK period size changed to "<<nframes<<" frames");
+  LV2Host* host = static_cast<LV2Host*>(arg);
+  unsigned factor = (oversampler ? oversampler->get_factor() : 1);
+  if (!host->resize_buffers(event_capacity(nframes), 
+			    factor > 1 ? nframes * factor : 0)) {
+    DBG0("Could not resize the port buffers!");
+    return 1;
+  }
+  if (oversampler) {
+    delete oversampler;
+    oversampler = new Oversampler(*host, factor, nframes);
+  }
+  buffer_size = nframes;
+  telemetry.set_event_capacity(event_capacity(nframes));
+  return 0;
+}
+
+
+/** The JACK buffer size callback for a plugin graph. */
+int graph_buffer_size_changed(jack_nframes_t nframes, void* arg) {
+  if (nframes == buffer_size)
+    return 0;
+  DBG1("The JACK period size changed to "<<nframes<<" frames");
+  PluginGraph* graph = static_cast<PluginGraph*>(arg);
+  if (!graph->resize_buffers(nframes, event_capacity(nframes))) {
+    DBG0("Could not resize the port buffers!");
+    return 1;
+  }
+  buffer_size = nframes;
+  telemetry.set_event_capacity(event_capacity(nframes));
+  return 0;
+}
+
+
+/** The JACK buffer size callback for the server mode. */
+int server_buffer_size_changed(jack_nframes_t nframes, void* arg) {
+  if (nframes == buffer_size)
+    return 0;
+  DBG1("The JACK period size changed to "<<nframes<<" frames");
+  HostServer* server = static_cast<HostServer*>(arg);
+  if (!server->set_event_capacity(event_capacity(nframes)))
+    return 1;
+  buffer_size = nframes;
+  telemetry.set_event_capacity(event_capacity(nframes));
+  return 0;
+}
+
+
+/** The JACK sample rate callback. The plugins are reinstantiated in the
+    main thread. */
+int sample_rate_changed(jack_nframes_t rate, void*) {
+  new_sample_rate = rate;
+  return 0;
+}
+
+
+/** Reinstantiate the plugins with @c set_rate if the JACK sample rate has
+    changed. */
+bool check_sample_rate(sigc::slot<void, unsigned long> set_rate) {
+  jack_nframes_t rate = new_sample_rate;
+  if (rate == 0 || rate == sample_rate)
+    return true;
+  clog<<"The JACK sample rate changed from "<<sample_rate<<" to "<<rate
+      <<", reinstantiating"<<endl;
+  sample_rate = rate;
+  telemetry.set_sample_rate(rate);
+  set_rate(rate);
+  return true;
+}
+
+
+/** Set the sample rate of a plugin that may be oversampled. */
+void set_host_rate(unsigned long rate, LV2Host* host) {
+  host->set_frame_rate(rate * (oversampler ? oversampler->get_factor() : 1));
+}
+
+
+/** The JACK xrun callback */
+int xrun(void*) {
+  telemetry.count_xrun();
   return 0;
 }
 
 
 void thread_init(void*) {
-  DebugInfo::thread_prefix()[pthread_self()] = "J ";
+  DebugInfo::thread_prefix() = "J ";
+  Trace::register_thread("JACK");
+  rt_profile.apply_thread();
+  rt_profile.report_thread(clog);
+  DebugInfo::realtime() = true;
+}
+
+
+void worker_init(void*) {
+  DebugInfo::thread_prefix() = "W ";
+  Trace::register_thread("Worker");
+  rt_profile.apply_worker();
+  DebugInfo::realtime() = true;
 }
 
 
@@ -398,6 +632,21 @@ void sigchild(int signal) {
 }
 
 
+void sigusr1(int) {
+  trace_requested = 1;
+}
+
+
+/** Write the trace if SIGUSR1 has been received. */
+bool check_trace_request(const char* trace_file) {
+  if (trace_requested) {
+    trace_requested = 0;
+    Trace::write(trace_file);
+  }
+  return true;
+}
+
+
 void print_version() {
   clog<<"Elven is an (E)xperimental (LV)2 (E)xecution e(N)vironment.\n"
       <<"Version " VERSION 
@@ -410,7 +659,34 @@ void print_version() {
 void print_usage(const char* argv0) {
   clog<<"usage:   "<<argv0<<" --help\n"
       <<"         "<<argv0<<" --list\n"
-      <<"         "<<argv0<<" [--debug DEBUGLEVEL] [--nogui] PLUGIN_URI\n\n"
+      <<"         "<<argv0<<" [--debug DEBUGLEVEL] [--deferred-debug] "
+      <<"[--rt SETTINGS] [--rtcheck]\n"
+      <<"         [--stats-socket PATH] [--trace FILE]\n"
+      <<"         [--oversample 2|4|8] [--cc-ramp FRAMES] "
+      <<"[--min-segment FRAMES]\n"
+      <<"         [--events-per-frame EVENTS] [--nogui] PLUGIN_URI\n"
+      <<"         "<<argv0<<" [--debug DEBUGLEVEL] [--rt SETTINGS] "
+      <<"[--rtcheck]\n"
+      <<"         [--stats-socket PATH] [--trace FILE] [--threads N] "
+      <<"--graph FILE\n"
+      <<"         [--events-per-frame EVENTS]\n"
+      <<"         "<<argv0<<" [--debug DEBUGLEVEL] [--rt SETTINGS] "
+      <<"[--rtcheck]\n"
+      <<"         [--stats-socket PATH] [--trace FILE] --server PATH\n"
+      <<"         [--events-per-frame EVENTS]\n"
+      <<"         "<<argv0<<" --render MIDIFILE --out SOUNDFILE [--rate RATE]\n"
+      <<"         [--block FRAMES] [--tail SECONDS] [--automation FILE]\n"
+      <<"         [--cc-ramp FRAMES] [--min-segment FRAMES] PLUGIN_URI\n"
+      <<"         "<<argv0<<" --batch DIRECTORY [--set SYMBOL=VALUE]...\n"
+      <<"         [--preset PROGRAM] [--threads N] [--rate RATE]\n"
+      <<"         [--block FRAMES] [--tail SECONDS] PLUGIN_URI FILE...\n"
+      <<"         "<<argv0<<" --bench [--bench-midi chords|notes]\n"
+      <<"         [--bench-seconds SECONDS] [--rate RATE]\n"
+      <<"         PLUGIN_URI|BUNDLE...\n"
+      <<"         "<<argv0<<" --bench --graph FILE [--threads N] "
+      <<"[--block FRAMES]\n"
+      <<"         [--bench-midi chords|notes] [--bench-seconds SECONDS] "
+      <<"[--rate RATE]\n\n"
       <<"example: "<<argv0
       <<" http://ll-plugins.nongnu.org/lv2/dev/klaviatur/0.0.0\n"
       <<endl;
@@ -423,7 +699,423 @@ void print_help(const char* argv0) {
       <<"URI as a substring. Thus '"<<argv0<<" klav' will load the plugin\n"
       <<"with the URI http://ll-plugins.nongnu.org/lv2/dev/klaviatur/0.0.0,\n"
       <<"unless Elven happens to find another plugin whose URI contains\n"
-      <<"the substring 'klav' first."<<endl;
+      <<"the substring 'klav' first.\n\n"
+      <<"The --rt option takes a comma separated list of realtime settings\n"
+      <<"for the JACK thread. The settings in the environment variable\n"
+      <<"ELVEN_RT_PROFILE are used too. Available settings are:\n"
+      <<"  mlock      lock all memory with mlockall()\n"
+      <<"  prefault   touch the stack of the JACK thread before it runs\n"
+      <<"  denormals  flush denormals to zero in the JACK thread\n"
+      <<"  cpu=N      bind the JACK thread to CPU N\n"
+      <<"  isolated   bind the JACK thread to an isolated CPU\n"
+      <<"  policy     check that the JACK thread is SCHED_FIFO or SCHED_RR\n"
+      <<"  all        mlock, prefault, denormals and policy\n\n"
+      <<"The --rtcheck option makes Elven record every call to malloc(),\n"
+      <<"free(), new, delete and blocking pthread functions that is made\n"
+      <<"in the JACK process callback, and print a summary with backtraces\n"
+      <<"when it exits.\n\n"
+      <<"The --stats-socket option makes Elven measure the DSP load and\n"
+      <<"count xruns and dropped events, and write the statistics as\n"
+      <<"'key value' lines to anyone who connects to the Unix domain\n"
+      <<"socket at PATH.\n\n"
+      <<"The --trace option makes Elven record the phases of the JACK\n"
+      <<"callback and the GUI updates and write them to FILE in the\n"
+      <<"Chrome trace event format when it exits or receives SIGUSR1.\n\n"
+      <<"The --oversample option runs the plugin at 2, 4 or 8 times the\n"
+      <<"JACK sample rate, with halfband filters that upsample the audio\n"
+      <<"inputs and downsample the outputs. This reduces aliasing in\n"
+      <<"nonlinear plugins. The added latency is printed and reported on\n"
+      <<"the JACK output ports.\n\n"
+      <<"MIDI controllers that the plugin maps to control inputs change\n"
+      <<"the inputs at the right sample instead of at the start of the\n"
+      <<"period, by running the plugin in shorter segments. No segment is\n"
+      <<"shorter than --min-segment frames (default: 32) unless it ends the\n"
+      <<"period. With --cc-ramp, the inputs move to the new values in steps\n"
+      <<"over the given number of frames instead of jumping. The GUI is\n"
+      <<"updated with the new values.\n\n"
+      <<"The MIDI input buffers have room for --events-per-frame (default:\n"
+      <<"1) MIDI events per frame of the JACK period, and at least 256.\n"
+      <<"Events that don't fit are dropped and counted in the statistics.\n"
+      <<"The buffers are resized when the JACK period size changes, and the\n"
+      <<"plugins are reinstantiated with the same control values when the\n"
+      <<"sample rate changes.\n\n"
+      <<"The --graph option loads several plugins in a single JACK client\n"
+      <<"and runs them in one process callback. FILE has one statement\n"
+      <<"per line:\n"
+      <<"  plugin NAME URI                  load a plugin and call it NAME\n"
+      <<"  connect NAME.SYMBOL NAME.SYMBOL  connect an output to an input\n"
+      <<"  set NAME.SYMBOL VALUE            set a control input\n"
+      <<"Audio and MIDI ports that are not connected get JACK ports called\n"
+      <<"NAME.SYMBOL. No GUIs are loaded. With --threads N, plugins that\n"
+      <<"don't depend on each other run in parallel on N threads.\n\n"
+      <<"The --server option starts a JACK client without any plugins and\n"
+      <<"reads commands from the Unix domain socket at PATH, one per line:\n"
+      <<"  add NAME URI           load a plugin and call it NAME\n"
+      <<"  remove NAME            remove a plugin\n"
+      <<"  set NAME SYMBOL VALUE  set a control input\n"
+      <<"  program NAME PROGRAM   select a program\n"
+      <<"  list                   list the loaded plugins\n"
+      <<"  quit                   stop the server\n"
+      <<"Every reply ends with a line that is 'ok' or starts with 'error'.\n"
+      <<"Instances of the same plugin share the parsed RDF data and the\n"
+      <<"plugin library. No GUIs are loaded.\n\n"
+      <<"The --render option runs the plugin without JACK, as fast as\n"
+      <<"possible, with the events from a Standard MIDI File and writes the\n"
+      <<"output to a sound file (WAV, unless the name ends with .flac, .aiff\n"
+      <<"or .ogg). The default sample rate is 48000, the default block size\n"
+      <<"is 256 frames, and rendering goes on for 2 seconds after the end of\n"
+      <<"the MIDI file unless --tail says otherwise. With --automation,\n"
+      <<"control inputs are changed at the times given in FILE, one change\n"
+      <<"per line:\n"
+      <<"  SECONDS SYMBOL VALUE             set a control input at a time\n"
+      <<"They happen at the right sample, like mapped MIDI controllers.\n\n"
+      <<"The --batch option runs all the given sound files through the\n"
+      <<"plugin, using one plugin instance per CPU core (or --threads),\n"
+      <<"and writes the results with the same names to DIRECTORY. Control\n"
+      <<"inputs can be set with --set, or a program can be selected with\n"
+      <<"--preset. The sample rate of the first file is used unless --rate\n"
+      <<"is given, and files with other rates fail. The default block size\n"
+      <<"is 8192 frames and there is no tail.\n\n"
+      <<"The --bench option measures how long the plugins take to run for\n"
+      <<"block sizes from 1 to 8192, with white noise on the audio inputs\n"
+      <<"and chords or a dense stream of notes on the MIDI input. If a\n"
+      <<"bundle directory is given all plugins in it are measured. The\n"
+      <<"results are written to stdout, one line of key=value pairs per\n"
+      <<"block size and a 'fit' line with the overhead per call and the\n"
+      <<"cost per frame. With --graph it measures the whole graph with\n"
+      <<"1, 2, 4... up to --threads worker threads (default: one per CPU\n"
+      <<"core) and a fixed block size (default: 256 frames), and writes\n"
+      <<"one 'graph' line per thread count with the speedup."<<endl;
+}
+
+
+/** Returns true if the command line asks for a mode that does not need
+    GTK. */
+bool is_headless(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--render") || !strcmp(argv[i], "--batch") ||
+	!strcmp(argv[i], "--bench") || !strcmp(argv[i], "--server"))
+      return true;
+  }
+  return false;
+}
+
+
+/** Render a MIDI file through a plugin to a sound file, without JACK. */
+int render(const string& plugin_uri, const char* midi_file, 
+	   const char* output_file, unsigned long rate, uint32_t block_size,
+	   double tail, const char* automation_file, uint32_t min_segment,
+	   uint32_t cc_ramp) {
+  
+  MidiFile midi;
+  if (!midi.read(midi_file, rate))
+    return 1;
+  
+  LV2Host lv2h(plugin_uri, rate);
+  if (!lv2h.is_valid()) {
+    DBG0("Could not load the plugin "<<plugin_uri);
+    return 1;
+  }
+  
+  Automation automation;
+  if (automation_file && !automation.read(automation_file, lv2h))
+    return 1;
+  if (min_segment > 0)
+    lv2h.set_min_segment(min_segment);
+  lv2h.set_midi_control_ramp(cc_ramp);
+  
+  OfflineRenderer renderer(lv2h, block_size);
+  if (!renderer.is_valid())
+    return 1;
+  if (lv2h.get_presets().size() > 0)
+    lv2h.set_program(lv2h.get_presets().begin()->first);
+  renderer.set_events(&midi.get_events());
+  if (automation_file)
+    renderer.set_automation(&automation.get_events());
+  
+  uint64_t frames = midi.get_length() + uint64_t(tail * rate);
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (!renderer.render(frames, output_file))
+    return 1;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  
+  double audio = double(frames) / rate;
+  double wall = (end.tv_sec - start.tv_sec) + 
+    (end.tv_nsec - start.tv_nsec) / 1e9;
+  clog<<"Rendered "<<audio<<" seconds to "<<output_file<<" in "<<wall
+      <<" seconds";
+  if (wall > 0)
+    clog<<" ("<<(audio / wall)<<" times realtime)";
+  clog<<endl;
+  
+  return 0;
+}
+
+
+/** Benchmark plugins, given by URI or by bundle directory. */
+int benchmark(const vector<string>& targets, unsigned long rate, 
+	      double seconds, Benchmark::MidiInput input) {
+  
+  // replace bundles with the plugins in them
+  vector<string> uris;
+  for (unsigned j = 0; j < targets.size(); ++j) {
+    struct stat info;
+    if (!stat(targets[j].c_str(), &info) && S_ISDIR(info.st_mode)) {
+      vector<string> bundle = LV2Host::get_bundle_plugins(targets[j]);
+      if (bundle.empty())
+	DBG0("Found no plugins in "<<targets[j]);
+      uris.insert(uris.end(), bundle.begin(), bundle.end());
+    }
+    else
+      uris.push_back(targets[j]);
+  }
+  
+  Benchmark b(rate, seconds, input);
+  b.write_header(cout);
+  unsigned failed = 0;
+  for (unsigned j = 0; j < uris.size(); ++j) {
+    if (!b.run(uris[j], cout))
+      ++failed;
+  }
+  
+  return failed ? 1 : 0;
+}
+
+
+/** Measure how a plugin graph scales with the number of worker threads. */
+int benchmark_graph(const char* graph_file, unsigned long rate, 
+		    double seconds, Benchmark::MidiInput input, 
+		    unsigned threads, uint32_t block_size) {
+  
+  if (threads == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (cores > 0 ? cores : 1);
+  }
+  if (block_size > Benchmark::MaxBlock)
+    block_size = Benchmark::MaxBlock;
+  
+  Benchmark b(rate, seconds, input);
+  b.write_header(cout);
+  
+  return b.run_graph(graph_file, threads, block_size, cout) ? 0 : 1;
+}
+
+
+/** Run sound files through a plugin in parallel, without JACK. */
+int batch(const string& plugin_uri, const vector<string>& files, 
+	  const char* directory, const vector<pair<string, float> >& controls,
+	  int program, unsigned threads, unsigned long rate, 
+	  uint32_t block_size, double tail) {
+  
+  if (files.empty()) {
+    DBG0("No input files given!");
+    return 1;
+  }
+  if (!BatchProcessor::check_outputs(files, directory))
+    return 1;
+  
+  // use the sample rate of the first file if none was given
+  if (rate == 0) {
+    SF_INFO info;
+    memset(&info, 0, sizeof(info));
+    SNDFILE* file = sf_open(files[0].c_str(), SFM_READ, &info);
+    if (!file) {
+      DBG0("Could not open "<<files[0]<<": "<<sf_strerror(0));
+      return 1;
+    }
+    rate = info.samplerate;
+    sf_close(file);
+  }
+  
+  // one plugin instance per core, but not more than there are files
+  if (threads == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (cores > 0 ? cores : 1);
+  }
+  if (threads > files.size())
+    threads = files.size();
+  
+  BatchProcessor processor(plugin_uri, rate, block_size, threads);
+  if (!processor.is_valid())
+    return 1;
+  for (unsigned j = 0; j < controls.size(); ++j) {
+    if (!processor.set_control(controls[j].first, controls[j].second))
+      return 1;
+  }
+  if (program >= 0 && !processor.set_program(program))
+    return 1;
+  
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  unsigned failed = processor.run(files, directory, uint64_t(tail * rate));
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  
+  double wall = (end.tv_sec - start.tv_sec) + 
+    (end.tv_nsec - start.tv_nsec) / 1e9;
+  clog<<"Processed "<<(files.size() - failed)<<" of "<<files.size()
+      <<" files with "<<threads<<" threads in "<<wall<<" seconds"<<endl;
+  
+  return failed ? 1 : 0;
+}
+
+
+/** Run a graph of plugins in a single JACK client. */
+int run_graph(Gtk::Main* kit, const char* graph_file, unsigned threads,
+	      const char* stats_socket, const char* trace_file) {
+  
+  if (!(jack_client = jack_client_open("Elven", jack_options_t(0), 0))) {
+    DBG0("Could not initialise JACK client!");
+    return -1;
+  }
+  
+  PluginGraph graph(jack_get_sample_rate(jack_client));
+  if (!graph.load(graph_file)) {
+    jack_client_close(jack_client);
+    return 1;
+  }
+  
+  // register JACK ports for the external ports
+  const vector<PluginGraph::Node>& nodes = graph.get_nodes();
+  const vector<PluginGraph::ExternalPort>& external = 
+    graph.get_external_ports();
+  for (size_t j = 0; j < external.size(); ++j) {
+    const LV2Port& port = 
+      nodes[external[j].node].host->get_ports()[external[j].port];
+    jack_port_t* jack_port = 
+      jack_port_register(jack_client, external[j].name.c_str(),
+			 (port.type == MidiType ?
+			  JACK_DEFAULT_MIDI_TYPE : JACK_DEFAULT_AUDIO_TYPE),
+			 (port.direction == InputPort ?
+			  JackPortIsInput : JackPortIsOutput), 0);
+    
+    // the process callback doesn't check for missing ports
+    if (!jack_port) {
+      DBG0("Could not register the JACK port "<<external[j].name);
+      jack_client_close(jack_client);
+      return 1;
+    }
+    jack_ports.push_back(jack_port);
+  }
+  
+  buffer_size = jack_get_buffer_size(jack_client);
+  sample_rate = jack_get_sample_rate(jack_client);
+  if (!graph.allocate_buffers(buffer_size, event_capacity(buffer_size),
+			      threads > 1)) {
+    DBG0("Could not allocate the port buffers!");
+    jack_client_close(jack_client);
+    return 1;
+  }
+  
+  // the workers get the same priority as the JACK thread
+  GraphScheduler scheduler(graph, threads);
+  if (threads > 1) {
+    scheduler.start(jack_client_real_time_priority(jack_client), 
+		    &worker_init, 0);
+    graph_scheduler = &scheduler;
+  }
+  
+  jack_set_process_callback(jack_client, &graph_process, &graph);
+  jack_set_thread_init_callback(jack_client, &thread_init, 0);
+  jack_set_xrun_callback(jack_client, &xrun, 0);
+  jack_set_buffer_size_callback(jack_client, &graph_buffer_size_changed, 
+				&graph);
+  jack_set_sample_rate_callback(jack_client, &sample_rate_changed, 0);
+  graph.activate();
+  rt_profile.apply_process();
+  rt_profile.report_process(clog);
+  telemetry.set_event_capacity(event_capacity(buffer_size));
+  if (stats_socket)
+    telemetry.start_server(stats_socket, sample_rate, 0);
+  jack_activate(jack_client);
+  
+  autoconnect(jack_client);
+  
+  // there is no single notification fd for the graph, so poll
+  Glib::signal_timeout().
+    connect(bind_return(mem_fun(graph, &PluginGraph::run_main), true), 10);
+  Glib::signal_timeout().
+    connect(sigc::bind(sigc::ptr_fun(&check_sample_rate), 
+		       mem_fun(graph, &PluginGraph::set_frame_rate)), 100);
+  
+  // write the trace when we get SIGUSR1
+  if (trace_file) {
+    ::signal(SIGUSR1, &sigusr1);
+    Glib::signal_timeout().
+      connect(sigc::bind(sigc::ptr_fun(&check_trace_request), trace_file),
+	      100);
+  }
+  
+  kit->run();
+  
+  jack_client_close(jack_client);
+  graph_scheduler = 0;
+  scheduler.stop();
+  telemetry.stop_server();
+  graph.deactivate();
+  
+  return 0;
+}
+
+
+/** Host plugins that are added and removed through a command socket. */
+int run_server(const char* socket_path, const char* stats_socket, 
+	       const char* trace_file) {
+  
+  if (!(jack_client = jack_client_open("Elven", jack_options_t(0), 0))) {
+    DBG0("Could not initialise JACK client!");
+    return -1;
+  }
+  
+  Glib::RefPtr<Glib::MainLoop> loop = Glib::MainLoop::create();
+  HostServer* server = new HostServer(jack_client, loop);
+  buffer_size = jack_get_buffer_size(jack_client);
+  sample_rate = jack_get_sample_rate(jack_client);
+  server->set_event_capacity(event_capacity(buffer_size));
+  
+  jack_set_process_callback(jack_client, &server_process, server);
+  jack_set_thread_init_callback(jack_client, &thread_init, 0);
+  jack_set_xrun_callback(jack_client, &xrun, 0);
+  jack_set_buffer_size_callback(jack_client, &server_buffer_size_changed, 
+				server);
+  jack_set_sample_rate_callback(jack_client, &sample_rate_changed, 0);
+  rt_profile.apply_process();
+  rt_profile.report_process(clog);
+  telemetry.set_event_capacity(event_capacity(buffer_size));
+  if (stats_socket)
+    telemetry.start_server(stats_socket, sample_rate, 0);
+  jack_activate(jack_client);
+  
+  if (!server->start(socket_path)) {
+    jack_client_close(jack_client);
+    delete server;
+    return 1;
+  }
+  
+  Glib::signal_timeout().
+    connect(mem_fun(*server, &HostServer::run_main), 10);
+  Glib::signal_timeout().
+    connect(sigc::bind(sigc::ptr_fun(&check_sample_rate), 
+		       mem_fun(*server, &HostServer::set_frame_rate)), 100);
+  
+  // write the trace when we get SIGUSR1
+  if (trace_file) {
+    ::signal(SIGUSR1, &sigusr1);
+    Glib::signal_timeout().
+      connect(sigc::bind(sigc::ptr_fun(&check_trace_request), trace_file),
+	      100);
+  }
+  
+  loop->run();
+  
+  // remove the instances while the JACK client is still open, their ports
+  // have to be unregistered
+  server->stop();
+  delete server;
+  jack_client_close(jack_client);
+  telemetry.stop_server();
+  
+  return 0;
 }
 
 
@@ -434,12 +1126,39 @@ int main(int argc, char** argv) {
   // prevent GTK from ruining our locale settings
   gtk_disable_setlocale();
   
-  Gtk::Main kit(argc, argv);
+  // the offline modes don't need a display
+  Gtk::Main* kit = 0;
+  if (!is_headless(argc, argv))
+    kit = new Gtk::Main(argc, argv);
   
   DebugInfo::prefix() = "H:";
-  DebugInfo::thread_prefix()[pthread_self()] = "M ";
+  DebugInfo::thread_prefix() = "M ";
   
   bool load_gui = true;
+  const char* stats_socket = 0;
+  const char* trace_file = 0;
+  const char* graph_file = 0;
+  const char* server_socket = 0;
+  unsigned oversampling = 1;
+  const char* render_file = 0;
+  const char* output_file = 0;
+  const char* batch_dir = 0;
+  vector<pair<string, float> > batch_controls;
+  int batch_program = -1;
+  unsigned batch_threads = 0;
+  bool bench = false;
+  Benchmark::MidiInput bench_midi = Benchmark::Chords;
+  double bench_seconds = 2;
+  unsigned long render_rate = 0;
+  uint32_t render_block = 0;
+  double render_tail = -1;
+  const char* automation_file = 0;
+  uint32_t min_segment = 0;
+  uint32_t cc_ramp = 0;
+  
+  const char* env = getenv("ELVEN_RT_PROFILE");
+  if (env && !rt_profile.parse(env))
+    return 1;
   
   if (argc < 2) {
     print_usage(argv[0]);
@@ -479,6 +1198,239 @@ int main(int argc, char** argv) {
       ++i;
     }
     
+    // let a separate thread write the messages from the JACK thread
+    else if (!strcmp(argv[i], "-D") || !strcmp(argv[i], "--deferred-debug")) {
+      DebugInfo::start_deferred();
+    }
+    
+    // realtime settings for the JACK thread
+    else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--rt")) {
+      if (i == argc - 1) {
+        DBG0("No realtime settings given!");
+        return 1;
+      }
+      if (!rt_profile.parse(argv[i + 1]))
+        return 1;
+      ++i;
+    }
+    
+    // record non-realtime safe calls in the JACK thread
+    else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--rtcheck")) {
+      RTCheck::enable();
+    }
+    
+    // serve statistics on a Unix domain socket
+    else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stats-socket")) {
+      if (i == argc - 1) {
+        DBG0("No socket path given!");
+        return 1;
+      }
+      stats_socket = argv[i + 1];
+      ++i;
+    }
+    
+    // record a timeline trace
+    else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--trace")) {
+      if (i == argc - 1) {
+        DBG0("No trace file given!");
+        return 1;
+      }
+      trace_file = argv[i + 1];
+      Trace::enable();
+      ++i;
+    }
+    
+    // run several connected plugins
+    else if (!strcmp(argv[i], "-g") || !strcmp(argv[i], "--graph")) {
+      if (i == argc - 1) {
+        DBG0("No graph file given!");
+        return 1;
+      }
+      graph_file = argv[i + 1];
+      ++i;
+    }
+    
+    // run the plugin at a higher sample rate
+    else if (!strcmp(argv[i], "--oversample")) {
+      if (i == argc - 1 || (strcmp(argv[i + 1], "2") && 
+			    strcmp(argv[i + 1], "4") && 
+			    strcmp(argv[i + 1], "8"))) {
+        DBG0("The oversampling factor must be 2, 4 or 8!");
+        return 1;
+      }
+      oversampling = atoi(argv[i + 1]);
+      ++i;
+    }
+    
+    // host plugins that are added and removed through a socket
+    else if (!strcmp(argv[i], "--server")) {
+      if (i == argc - 1) {
+        DBG0("No socket path given!");
+        return 1;
+      }
+      server_socket = argv[i + 1];
+      ++i;
+    }
+    
+    // render a MIDI file offline
+    else if (!strcmp(argv[i], "--render")) {
+      if (i == argc - 1) {
+        DBG0("No MIDI file given!");
+        return 1;
+      }
+      render_file = argv[i + 1];
+      ++i;
+    }
+    
+    // measure how fast plugins run
+    else if (!strcmp(argv[i], "--bench")) {
+      bench = true;
+    }
+    
+    // the MIDI input for benchmarks
+    else if (!strcmp(argv[i], "--bench-midi")) {
+      if (i == argc - 1 || (strcmp(argv[i + 1], "chords") && 
+			    strcmp(argv[i + 1], "notes"))) {
+        DBG0("The benchmark MIDI input must be 'chords' or 'notes'!");
+        return 1;
+      }
+      bench_midi = (strcmp(argv[i + 1], "chords") ? 
+		    Benchmark::Notes : Benchmark::Chords);
+      ++i;
+    }
+    
+    // the length of each benchmark run
+    else if (!strcmp(argv[i], "--bench-seconds")) {
+      if (i == argc - 1 || atof(argv[i + 1]) <= 0) {
+        DBG0("No valid benchmark length given!");
+        return 1;
+      }
+      bench_seconds = atof(argv[i + 1]);
+      ++i;
+    }
+    
+    // run sound files through an effect in parallel
+    else if (!strcmp(argv[i], "--batch")) {
+      if (i == argc - 1) {
+        DBG0("No output directory given!");
+        return 1;
+      }
+      batch_dir = argv[i + 1];
+      ++i;
+    }
+    
+    // set a control value for batch processing
+    else if (!strcmp(argv[i], "--set")) {
+      const char* eq = (i == argc - 1 ? 0 : strchr(argv[i + 1], '='));
+      if (!eq) {
+        DBG0("No SYMBOL=VALUE given!");
+        return 1;
+      }
+      string symbol(argv[i + 1], eq - argv[i + 1]);
+      batch_controls.push_back(make_pair(symbol, float(atof(eq + 1))));
+      ++i;
+    }
+    
+    // select a program for batch processing
+    else if (!strcmp(argv[i], "--preset")) {
+      if (i == argc - 1) {
+        DBG0("No program number given!");
+        return 1;
+      }
+      batch_program = atoi(argv[i + 1]);
+      ++i;
+    }
+    
+    // the number of worker threads for batch processing
+    else if (!strcmp(argv[i], "--threads")) {
+      if (i == argc - 1 || atoi(argv[i + 1]) <= 0) {
+        DBG0("No valid number of threads given!");
+        return 1;
+      }
+      batch_threads = atoi(argv[i + 1]);
+      ++i;
+    }
+    
+    // the output file for offline rendering
+    else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--out")) {
+      if (i == argc - 1) {
+        DBG0("No output file given!");
+        return 1;
+      }
+      output_file = argv[i + 1];
+      ++i;
+    }
+    
+    // the sample rate for offline rendering
+    else if (!strcmp(argv[i], "--rate")) {
+      if (i == argc - 1 || atoi(argv[i + 1]) <= 0) {
+        DBG0("No valid sample rate given!");
+        return 1;
+      }
+      render_rate = atoi(argv[i + 1]);
+      ++i;
+    }
+    
+    // the block size for offline rendering
+    else if (!strcmp(argv[i], "--block")) {
+      if (i == argc - 1 || atoi(argv[i + 1]) <= 0) {
+        DBG0("No valid block size given!");
+        return 1;
+      }
+      render_block = atoi(argv[i + 1]);
+      ++i;
+    }
+    
+    // the time to keep rendering after the last MIDI event
+    else if (!strcmp(argv[i], "--tail")) {
+      if (i == argc - 1 || atof(argv[i + 1]) < 0) {
+        DBG0("No valid tail length given!");
+        return 1;
+      }
+      render_tail = atof(argv[i + 1]);
+      ++i;
+    }
+    
+    // control changes for offline rendering
+    else if (!strcmp(argv[i], "--automation")) {
+      if (i == argc - 1) {
+        DBG0("No automation file given!");
+        return 1;
+      }
+      automation_file = argv[i + 1];
+      ++i;
+    }
+    
+    // the shortest part of a block that the plugin is run for
+    else if (!strcmp(argv[i], "--min-segment")) {
+      if (i == argc - 1 || atoi(argv[i + 1]) <= 0) {
+        DBG0("No valid segment size given!");
+        return 1;
+      }
+      min_segment = atoi(argv[i + 1]);
+      ++i;
+    }
+    
+    // the time that mapped MIDI controllers take to reach a new value
+    else if (!strcmp(argv[i], "--cc-ramp")) {
+      if (i == argc - 1 || atoi(argv[i + 1]) < 0) {
+        DBG0("No valid ramp length given!");
+        return 1;
+      }
+      cc_ramp = atoi(argv[i + 1]);
+      ++i;
+    }
+    
+    // the size of the MIDI input buffers
+    else if (!strcmp(argv[i], "--events-per-frame")) {
+      if (i == argc - 1 || atof(argv[i + 1]) <= 0) {
+        DBG0("No valid number of events per frame given!");
+        return 1;
+      }
+      events_per_frame = atof(argv[i + 1]);
+      ++i;
+    }
+    
     // don't load a GUI plugin
     else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--nogui")) {
       load_gui = false;
@@ -488,11 +1440,87 @@ int main(int argc, char** argv) {
       break;
   }
   
-  if (i >= argc) {
+  if (i >= argc && !graph_file && !server_socket) {
     print_usage(argv[0]);
     return 1;
   }
-    
+  
+  Trace::register_thread("GUI");
+  
+  // run benchmarks instead of starting a JACK client
+  if (bench) {
+    vector<string> targets(argv + i, argv + argc);
+    int result;
+    if (graph_file)
+      result = benchmark_graph(graph_file, render_rate ? render_rate : 48000,
+			       bench_seconds, bench_midi, batch_threads,
+			       render_block ? render_block : 256);
+    else
+      result = benchmark(targets, render_rate ? render_rate : 48000,
+			 bench_seconds, bench_midi);
+    DebugInfo::stop_deferred();
+    RTCheck::report(clog);
+    if (trace_file)
+      Trace::write(trace_file);
+    return result;
+  }
+  
+  // process sound files instead of starting a JACK client
+  if (batch_dir) {
+    vector<string> files(argv + i + 1, argv + argc);
+    int result = batch(argv[i], files, batch_dir, batch_controls, 
+		       batch_program, batch_threads, render_rate, 
+		       render_block ? render_block : 8192,
+		       render_tail >= 0 ? render_tail : 0);
+    DebugInfo::stop_deferred();
+    RTCheck::report(clog);
+    if (trace_file)
+      Trace::write(trace_file);
+    return result;
+  }
+  
+  // render offline instead of starting a JACK client
+  if (render_file) {
+    if (!output_file) {
+      DBG0("No output file given!");
+      return 1;
+    }
+    int result = render(argv[i], render_file, output_file, 
+			render_rate ? render_rate : 48000,
+			render_block ? render_block : 256,
+			render_tail >= 0 ? render_tail : 2,
+			automation_file, min_segment, cc_ramp);
+    DebugInfo::stop_deferred();
+    RTCheck::report(clog);
+    if (trace_file)
+      Trace::write(trace_file);
+    return result;
+  }
+  
+  // run a plugin server instead of a single plugin
+  if (server_socket) {
+    int result = run_server(server_socket, stats_socket, trace_file);
+    DBG2("Exiting");
+    DebugInfo::stop_deferred();
+    RTCheck::report(clog);
+    if (trace_file)
+      Trace::write(trace_file);
+    return result;
+  }
+  
+  // run a plugin graph instead of a single plugin
+  if (graph_file) {
+    int result = run_graph(kit, graph_file, batch_threads, stats_socket, 
+			   trace_file);
+    DBG2("Exiting");
+    DebugInfo::stop_deferred();
+    RTCheck::report(clog);
+    if (trace_file)
+      Trace::write(trace_file);
+    delete kit;
+    return result;
+  }
+  
   // initialise JACK client
   if (!(jack_client = jack_client_open("Elven", jack_options_t(0), 0))) {
     DBG0("Could not initialise JACK client!");
@@ -501,7 +1529,7 @@ int main(int argc, char** argv) {
       
   // load plugin
   string plugin_uri = argv[i];
-  LV2Host lv2h(plugin_uri, jack_get_sample_rate(jack_client));
+  LV2Host lv2h(plugin_uri, jack_get_sample_rate(jack_client) * oversampling);
   
   if (lv2h.is_valid()) {
     
@@ -519,25 +1547,24 @@ int main(int argc, char** argv) {
     }
     if (has_map)
       DBG2("");
+    if (min_segment > 0)
+      lv2h.set_min_segment(min_segment * oversampling);
+    lv2h.set_midi_control_ramp(cc_ramp * oversampling);
     
     DBG2("Default MIDI port: "<<lv2h.get_default_midi_port());
     
-    // initialise port buffers
+    // register JACK ports for all audio and MIDI ports
     for (size_t p = 0; p < lv2h.get_ports().size(); ++p) {
       jack_port_t* port = 0;
       LV2Port& lv2port = lv2h.get_ports()[p];
       
-      // add JACK MIDI port and allocate internal MIDI buffer
       if (lv2port.type == MidiType) {
         port = jack_port_register(jack_client, lv2port.symbol.c_str(),
                                   JACK_DEFAULT_MIDI_TYPE,
                                   (lv2port.direction == InputPort ?
                                    JackPortIsInput : JackPortIsOutput), 0);
-        LV2_Event_Buffer* mbuf = lv2_event_buffer_new(8192, 0);
-        lv2port.buffer = mbuf;
       }
       
-      // add JACK audio port
       else if (lv2port.type == AudioType) {
         port = jack_port_register(jack_client, lv2port.symbol.c_str(),
                                   JACK_DEFAULT_AUDIO_TYPE,
@@ -545,16 +1572,39 @@ int main(int argc, char** argv) {
                                    JackPortIsInput : JackPortIsOutput), 0);
       }
       
-      // for control ports, just create buffers consisting of a single float
-      else if (lv2port.type == ControlType) {
-        lv2port.buffer = new float;
-        *static_cast<float*>(lv2port.buffer) = lv2port.default_value;
-	lv2port.value = lv2port.default_value;
+      // the process callback doesn't check for missing ports
+      if (!port && (lv2port.type == MidiType || lv2port.type == AudioType)) {
+	DBG0("Could not register the JACK port "<<lv2port.symbol);
+	jack_client_close(jack_client);
+	return 1;
       }
       
       jack_ports.push_back(port);
     }
     
+    // the host allocates the control and MIDI buffers, and the audio 
+    // buffers too if the plugin runs at a higher rate than JACK
+    buffer_size = jack_get_buffer_size(jack_client);
+    sample_rate = jack_get_sample_rate(jack_client);
+    if (!lv2h.allocate_buffers(event_capacity(buffer_size), 
+			       (oversampling > 1 ? 
+				buffer_size * oversampling : 0))) {
+      DBG0("Could not allocate the port buffers!");
+      return 1;
+    }
+    
+    if (oversampling > 1) {
+      oversampler = new Oversampler(lv2h, oversampling, buffer_size);
+      jack_nframes_t latency = jack_nframes_t(oversampler->get_latency() + 0.5);
+      clog<<"Oversampling "<<oversampling<<"x adds "
+	  <<oversampler->get_latency()<<" frames of latency"<<endl;
+      for (size_t p = 0; p < jack_ports.size(); ++p) {
+	if (jack_ports[p] && lv2h.get_ports()[p].type == AudioType &&
+	    lv2h.get_ports()[p].direction == OutputPort)
+	  jack_port_set_latency(jack_ports[p], latency);
+      }
+    }
+    
     still_running = true;
     
     // start the GUI
@@ -615,26 +1665,57 @@ int main(int argc, char** argv) {
 
     jack_set_process_callback(jack_client, &process, &lv2h);
     jack_set_thread_init_callback(jack_client, &thread_init, 0);
+    jack_set_xrun_callback(jack_client, &xrun, 0);
+    jack_set_buffer_size_callback(jack_client, &buffer_size_changed, &lv2h);
+    jack_set_sample_rate_callback(jack_client, &sample_rate_changed, 0);
     if (lv2h.get_presets().size() > 0)
       lv2h.set_program(lv2h.get_presets().begin()->first);
     lv2h.activate();
+    rt_profile.apply_process();
+    rt_profile.report_process(clog);
+    telemetry.set_event_capacity(event_capacity(buffer_size));
+    if (stats_socket)
+      telemetry.start_server(stats_socket, sample_rate, &lv2h);
     jack_activate(jack_client);
     
     autoconnect(jack_client);
     
-    // wait until we are killed
+    // handle port changes from the plugin when the host wakes us up, or
+    // poll if it can't
+    if (lv2h.get_notification_fd() != -1)
+      Glib::signal_io().
+	connect(hide(bind_return(mem_fun(lv2h, &LV2Host::run_main), true)),
+		lv2h.get_notification_fd(), Glib::IO_IN);
+    else
+      Glib::signal_timeout().
+	connect(bind_return(mem_fun(lv2h, &LV2Host::run_main), true), 10);
     Glib::signal_timeout().
-      connect(bind_return(mem_fun(lv2h, &LV2Host::run_main), true), 10);
+      connect(sigc::bind(sigc::ptr_fun(&check_sample_rate), 
+			 sigc::bind(sigc::ptr_fun(&set_host_rate), &lv2h)),
+	      100);
+    
+    // write the trace when we get SIGUSR1
+    if (trace_file) {
+      ::signal(SIGUSR1, &sigusr1);
+      Glib::signal_timeout().
+	connect(sigc::bind(sigc::ptr_fun(&check_trace_request), trace_file),
+		100);
+    }
+    
+    // wait until we are killed
     if (win) {
-      kit.run(*win);
+      kit->run(*win);
       win->show_all();
     }
     else
-      kit.run();
+      kit->run();
     
     jack_client_close(jack_client);
+    telemetry.stop_server();
     delete lv2gh;
     lv2h.deactivate();
+    delete oversampler;
+    oversampler = 0;
   }
   
   else {
@@ -642,6 +1723,12 @@ int main(int argc, char** argv) {
   }
   
   DBG2("Exiting");
+  DebugInfo::stop_deferred();
+  RTCheck::report(clog);
+  if (trace_file)
+    Trace::write(trace_file);
+  
+  delete kit;
   
   return 0;
 }
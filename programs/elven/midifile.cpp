@@ -0,0 +1,245 @@
+/****************************************************************************
+    
+    midifile.cpp - A reader for Standard MIDI Files
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "debug.hpp"
+#include "midifile.hpp"
+
+
+using namespace std;
+
+
+namespace {
+  
+  uint32_t read_be(const unsigned char* data, unsigned bytes) {
+    uint32_t value = 0;
+    for (unsigned i = 0; i < bytes; ++i)
+      value = (value << 8) | data[i];
+    return value;
+  }
+  
+  
+  /** Read a variable length quantity, or return false if it runs past the
+      end of the data. */
+  bool read_varlen(const unsigned char* data, size_t size, size_t& pos, 
+		   uint32_t& value) {
+    value = 0;
+    for (unsigned i = 0; i < 4; ++i) {
+      if (pos >= size)
+	return false;
+      unsigned char c = data[pos++];
+      value = (value << 7) | (c & 0x7F);
+      if (!(c & 0x80))
+	return true;
+    }
+    return false;
+  }
+  
+}
+
+
+bool MidiFile::read(const std::string& filename, unsigned long frame_rate) {
+  
+  m_events.clear();
+  m_length = 0;
+  
+  ifstream ifs(filename.c_str(), ios::binary);
+  if (!ifs.good()) {
+    DBG0("Could not open "<<filename);
+    return false;
+  }
+  vector<unsigned char> file((istreambuf_iterator<char>(ifs)),
+			     istreambuf_iterator<char>());
+  
+  // the header
+  if (file.size() < 14 || memcmp(&file[0], "MThd", 4) || 
+      read_be(&file[4], 4) < 6) {
+    DBG0(filename<<" is not a Standard MIDI File");
+    return false;
+  }
+  unsigned format = read_be(&file[8], 2);
+  unsigned ntracks = read_be(&file[10], 2);
+  unsigned division = read_be(&file[12], 2);
+  if (format > 1) {
+    DBG0("MIDI file format "<<format<<" is not supported");
+    return false;
+  }
+  
+  // with SMPTE timing the ticks have a fixed length, so we fake a tempo 
+  // where one quarter note is one second
+  double ticks_per_quarter = division;
+  bool smpte = (division & 0x8000);
+  if (smpte) {
+    int fps = -int(static_cast<signed char>(division >> 8));
+    ticks_per_quarter = fps * (division & 0xFF);
+  }
+  if (ticks_per_quarter <= 0) {
+    DBG0("Invalid time division in "<<filename);
+    return false;
+  }
+  
+  // read the tracks, skipping any unknown chunks
+  vector<TickEvent> events;
+  size_t pos = 8 + read_be(&file[4], 4);
+  unsigned track = 0;
+  while (track < ntracks && pos + 8 <= file.size()) {
+    uint32_t length = read_be(&file[pos + 4], 4);
+    if (pos + 8 + length > file.size()) {
+      DBG0("Truncated chunk in "<<filename);
+      return false;
+    }
+    if (!memcmp(&file[pos], "MTrk", 4)) {
+      if (!read_track(&file[pos + 8], length, track, events)) {
+	DBG0("Could not parse track "<<track<<" in "<<filename);
+	return false;
+      }
+      ++track;
+    }
+    pos += 8 + length;
+  }
+  
+  // merge the tracks and apply the tempo map
+  stable_sort(events.begin(), events.end());
+  uint32_t tempo = (smpte ? 1000000 : 500000);
+  uint64_t last_tick = 0;
+  double seconds = 0;
+  for (size_t i = 0; i < events.size(); ++i) {
+    TickEvent& e = events[i];
+    seconds += (e.tick - last_tick) * (tempo / 1000000.0) / ticks_per_quarter;
+    last_tick = e.tick;
+    uint64_t frame = uint64_t(seconds * frame_rate + 0.5);
+    if (e.tempo && !smpte)
+      tempo = e.tempo;
+    else if (e.data.size()) {
+      m_events.push_back(MidiFileEvent());
+      m_events.back().frame = frame;
+      m_events.back().data.swap(e.data);
+    }
+    m_length = frame;
+  }
+  
+  DBG2("Read "<<m_events.size()<<" events from "<<track
+       <<" tracks in "<<filename);
+  
+  return true;
+}
+
+
+const std::vector<MidiFileEvent>& MidiFile::get_events() const {
+  return m_events;
+}
+
+
+uint64_t MidiFile::get_length() const {
+  return m_length;
+}
+
+
+bool MidiFile::TickEvent::operator<(const TickEvent& e) const {
+  if (tick != e.tick)
+    return tick < e.tick;
+  if (track != e.track)
+    return track < e.track;
+  return order < e.order;
+}
+
+
+bool MidiFile::read_track(const unsigned char* data, size_t size, 
+			  unsigned track, std::vector<TickEvent>& events) {
+  
+  size_t pos = 0;
+  uint64_t tick = 0;
+  unsigned char status = 0;
+  unsigned order = 0;
+  
+  while (pos < size) {
+    
+    uint32_t delta;
+    if (!read_varlen(data, size, pos, delta) || pos >= size)
+      return false;
+    tick += delta;
+    
+    TickEvent e;
+    e.tick = tick;
+    e.track = track;
+    e.order = order++;
+    e.tempo = 0;
+    
+    unsigned char c = data[pos];
+    
+    // meta event, only tempo changes and the end of the track matter
+    if (c == 0xFF) {
+      if (pos + 2 > size)
+	return false;
+      unsigned char type = data[pos + 1];
+      pos += 2;
+      uint32_t length;
+      if (!read_varlen(data, size, pos, length) || pos + length > size)
+	return false;
+      if (type == 0x51 && length == 3)
+	e.tempo = read_be(data + pos, 3);
+      pos += length;
+      status = 0;
+      events.push_back(e);
+      if (type == 0x2F)
+	break;
+    }
+    
+    // system exclusive, 0xF7 is used for escaped raw bytes
+    else if (c == 0xF0 || c == 0xF7) {
+      ++pos;
+      uint32_t length;
+      if (!read_varlen(data, size, pos, length) || pos + length > size)
+	return false;
+      if (c == 0xF0)
+	e.data.push_back(0xF0);
+      e.data.insert(e.data.end(), data + pos, data + pos + length);
+      pos += length;
+      status = 0;
+      events.push_back(e);
+    }
+    
+    // channel messages, possibly with running status
+    else {
+      if (c & 0x80) {
+	status = c;
+	++pos;
+      }
+      if (!status)
+	return false;
+      unsigned length = ((status & 0xE0) == 0xC0 ? 1 : 2);
+      if (pos + length > size)
+	return false;
+      e.data.push_back(status);
+      e.data.insert(e.data.end(), data + pos, data + pos + length);
+      pos += length;
+      events.push_back(e);
+    }
+  }
+  
+  return true;
+}
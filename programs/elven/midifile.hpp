@@ -0,0 +1,79 @@
+/****************************************************************************
+    
+    midifile.hpp - A reader for Standard MIDI Files
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef MIDIFILE_HPP
+#define MIDIFILE_HPP
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+
+/** A MIDI event from a file, with its time in frames. */
+struct MidiFileEvent {
+  uint64_t frame;
+  std::vector<unsigned char> data;
+};
+
+
+/** This class reads a Standard MIDI File (format 0 or 1) and converts it 
+    into a single list of events sorted by time, with the tempo changes 
+    applied. Meta events are dropped, and system exclusive messages are
+    kept with their leading 0xF0. */
+class MidiFile {
+public:
+  
+  /** Read the file and convert the event times to frames at the given 
+      sample rate. Returns false if the file could not be read or parsed. */
+  bool read(const std::string& filename, unsigned long frame_rate);
+  
+  /** Returns the events, sorted by time. */
+  const std::vector<MidiFileEvent>& get_events() const;
+  
+  /** Returns the length of the file in frames, including any trailing 
+      meta events. */
+  uint64_t get_length() const;
+  
+protected:
+  
+  /** An event with its time in ticks, before the tempo map is applied. */
+  struct TickEvent {
+    uint64_t tick;
+    unsigned track;
+    unsigned order;
+    uint32_t tempo;
+    std::vector<unsigned char> data;
+    bool operator<(const TickEvent& e) const;
+  };
+  
+  bool read_track(const unsigned char* data, size_t size, unsigned track,
+		  std::vector<TickEvent>& events);
+  
+  std::vector<MidiFileEvent> m_events;
+  uint64_t m_length;
+  
+};
+
+
+#endif
@@ -24,18 +24,32 @@
 #ifndef MIDIUTILS_HPP
 #define MIDIUTILS_HPP
 
-#include <sstream>
+#include <iostream>
 #include <iomanip>
 
 
 namespace {
   
-  std::string midi2str(size_t size, const unsigned char* data) {
-    std::ostringstream oss;
-    oss<<std::hex;
-    for (size_t i = 0; i < size; ++i)
-      oss<<(i ? " " : "")<<int(data[i]);
-    return oss.str();
+  /** A MIDI event that is written to a stream as hexadecimal bytes. */
+  struct MidiStr {
+    size_t size;
+    const unsigned char* data;
+  };
+  
+  /** Returns an object that writes the given MIDI event to a stream. This
+      does not allocate any memory, so it can be used in realtime threads. */
+  inline MidiStr midi2str(size_t size, const unsigned char* data) {
+    MidiStr str = { size, data };
+    return str;
+  }
+  
+  inline std::ostream& operator<<(std::ostream& os, const MidiStr& str) {
+    std::ios_base::fmtflags flags = os.flags();
+    os<<std::hex;
+    for (size_t i = 0; i < str.size; ++i)
+      os<<(i ? " " : "")<<int(str.data[i]);
+    os.flags(flags);
+    return os;
   }
 
 }
@@ -0,0 +1,293 @@
+/****************************************************************************
+    
+    oversampler.cpp - Runs a plugin at a multiple of the JACK sample rate
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include <lv2_event_helpers.h>
+
+#include "debug.hpp"
+#include "oversampler.hpp"
+
+
+using namespace std;
+
+
+namespace {
+  
+  /** The zeroth order modified Bessel function, for the Kaiser window. */
+  double bessel_i0(double x) {
+    double sum = 1, term = 1;
+    for (unsigned k = 1; k < 50; ++k) {
+      term *= (x / (2 * k)) * (x / (2 * k));
+      sum += term;
+    }
+    return sum;
+  }
+  
+}
+
+
+HalfbandFilter::HalfbandFilter(unsigned taps, uint32_t max_frames, 
+			       bool upsampler)
+  : m_taps(taps),
+    m_coefs(taps),
+    m_history(taps - 1 + max_frames, 0),
+    m_odd(upsampler ? 0 : taps / 2 + max_frames, 0) {
+  
+  // a Kaiser windowed sinc with the cutoff at half the Nyquist frequency,
+  // only the odd taps around the center (the FIR branch) are stored
+  const double beta = 8;
+  unsigned length = 2 * taps - 1;
+  double center = taps - 1;
+  double sum = 0;
+  vector<double> h(taps);
+  for (unsigned j = 0; j < taps; ++j) {
+    double n = 2 * j;
+    double x = (n - center) / 2;
+    double r = (n - center) / center;
+    double w = bessel_i0(beta * sqrt(1 - r * r)) / bessel_i0(beta);
+    h[j] = sin(M_PI * x) / (M_PI * x) * w;
+    sum += h[j];
+  }
+  
+  // the FIR branch has a DC gain of 0.5 and the delay branch has 0.5,
+  // upsampling doubles both since half of the output frames are zeros
+  double gain = (upsampler ? 1.0 : 0.5) / sum;
+  for (unsigned j = 0; j < taps; ++j)
+    m_coefs[taps - 1 - j] = float(h[j] * gain);
+  
+  DBG3("Created a halfband filter with "<<length<<" taps");
+}
+
+
+void HalfbandFilter::upsample(const float* input, float* output, 
+			      uint32_t nframes) {
+  
+  float* hist = &m_history[0];
+  memcpy(hist + m_taps - 1, input, nframes * sizeof(float));
+  
+  // y[2p] = FIR branch, y[2p + 1] = the input delayed by taps / 2 - 1
+  unsigned half = m_taps / 2;
+  for (uint32_t p = 0; p < nframes; ++p) {
+    output[2 * p] = dot(&m_coefs[0], hist + p, m_taps);
+    output[2 * p + 1] = hist[p + half];
+  }
+  
+  memmove(hist, hist + nframes, (m_taps - 1) * sizeof(float));
+}
+
+
+void HalfbandFilter::downsample(const float* input, float* output, 
+				uint32_t nframes) {
+  
+  float* even = &m_history[0];
+  float* odd = &m_odd[0];
+  unsigned half = m_taps / 2;
+  for (uint32_t p = 0; p < nframes; ++p) {
+    even[m_taps - 1 + p] = input[2 * p];
+    odd[half + p] = input[2 * p + 1];
+  }
+  
+  // z[p] = FIR branch on the even frames + 0.5 * the delayed odd frames
+  for (uint32_t p = 0; p < nframes; ++p)
+    output[p] = dot(&m_coefs[0], even + p, m_taps) + 0.5f * odd[p];
+  
+  memmove(even, even + nframes, (m_taps - 1) * sizeof(float));
+  memmove(odd, odd + nframes, half * sizeof(float));
+}
+
+
+unsigned HalfbandFilter::get_delay() const {
+  return m_taps - 1;
+}
+
+
+float HalfbandFilter::dot(const float* a, const float* b, unsigned n) {
+#if defined(__SSE__)
+  __m128 acc = _mm_setzero_ps();
+  for (unsigned i = 0; i < n; i += 4)
+    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), 
+				     _mm_loadu_ps(b + i)));
+  float sum[4];
+  _mm_storeu_ps(sum, acc);
+  return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+#else
+  float sum[4] = { 0, 0, 0, 0 };
+  for (unsigned i = 0; i < n; i += 4) {
+    sum[0] += a[i] * b[i];
+    sum[1] += a[i + 1] * b[i + 1];
+    sum[2] += a[i + 2] * b[i + 2];
+    sum[3] += a[i + 3] * b[i + 3];
+  }
+  return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+#endif
+}
+
+
+Oversampler::Oversampler(LV2Host& host, unsigned factor, 
+			 uint32_t max_frames)
+  : m_host(host),
+    m_factor(factor),
+    m_max_frames(max_frames),
+    m_latency(0) {
+  
+  unsigned stages = 0;
+  while ((1U << stages) < factor)
+    ++stages;
+  
+  vector<LV2Port>& ports = host.get_ports();
+  m_channel.resize(ports.size(), -1);
+  for (uint32_t p = 0; p < ports.size(); ++p) {
+    
+    if (ports[p].type == MidiType && ports[p].context == AudioContext) {
+      if (ports[p].direction == InputPort)
+	m_midi_inputs.push_back(p);
+      else
+	m_midi_outputs.push_back(p);
+    }
+    
+    if (ports[p].type != AudioType)
+      continue;
+    
+    bool input = (ports[p].direction == InputPort);
+    Channel c;
+    c.port = p;
+    c.outer = 0;
+    c.inner = static_cast<float*>(ports[p].buffer);
+    for (unsigned s = 0; s < stages; ++s) {
+      // stage s upsamples from factor 2^s, so it gets longer blocks
+      c.stages.push_back(new HalfbandFilter(stage_taps(s), max_frames << s,
+					    input));
+    }
+    if (input) {
+      m_channel[p] = m_inputs.size();
+      m_inputs.push_back(c);
+    }
+    else {
+      m_channel[p] = -2 - int(m_outputs.size());
+      m_outputs.push_back(c);
+    }
+  }
+  
+  // every stage delays by the same number of frames at its higher rate
+  // when upsampling and when downsampling
+  for (unsigned s = 0; s < stages; ++s)
+    m_latency += 2 * (stage_taps(s) - 1) / float(2 << s);
+  
+  m_scratch[0].resize(max_frames * factor);
+  m_scratch[1].resize(max_frames * factor);
+}
+
+
+Oversampler::~Oversampler() {
+  for (unsigned c = 0; c < m_inputs.size(); ++c) {
+    for (unsigned s = 0; s < m_inputs[c].stages.size(); ++s)
+      delete m_inputs[c].stages[s];
+  }
+  for (unsigned c = 0; c < m_outputs.size(); ++c) {
+    for (unsigned s = 0; s < m_outputs[c].stages.size(); ++s)
+      delete m_outputs[c].stages[s];
+  }
+}
+
+
+void Oversampler::run(uint32_t nframes) {
+  
+  if (nframes > m_max_frames) {
+    DBG0("The block is larger than the oversampler can handle");
+    nframes = m_max_frames;
+  }
+  
+  // upsample the inputs, the last stage writes to the plugin's buffer
+  for (unsigned c = 0; c < m_inputs.size(); ++c) {
+    Channel& ch = m_inputs[c];
+    const float* in = static_cast<const float*>(ch.outer);
+    uint32_t n = nframes;
+    for (unsigned s = 0; s < ch.stages.size(); ++s) {
+      float* out = (s + 1 == ch.stages.size() ? 
+		    ch.inner : &m_scratch[s % 2][0]);
+      ch.stages[s]->upsample(in, out, n);
+      in = out;
+      n *= 2;
+    }
+  }
+  
+  for (unsigned j = 0; j < m_midi_inputs.size(); ++j) {
+    scale_events(static_cast<LV2_Event_Buffer*>
+		 (m_host.get_ports()[m_midi_inputs[j]].buffer), m_factor, 1);
+  }
+  
+  m_host.run(nframes * m_factor);
+  
+  for (unsigned j = 0; j < m_midi_outputs.size(); ++j) {
+    scale_events(static_cast<LV2_Event_Buffer*>
+		 (m_host.get_ports()[m_midi_outputs[j]].buffer), 1, m_factor);
+  }
+  
+  // downsample the outputs, the last stage writes to the outer buffer
+  for (unsigned c = 0; c < m_outputs.size(); ++c) {
+    Channel& ch = m_outputs[c];
+    const float* in = ch.inner;
+    uint32_t n = nframes * m_factor;
+    for (unsigned s = ch.stages.size(); s > 0; --s) {
+      n /= 2;
+      float* out = (s == 1 ? 
+		    static_cast<float*>(ch.outer) : &m_scratch[s % 2][0]);
+      ch.stages[s - 1]->downsample(in, out, n);
+      in = out;
+    }
+  }
+}
+
+
+unsigned Oversampler::get_factor() const {
+  return m_factor;
+}
+
+
+float Oversampler::get_latency() const {
+  return m_latency;
+}
+
+
+unsigned Oversampler::stage_taps(unsigned stage) {
+  return stage == 0 ? 32 : 12;
+}
+
+
+void Oversampler::scale_events(LV2_Event_Buffer* buffer, unsigned mul, 
+			       unsigned div) {
+  LV2_Event_Iterator iter;
+  lv2_event_begin(&iter, buffer);
+  while (lv2_event_is_valid(&iter)) {
+    uint8_t* data;
+    LV2_Event* ev = lv2_event_get(&iter, &data);
+    ev->frames = ev->frames * mul / div;
+    lv2_event_increment(&iter);
+  }
+}
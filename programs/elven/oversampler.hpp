@@ -0,0 +1,142 @@
+/****************************************************************************
+    
+    oversampler.hpp - Runs a plugin at a multiple of the JACK sample rate
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef OVERSAMPLER_HPP
+#define OVERSAMPLER_HPP
+
+#include <vector>
+
+#include <stdint.h>
+
+#include "lv2host.hpp"
+
+
+/** A linear phase halfband lowpass filter that upsamples or decimates by 2.
+    Every other coefficient of a halfband filter is zero except the middle
+    one, so it is split into two polyphase branches: one is a plain delay
+    and the other is a short FIR filter on every other sample, which is
+    computed with SSE when it is available. A filter object keeps the 
+    history of one signal, so it should only be used in one direction. */
+class HalfbandFilter {
+public:
+  
+  /** Create a filter with @c taps nonzero coefficients in the FIR branch 
+      (a multiple of 4) for blocks of at most @c max_frames input frames. */
+  HalfbandFilter(unsigned taps, uint32_t max_frames, bool upsampler);
+  
+  /** Write 2 * @c nframes frames to @c output. */
+  void upsample(const float* input, float* output, uint32_t nframes);
+  
+  /** Read 2 * @c nframes frames from @c input. */
+  void downsample(const float* input, float* output, uint32_t nframes);
+  
+  /** The group delay, in frames at the higher rate. */
+  unsigned get_delay() const;
+  
+protected:
+  
+  static inline float dot(const float* a, const float* b, unsigned n);
+  
+  unsigned m_taps;
+  // the FIR branch coefficients in reverse order, so the convolution is a
+  // dot product with the history
+  std::vector<float> m_coefs;
+  // the input (or the even input frames when decimating) with taps - 1
+  // frames of history first
+  std::vector<float> m_history;
+  // the odd input frames when decimating, with taps / 2 frames of history
+  std::vector<float> m_odd;
+  
+};
+
+
+/** This class runs a plugin at 2, 4 or 8 times the rate of the audio that
+    is passed to it, with cascaded halfband filters that upsample the audio
+    inputs before the plugin runs and downsample the audio outputs after.
+    The first stage has the sharpest filter since it needs to keep the 
+    whole audible band, the later ones only need to remove images that are
+    far above it. The plugin must have been created with the higher rate 
+    and its audio buffers must have been allocated by the host with room 
+    for the oversampled blocks. Event timestamps in the MIDI ports are 
+    multiplied by the factor before the plugin runs and divided after. */
+class Oversampler {
+public:
+  
+  /** @c max_frames is the largest block at the lower rate. */
+  Oversampler(LV2Host& host, unsigned factor, uint32_t max_frames);
+  
+  ~Oversampler();
+  
+  /** Set the buffer for an audio port, at the lower rate. This is 
+      realtime safe. */
+  inline void set_buffer(uint32_t port, void* buffer);
+  
+  /** Run the plugin for @c nframes frames at the lower rate. */
+  void run(uint32_t nframes);
+  
+  unsigned get_factor() const;
+  
+  /** Returns the latency that the filters add, in frames at the lower 
+      rate. */
+  float get_latency() const;
+  
+protected:
+  
+  struct Channel {
+    uint32_t port;
+    void* outer;
+    float* inner;
+    std::vector<HalfbandFilter*> stages;
+  };
+  
+  /** The number of FIR coefficients for each stage. */
+  static unsigned stage_taps(unsigned stage);
+  
+  static void scale_events(LV2_Event_Buffer* buffer, unsigned mul, 
+			   unsigned div);
+  
+  LV2Host& m_host;
+  unsigned m_factor;
+  uint32_t m_max_frames;
+  std::vector<Channel> m_inputs;
+  std::vector<Channel> m_outputs;
+  std::vector<uint32_t> m_midi_inputs;
+  std::vector<uint32_t> m_midi_outputs;
+  // the channel for each port number, -1 for other ports
+  std::vector<int> m_channel;
+  std::vector<float> m_scratch[2];
+  float m_latency;
+  
+};
+
+
+void Oversampler::set_buffer(uint32_t port, void* buffer) {
+  int c = m_channel[port];
+  if (c >= 0)
+    m_inputs[c].outer = buffer;
+  else if (c < -1)
+    m_outputs[-c - 2].outer = buffer;
+}
+
+
+#endif
@@ -0,0 +1,344 @@
+/****************************************************************************
+    
+    render.cpp - Offline rendering without JACK
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <cctype>
+#include <cstring>
+
+#include <lv2_event_helpers.h>
+
+#include "debug.hpp"
+#include "render.hpp"
+#include "urimap.hpp"
+
+
+using namespace std;
+
+
+namespace {
+  
+  /** Pick a sound file format from the file name extension. */
+  int format_from_name(const std::string& filename) {
+    string ext;
+    string::size_type dot = filename.rfind('.');
+    if (dot != string::npos)
+      ext = filename.substr(dot + 1);
+    for (unsigned i = 0; i < ext.size(); ++i)
+      ext[i] = tolower(ext[i]);
+    if (ext == "flac")
+      return SF_FORMAT_FLAC | SF_FORMAT_PCM_24;
+    if (ext == "aif" || ext == "aiff")
+      return SF_FORMAT_AIFF | SF_FORMAT_FLOAT;
+    if (ext == "ogg")
+      return SF_FORMAT_OGG | SF_FORMAT_VORBIS;
+    return SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+  }
+  
+}
+
+
+OfflineRenderer::OfflineRenderer(LV2Host& host, uint32_t block_size)
+  : m_host(host),
+    m_block_size(block_size),
+    m_valid(false),
+    m_midi_port(-1),
+    m_events(0),
+    m_next_event(0),
+    m_changes(0),
+    m_next_change(0),
+    m_frame(0) {
+  
+  if (!m_host.is_valid() || block_size == 0)
+    return;
+  
+  // there is no period to size the event buffers from, so make room for
+  // a lot of events in every block
+  if (!m_host.allocate_buffers(65536, block_size)) {
+    DBG0("Could not allocate the port buffers!");
+    return;
+  }
+  
+  vector<LV2Port>& ports = m_host.get_ports();
+  for (uint32_t i = 0; i < ports.size(); ++i) {
+    if (ports[i].type == AudioType && ports[i].direction == InputPort)
+      m_audio_inputs.push_back(i);
+    else if (ports[i].type == AudioType && ports[i].direction == OutputPort)
+      m_outputs.push_back(i);
+    else if (ports[i].type == MidiType) {
+      m_event_ports.push_back(i);
+      if (m_midi_port == -1 && ports[i].direction == InputPort)
+	m_midi_port = i;
+    }
+  }
+  
+  long def = m_host.get_default_midi_port();
+  if (def >= 0 && def < long(ports.size()) && 
+      ports[def].type == MidiType && ports[def].direction == InputPort)
+    m_midi_port = def;
+  
+  // there is no deadline, so don't drop audio while presets are restored
+  m_host.set_offline(true);
+  m_host.activate();
+  m_valid = true;
+}
+
+
+OfflineRenderer::~OfflineRenderer() {
+  if (m_valid)
+    m_host.deactivate();
+}
+
+
+bool OfflineRenderer::is_valid() const {
+  return m_valid;
+}
+
+
+void OfflineRenderer::set_events(const std::vector<MidiFileEvent>* events) {
+  m_events = events;
+  m_next_event = 0;
+}
+
+
+void OfflineRenderer::set_automation(const std::vector<AutomationEvent>* 
+				     changes) {
+  m_changes = changes;
+  m_next_change = 0;
+}
+
+
+void OfflineRenderer::reset() {
+  if (!m_valid)
+    return;
+  m_host.deactivate();
+  m_host.activate();
+  m_frame = 0;
+  m_next_event = 0;
+  m_next_change = 0;
+}
+
+
+void OfflineRenderer::run_block(uint32_t nframes) {
+  
+  // the data files for a program change must be restored before the
+  // block that should use them is run
+  m_host.wait_for_state_jobs();
+  
+  vector<LV2Port>& ports = m_host.get_ports();
+  
+  for (unsigned j = 0; j < m_event_ports.size(); ++j) {
+    LV2_Event_Buffer* buf = 
+      static_cast<LV2_Event_Buffer*>(ports[m_event_ports[j]].buffer);
+    lv2_event_buffer_reset(buf, LV2_EVENT_AUDIO_STAMP, buf->data);
+  }
+  
+  // write the events for this block, the ones that don't fit are written
+  // at the start of the next block
+  if (m_events && m_midi_port != -1) {
+    LV2_Event_Iterator iter;
+    lv2_event_begin(&iter, 
+		    static_cast<LV2_Event_Buffer*>(ports[m_midi_port].buffer));
+    uint64_t end = m_frame + nframes;
+    for ( ; m_next_event < m_events->size(); ++m_next_event) {
+      const MidiFileEvent& e = (*m_events)[m_next_event];
+      if (e.frame >= end)
+	break;
+      uint32_t offset = e.frame > m_frame ? uint32_t(e.frame - m_frame) : 0;
+      if (m_host.handle_midi_program(&e.data[0], e.data.size()) ||
+	  m_host.handle_midi_control(&e.data[0], e.data.size(), offset))
+	continue;
+      if (!lv2_event_write(&iter, offset, 0, URIMap::MidiEvent, 
+			   e.data.size(), &e.data[0])) {
+	DBG2("Event buffer is full, delaying events until the next block");
+	break;
+      }
+    }
+  }
+  
+  // queue the control changes for this block, the host frame counter is
+  // not reset by reset() so the times are relative to it
+  if (m_changes) {
+    uint64_t end = m_frame + nframes;
+    uint64_t base = m_host.get_frame();
+    for ( ; m_next_change < m_changes->size(); ++m_next_change) {
+      const AutomationEvent& e = (*m_changes)[m_next_change];
+      if (e.frame >= end)
+	break;
+      uint64_t offset = e.frame > m_frame ? e.frame - m_frame : 0;
+      if (!m_host.queue_control(e.port, e.value, base + offset)) {
+	DBG2("Control queue is full, delaying changes until the next block");
+	break;
+      }
+    }
+  }
+  
+  m_host.run(nframes);
+  m_frame += nframes;
+}
+
+
+bool OfflineRenderer::render(uint64_t frames, const std::string& filename) {
+  
+  if (!m_valid)
+    return false;
+  
+  if (m_outputs.empty()) {
+    DBG0("The plugin has no audio outputs");
+    return false;
+  }
+  
+  SF_INFO info;
+  memset(&info, 0, sizeof(info));
+  info.samplerate = m_host.get_frame_rate();
+  info.channels = m_outputs.size();
+  info.format = format_from_name(filename);
+  SNDFILE* file = sf_open(filename.c_str(), SFM_WRITE, &info);
+  if (!file) {
+    DBG0("Could not open "<<filename<<" for writing: "<<sf_strerror(0));
+    return false;
+  }
+  
+  vector<float> interleaved(m_block_size * m_outputs.size());
+  bool ok = true;
+  
+  uint64_t end = m_frame + frames;
+  while (ok && m_frame < end) {
+    uint32_t nframes = m_block_size;
+    if (end - m_frame < nframes)
+      nframes = uint32_t(end - m_frame);
+    run_block(nframes);
+    m_host.run_main();
+    ok = write_outputs(file, nframes, interleaved);
+  }
+  
+  sf_close(file);
+  return ok;
+}
+
+
+bool OfflineRenderer::process(const std::string& input, 
+			      const std::string& output, uint64_t tail) {
+  
+  if (!m_valid)
+    return false;
+  
+  if (m_outputs.empty()) {
+    DBG0("The plugin has no audio outputs");
+    return false;
+  }
+  
+  SF_INFO in_info;
+  memset(&in_info, 0, sizeof(in_info));
+  SNDFILE* in_file = sf_open(input.c_str(), SFM_READ, &in_info);
+  if (!in_file) {
+    DBG0("Could not open "<<input<<": "<<sf_strerror(0));
+    return false;
+  }
+  if (in_info.samplerate != int(m_host.get_frame_rate())) {
+    DBG0(input<<" has the sample rate "<<in_info.samplerate
+	 <<", the plugin runs at "<<m_host.get_frame_rate());
+    sf_close(in_file);
+    return false;
+  }
+  
+  SF_INFO out_info;
+  memset(&out_info, 0, sizeof(out_info));
+  out_info.samplerate = in_info.samplerate;
+  out_info.channels = m_outputs.size();
+  out_info.format = in_info.format;
+  if (!sf_format_check(&out_info))
+    out_info.format = format_from_name(output);
+  SNDFILE* out_file = sf_open(output.c_str(), SFM_WRITE, &out_info);
+  if (!out_file) {
+    DBG0("Could not open "<<output<<" for writing: "<<sf_strerror(0));
+    sf_close(in_file);
+    return false;
+  }
+  
+  vector<LV2Port>& ports = m_host.get_ports();
+  unsigned in_channels = in_info.channels;
+  vector<float> in_buffer(m_block_size * in_channels);
+  vector<float> out_buffer(m_block_size * m_outputs.size());
+  bool ok = true;
+  
+  while (ok) {
+    
+    // read a block, or run the tail with silent inputs
+    uint32_t nframes = uint32_t(sf_readf_float(in_file, &in_buffer[0], 
+					       m_block_size));
+    if (nframes == 0) {
+      if (tail == 0)
+	break;
+      nframes = (tail < m_block_size ? uint32_t(tail) : m_block_size);
+      tail -= nframes;
+      for (unsigned j = 0; j < m_audio_inputs.size(); ++j)
+	memset(ports[m_audio_inputs[j]].buffer, 0, nframes * sizeof(float));
+    }
+    else {
+      for (unsigned j = 0; j < m_audio_inputs.size(); ++j) {
+	float* buf = static_cast<float*>(ports[m_audio_inputs[j]].buffer);
+	unsigned c = (in_channels == 1 ? 0 : j);
+	if (c >= in_channels)
+	  memset(buf, 0, nframes * sizeof(float));
+	else {
+	  for (uint32_t f = 0; f < nframes; ++f)
+	    buf[f] = in_buffer[f * in_channels + c];
+	}
+      }
+    }
+    
+    run_block(nframes);
+    m_host.run_main();
+    ok = write_outputs(out_file, nframes, out_buffer);
+  }
+  
+  sf_close(in_file);
+  sf_close(out_file);
+  return ok;
+}
+
+
+uint64_t OfflineRenderer::get_frame() const {
+  return m_frame;
+}
+
+
+const std::vector<uint32_t>& OfflineRenderer::get_outputs() const {
+  return m_outputs;
+}
+
+
+bool OfflineRenderer::write_outputs(SNDFILE* file, uint32_t nframes,
+				    std::vector<float>& interleaved) {
+  vector<LV2Port>& ports = m_host.get_ports();
+  unsigned nchannels = m_outputs.size();
+  for (unsigned c = 0; c < nchannels; ++c) {
+    const float* buf = static_cast<float*>(ports[m_outputs[c]].buffer);
+    for (uint32_t f = 0; f < nframes; ++f)
+      interleaved[f * nchannels + c] = buf[f];
+  }
+  if (sf_writef_float(file, &interleaved[0], nframes) != nframes) {
+    DBG0("Could not write the output: "<<sf_strerror(file));
+    return false;
+  }
+  return true;
+}
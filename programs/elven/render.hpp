@@ -0,0 +1,118 @@
+/****************************************************************************
+    
+    render.hpp - Offline rendering without JACK
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef RENDER_HPP
+#define RENDER_HPP
+
+#include <string>
+#include <vector>
+
+#include <sndfile.h>
+
+#include "automation.hpp"
+#include "lv2host.hpp"
+#include "midifile.hpp"
+
+
+/** This class drives a plugin without JACK, as fast as it can. It gives
+    all audio ports scratch buffers, feeds MIDI events to the default MIDI
+    input port with sample accurate timestamps and runs the plugin in
+    blocks of a fixed size. The audio inputs are silent unless the signal
+    comes from a sound file passed to process(). Control changes from an
+    Automation are passed to the plugin with sample accurate timestamps
+    too. The plugin is activated by
+    the constructor and deactivated by the destructor. */
+class OfflineRenderer {
+public:
+  
+  /** Prepare the host for offline rendering in blocks of at most 
+      @c block_size frames. */
+  OfflineRenderer(LV2Host& host, uint32_t block_size);
+  
+  ~OfflineRenderer();
+  
+  /** Returns true if the host could be prepared. */
+  bool is_valid() const;
+  
+  /** Set the events that should be sent to the plugin. The times are 
+      relative to the first rendered frame, and the vector must be sorted
+      and stay alive while rendering. */
+  void set_events(const std::vector<MidiFileEvent>* events);
+  
+  /** Set the control changes that should be sent to the plugin. The same
+      rules as for set_events() apply. */
+  void set_automation(const std::vector<AutomationEvent>* changes);
+  
+  /** Deactivate and reactivate the plugin, so the next block starts from a
+      clean state, and start counting frames from 0 again. */
+  void reset();
+  
+  /** Run the plugin for @c nframes frames, which must not be more than
+      the block size. The output port changes are not handled, so 
+      LV2Host::run_main() should be called now and then. */
+  void run_block(uint32_t nframes);
+  
+  /** Render @c frames frames to a sound file. The file type is chosen
+      from the file name extension, WAV is used if it is not known. */
+  bool render(uint64_t frames, const std::string& filename);
+  
+  /** Run a sound file through the plugin and write the output to another
+      sound file, followed by @c tail frames of the plugin's response to 
+      silence. The input must have the sample rate that the plugin was
+      instantiated with. Mono files are sent to all audio inputs, otherwise
+      channel N goes to input N. The output file gets the same format as
+      the input file if possible. */
+  bool process(const std::string& input, const std::string& output,
+	       uint64_t tail);
+  
+  /** Returns the number of frames that have been rendered. */
+  uint64_t get_frame() const;
+  
+  /** Returns the indices of the audio output ports. */
+  const std::vector<uint32_t>& get_outputs() const;
+  
+protected:
+  
+  /** Interleave the output buffers and write them to a file. */
+  bool write_outputs(SNDFILE* file, uint32_t nframes, 
+		     std::vector<float>& interleaved);
+  
+  LV2Host& m_host;
+  uint32_t m_block_size;
+  bool m_valid;
+  
+  long m_midi_port;
+  std::vector<uint32_t> m_audio_inputs;
+  std::vector<uint32_t> m_outputs;
+  std::vector<uint32_t> m_event_ports;
+  
+  const std::vector<MidiFileEvent>* m_events;
+  size_t m_next_event;
+  const std::vector<AutomationEvent>* m_changes;
+  size_t m_next_change;
+  uint64_t m_frame;
+  
+};
+
+
+#endif
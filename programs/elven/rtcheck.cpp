@@ -0,0 +1,288 @@
+/****************************************************************************
+    
+    rtcheck.cpp - Detection of non-realtime safe calls in the JACK thread
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "rtcheck.hpp"
+
+
+/** The number of calls that get a backtrace. Calls after these are only
+    counted. */
+#define RTCHECK_RECORDS 256
+
+/** The maximal depth of the backtraces. */
+#define RTCHECK_FRAMES 16
+
+
+using namespace std;
+
+
+extern "C" {
+  void* __libc_malloc(size_t size);
+  void* __libc_calloc(size_t n, size_t size);
+  void* __libc_realloc(void* ptr, size_t size);
+  void __libc_free(void* ptr);
+}
+
+
+namespace {
+  
+  struct Record {
+    const char* call;
+    int depth;
+    void* frames[RTCHECK_FRAMES];
+  };
+  
+  Record records[RTCHECK_RECORDS];
+  volatile unsigned n_calls = 0;
+  bool enabled = false;
+  __thread bool in_realtime = false;
+  
+  typedef int (*MutexFunc)(pthread_mutex_t*);
+  typedef int (*CondWaitFunc)(pthread_cond_t*, pthread_mutex_t*);
+  typedef int (*SemFunc)(sem_t*);
+  
+  MutexFunc real_mutex_lock = 0;
+  MutexFunc real_mutex_trylock = 0;
+  CondWaitFunc real_cond_wait = 0;
+  SemFunc real_sem_wait = 0;
+  
+  
+  template <typename T> T real(T& func, const char* name) {
+    if (!func)
+      func = reinterpret_cast<T>(dlsym(RTLD_NEXT, name));
+    return func;
+  }
+  
+  
+  /** Resolve the replaced functions when the program is loaded, so the
+      dynamic linker doesn't run in the first thread that calls one of 
+      them, even if RTCheck is never enabled. real() only has to look them
+      up if they are called by a library before this runs. */
+  __attribute__((constructor)) void resolve_functions() {
+    real(real_mutex_lock, "pthread_mutex_lock");
+    real(real_mutex_trylock, "pthread_mutex_trylock");
+    real(real_cond_wait, "pthread_cond_wait");
+    real(real_sem_wait, "sem_wait");
+  }
+  
+  
+  /** Record a call if the calling thread is running realtime code. 
+      Recording is switched off while the backtrace is taken, so anything
+      it calls isn't recorded. */
+  inline void record(const char* call) {
+    if (!in_realtime)
+      return;
+    in_realtime = false;
+    unsigned i = __sync_fetch_and_add(&n_calls, 1);
+    if (i < RTCHECK_RECORDS) {
+      records[i].call = call;
+      records[i].depth = backtrace(records[i].frames, RTCHECK_FRAMES);
+    }
+    in_realtime = true;
+  }
+  
+  
+  /** Returns true if two records have the same call and backtrace. */
+  bool same_site(const Record& a, const Record& b) {
+    return a.call == b.call && a.depth == b.depth && 
+      !memcmp(a.frames, b.frames, a.depth * sizeof(void*));
+  }
+  
+}
+
+
+void RTCheck::enable() {
+  
+  // the first call to backtrace() loads libgcc_s, which allocates memory
+  void* frames[2];
+  backtrace(frames, 2);
+  
+  enabled = true;
+}
+
+
+bool RTCheck::is_enabled() {
+  return enabled;
+}
+
+
+void RTCheck::enter() {
+  if (enabled)
+    in_realtime = true;
+}
+
+
+void RTCheck::leave() {
+  in_realtime = false;
+}
+
+
+void RTCheck::report(std::ostream& os) {
+  
+  if (!enabled)
+    return;
+  
+  unsigned n = n_calls;
+  if (n == 0) {
+    os<<"No non-realtime safe calls were made in the JACK thread"<<endl;
+    return;
+  }
+  
+  // group the records by call site
+  unsigned recorded = n < RTCHECK_RECORDS ? n : RTCHECK_RECORDS;
+  vector<unsigned> sites;
+  vector<unsigned> counts;
+  for (unsigned i = 0; i < recorded; ++i) {
+    unsigned j;
+    for (j = 0; j < sites.size(); ++j) {
+      if (same_site(records[sites[j]], records[i]))
+	break;
+    }
+    if (j == sites.size()) {
+      sites.push_back(i);
+      counts.push_back(0);
+    }
+    ++counts[j];
+  }
+  
+  os<<n<<" non-realtime safe calls were made in the JACK thread";
+  if (n > recorded)
+    os<<" (only the first "<<recorded<<" were recorded)";
+  os<<":"<<endl;
+  for (unsigned j = 0; j < sites.size(); ++j) {
+    const Record& r = records[sites[j]];
+    os<<endl<<counts[j]<<" x "<<r.call<<endl;
+    char** symbols = backtrace_symbols(r.frames, r.depth);
+    // skip record() and the replaced function
+    for (int k = 2; k < r.depth; ++k)
+      os<<"    "<<(symbols ? symbols[k] : "???")<<endl;
+    free(symbols);
+  }
+}
+
+
+// The replaced functions
+
+
+extern "C" {
+  
+  void* malloc(size_t size) __THROW {
+    record("malloc()");
+    return __libc_malloc(size);
+  }
+  
+  
+  void* calloc(size_t n, size_t size) __THROW {
+    record("calloc()");
+    return __libc_calloc(n, size);
+  }
+  
+  
+  void* realloc(void* ptr, size_t size) __THROW {
+    record("realloc()");
+    return __libc_realloc(ptr, size);
+  }
+  
+  
+  void free(void* ptr) __THROW {
+    if (ptr)
+      record("free()");
+    __libc_free(ptr);
+  }
+  
+  
+  int pthread_mutex_lock(pthread_mutex_t* mutex) __THROW {
+    record("pthread_mutex_lock()");
+    return real(real_mutex_lock, "pthread_mutex_lock")(mutex);
+  }
+  
+  
+  int pthread_mutex_trylock(pthread_mutex_t* mutex) __THROW {
+    record("pthread_mutex_trylock()");
+    return real(real_mutex_trylock, "pthread_mutex_trylock")(mutex);
+  }
+  
+  
+  int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    record("pthread_cond_wait()");
+    return real(real_cond_wait, "pthread_cond_wait")(cond, mutex);
+  }
+  
+  
+  int sem_wait(sem_t* sem) {
+    record("sem_wait()");
+    return real(real_sem_wait, "sem_wait")(sem);
+  }
+  
+}
+
+
+void* operator new(size_t size) {
+  record("operator new");
+  void* ptr = __libc_malloc(size ? size : 1);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+
+void* operator new[](size_t size) {
+  record("operator new[]");
+  void* ptr = __libc_malloc(size ? size : 1);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+
+void operator delete(void* ptr) {
+  if (ptr)
+    record("operator delete");
+  __libc_free(ptr);
+}
+
+
+void operator delete[](void* ptr) {
+  if (ptr)
+    record("operator delete[]");
+  __libc_free(ptr);
+}
+
+
+void operator delete(void* ptr, size_t) {
+  operator delete(ptr);
+}
+
+
+void operator delete[](void* ptr, size_t) {
+  operator delete[](ptr);
+}
@@ -0,0 +1,57 @@
+/****************************************************************************
+    
+    rtcheck.hpp - Detection of non-realtime safe calls in the JACK thread
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef RTCHECK_HPP
+#define RTCHECK_HPP
+
+#include <iostream>
+
+
+/** Elven replaces malloc(), calloc(), realloc(), free(), the global
+    operator new and delete and the blocking pthread and semaphore calls
+    with versions that record a backtrace when they are called between
+    RTCheck::enter() and RTCheck::leave() in a thread. Nothing is recorded
+    unless RTCheck::enable() has been called. The records are kept in a
+    preallocated array, so the recording itself doesn't allocate. */
+struct RTCheck {
+  
+  /** Start recording. This must be called in the main thread before
+      the JACK thread is started. */
+  static void enable();
+  
+  /** Returns true if recording has been enabled. */
+  static bool is_enabled();
+  
+  /** Mark the start of realtime code in the calling thread. */
+  static void enter();
+  
+  /** Mark the end of realtime code in the calling thread. */
+  static void leave();
+  
+  /** Write a summary of the recorded calls, grouped by call site. */
+  static void report(std::ostream& os);
+  
+};
+
+
+#endif
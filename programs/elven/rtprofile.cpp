@@ -0,0 +1,258 @@
+/****************************************************************************
+    
+    rtprofile.cpp - Realtime settings for Elven's JACK thread
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "debug.hpp"
+#include "rtprofile.hpp"
+
+
+using namespace std;
+
+
+/** The amount of stack that is touched in the realtime thread. */
+#define PREFAULT_STACK_SIZE (64 * 1024)
+
+
+RTProfile::RTProfile()
+  : m_mlock(false),
+    m_prefault(false),
+    m_denormals(false),
+    m_cpu(-1),
+    m_isolated(false),
+    m_policy(false) {
+
+}
+
+
+bool RTProfile::parse(const std::string& settings) {
+  istringstream iss(settings);
+  string setting;
+  bool ok = true;
+  while (getline(iss, setting, ',')) {
+    if (setting == "mlock")
+      m_mlock = true;
+    else if (setting == "prefault")
+      m_prefault = true;
+    else if (setting == "denormals")
+      m_denormals = true;
+    else if (setting.substr(0, 4) == "cpu=")
+      m_cpu = atoi(setting.c_str() + 4);
+    else if (setting == "isolated")
+      m_isolated = true;
+    else if (setting == "policy")
+      m_policy = true;
+    else if (setting == "all")
+      m_mlock = m_prefault = m_denormals = m_policy = true;
+    else if (setting.size()) {
+      DBG0("Unknown realtime setting \""<<setting<<"\"");
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+
+bool RTProfile::is_enabled() const {
+  return m_mlock || m_prefault || m_denormals || m_cpu >= 0 || 
+    m_isolated || m_policy;
+}
+
+
+void RTProfile::apply_process() {
+  
+  if (m_mlock) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE))
+      m_mlock_result = string("failed (") + strerror(errno) + ")";
+    else
+      m_mlock_result = "all current and future memory is locked";
+  }
+  
+  // find an isolated CPU for the realtime thread
+  if (m_isolated) {
+    string isolated;
+    if (!read_isolated_cpus(isolated) || isolated.empty()) {
+      m_cpu_result = "no isolated CPUs found";
+      m_cpu = -1;
+    }
+    else if (m_cpu >= 0 && !cpu_in_list(m_cpu, isolated)) {
+      ostringstream oss;
+      oss<<"CPU "<<m_cpu<<" is not isolated (isolated: "<<isolated<<")";
+      m_cpu_result = oss.str();
+    }
+    else {
+      if (m_cpu < 0)
+	m_cpu = atoi(isolated.c_str());
+      ostringstream oss;
+      oss<<"using isolated CPU "<<m_cpu<<" (isolated: "<<isolated<<")";
+      m_cpu_result = oss.str();
+    }
+  }
+}
+
+
+void RTProfile::apply_thread() {
+  
+  // touch the stack so the realtime thread doesn't page fault on it later
+  if (m_prefault) {
+    prefault_stack();
+    ostringstream oss;
+    oss<<(PREFAULT_STACK_SIZE / 1024)<<" kB of stack prefaulted";
+    m_stack_result = oss.str();
+  }
+  
+  // flush denormals to zero
+  if (m_denormals)
+    m_denormals_result = flush_denormals();
+  
+  // CPU affinity
+  if (m_cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(m_cpu, &set);
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    ostringstream oss;
+    if (result)
+      oss<<"could not bind to CPU "<<m_cpu<<" ("<<strerror(result)<<")";
+    else
+      oss<<"bound to CPU "<<m_cpu;
+    m_affinity_result = oss.str();
+  }
+  
+  // scheduling policy
+  if (m_policy) {
+    int policy;
+    sched_param param;
+    if (pthread_getschedparam(pthread_self(), &policy, &param))
+      m_policy_result = "could not read the scheduling policy";
+    else {
+      ostringstream oss;
+      if (policy == SCHED_FIFO)
+	oss<<"SCHED_FIFO, priority "<<param.sched_priority;
+      else if (policy == SCHED_RR)
+	oss<<"SCHED_RR, priority "<<param.sched_priority;
+      else
+	oss<<"NOT REALTIME (policy "<<policy<<") - is JACK running with -R?";
+      m_policy_result = oss.str();
+    }
+  }
+}
+
+
+void RTProfile::apply_worker() const {
+  if (m_prefault)
+    prefault_stack();
+  if (m_denormals)
+    flush_denormals();
+}
+
+
+void RTProfile::report_process(std::ostream& os) const {
+  if (!is_enabled())
+    return;
+  os<<"Realtime profile:"<<endl;
+  if (m_mlock)
+    os<<"  mlock:     "<<m_mlock_result<<endl;
+  if (m_isolated)
+    os<<"  isolated:  "<<m_cpu_result<<endl;
+}
+
+
+void RTProfile::report_thread(std::ostream& os) const {
+  if (!is_enabled())
+    return;
+  os<<"Realtime profile for the JACK thread:"<<endl;
+  if (m_prefault)
+    os<<"  prefault:  "<<m_stack_result<<endl;
+  if (m_denormals)
+    os<<"  denormals: "<<m_denormals_result<<endl;
+  if (m_cpu >= 0)
+    os<<"  affinity:  "<<m_affinity_result<<endl;
+  if (m_policy)
+    os<<"  policy:    "<<m_policy_result<<endl;
+}
+
+
+void RTProfile::prefault_stack() {
+  volatile char stack[PREFAULT_STACK_SIZE];
+  for (unsigned i = 0; i < PREFAULT_STACK_SIZE; i += 1024)
+    stack[i] = 0;
+  // the compiler can't see what this does with the array, so it can't 
+  // drop the writes above
+  asm volatile("" : : "r" (stack) : "memory");
+}
+
+
+const char* RTProfile::flush_denormals() {
+#if defined(__SSE2__)
+  _mm_setcsr(_mm_getcsr() | 0x8040);
+  return "FTZ and DAZ enabled";
+#elif defined(__SSE__)
+  _mm_setcsr(_mm_getcsr() | 0x8000);
+  return "FTZ enabled (no DAZ without SSE2)";
+#elif defined(__aarch64__)
+  uint64_t fpcr;
+  asm volatile("mrs %0, fpcr" : "=r" (fpcr));
+  asm volatile("msr fpcr, %0" : : "r" (fpcr | (1 << 24)));
+  return "FZ enabled";
+#else
+  return "not supported on this architecture";
+#endif
+}
+
+
+bool RTProfile::read_isolated_cpus(std::string& cpus) {
+  ifstream ifs("/sys/devices/system/cpu/isolated");
+  if (!ifs.good())
+    return false;
+  getline(ifs, cpus);
+  return true;
+}
+
+
+bool RTProfile::cpu_in_list(int cpu, const std::string& list) {
+  istringstream iss(list);
+  string range;
+  while (getline(iss, range, ',')) {
+    int first = atoi(range.c_str());
+    int last = first;
+    string::size_type dash = range.find('-');
+    if (dash != string::npos)
+      last = atoi(range.c_str() + dash + 1);
+    if (cpu >= first && cpu <= last)
+      return true;
+  }
+  return false;
+}
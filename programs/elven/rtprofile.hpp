@@ -0,0 +1,107 @@
+/****************************************************************************
+    
+    rtprofile.hpp - Realtime settings for Elven's JACK thread
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef RTPROFILE_HPP
+#define RTPROFILE_HPP
+
+#include <iostream>
+#include <string>
+
+
+/** A set of things that can be done to make the JACK thread behave better,
+    and the results of doing them. The settings are given as a comma
+    separated list, e.g. "mlock,denormals,cpu=3":
+
+    - mlock: lock all current and future memory with mlockall()
+    - prefault: touch the stack of the realtime thread before processing
+      starts (the port buffers are always zeroed, and thus faulted in, when
+      they are allocated)
+    - denormals: flush denormals to zero (FTZ and DAZ) in the realtime thread
+    - cpu=N: bind the realtime thread to CPU N
+    - isolated: bind the realtime thread to a CPU that is isolated from the
+      scheduler (isolcpus), CPU N if that was given
+    - policy: check that the realtime thread is running with SCHED_FIFO or
+      SCHED_RR
+    - all: mlock, prefault, denormals and policy
+*/
+class RTProfile {
+public:
+
+  RTProfile();
+
+  /** Add the settings in a comma separated list. Returns false if any of
+      them is unknown. */
+  bool parse(const std::string& settings);
+
+  /** Returns true if any settings have been given. */
+  bool is_enabled() const;
+
+  /** Apply the settings that affect the whole process. This should be
+      called in the main thread before the JACK client is activated. */
+  void apply_process();
+
+  /** Apply the settings that affect the calling thread. This should be
+      called in the JACK thread before it starts processing. */
+  void apply_thread();
+
+  /** Apply the stack and denormal settings to a helper thread of the JACK
+      thread, e.g. a worker that runs part of a plugin graph. The CPU 
+      affinity is not applied since the workers should run on other CPUs,
+      and nothing is reported. */
+  void apply_worker() const;
+
+  /** Write a report about which settings took effect. */
+  void report_process(std::ostream& os) const;
+
+  /** Write a report about which thread settings took effect. */
+  void report_thread(std::ostream& os) const;
+
+protected:
+
+  static void prefault_stack();
+
+  static const char* flush_denormals();
+
+  static bool read_isolated_cpus(std::string& cpus);
+
+  static bool cpu_in_list(int cpu, const std::string& list);
+
+  bool m_mlock;
+  bool m_prefault;
+  bool m_denormals;
+  int m_cpu;
+  bool m_isolated;
+  bool m_policy;
+
+  // results
+  std::string m_mlock_result;
+  std::string m_cpu_result;
+  std::string m_stack_result;
+  std::string m_denormals_result;
+  std::string m_affinity_result;
+  std::string m_policy_result;
+
+};
+
+
+#endif
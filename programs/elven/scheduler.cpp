@@ -0,0 +1,309 @@
+/****************************************************************************
+    
+    scheduler.cpp - A work-stealing thread pool that runs a plugin graph
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <climits>
+#include <cstring>
+
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+#include "rtcheck.hpp"
+#include "scheduler.hpp"
+
+
+using namespace std;
+
+
+GraphScheduler::Deque::Deque(unsigned capacity)
+  : m_top(0),
+    m_bottom(0) {
+  long size = 1;
+  while (size < long(capacity))
+    size *= 2;
+  m_nodes = new int[size];
+  m_mask = size - 1;
+}
+
+
+GraphScheduler::Deque::~Deque() {
+  delete [] m_nodes;
+}
+
+
+void GraphScheduler::Deque::push(int node) {
+  long b = m_bottom;
+  m_nodes[b & m_mask] = node;
+  __sync_synchronize();
+  m_bottom = b + 1;
+}
+
+
+int GraphScheduler::Deque::pop() {
+  long b = m_bottom - 1;
+  m_bottom = b;
+  __sync_synchronize();
+  long t = m_top;
+  if (t > b) {
+    m_bottom = t;
+    return -1;
+  }
+  int node = m_nodes[b & m_mask];
+  if (t == b) {
+    // the last node, race the thieves for it
+    if (!__sync_bool_compare_and_swap(&m_top, t, t + 1))
+      node = -1;
+    m_bottom = t + 1;
+  }
+  return node;
+}
+
+
+int GraphScheduler::Deque::steal() {
+  long t = m_top;
+  __sync_synchronize();
+  long b = m_bottom;
+  if (t >= b)
+    return -1;
+  int node = m_nodes[t & m_mask];
+  if (!__sync_bool_compare_and_swap(&m_top, t, t + 1))
+    return -1;
+  return node;
+}
+
+
+GraphScheduler::GraphScheduler(PluginGraph& graph, unsigned threads)
+  : m_graph(graph),
+    m_threads(threads ? threads : 1),
+    m_remaining(0),
+    m_generation(0),
+    m_sleepers(0),
+    m_nframes(0),
+    m_quit(false),
+    m_init(0),
+    m_init_arg(0),
+    m_started(false) {
+  
+  const vector<PluginGraph::Node>& nodes = graph.get_nodes();
+  m_pending = new int[nodes.size()];
+  for (unsigned n = 0; n < nodes.size(); ++n) {
+    m_pending[n] = 0;
+    if (nodes[n].dependencies == 0)
+      m_roots.push_back(n);
+  }
+  
+  m_workers.resize(m_threads);
+  for (unsigned i = 0; i < m_threads; ++i) {
+    m_workers[i].scheduler = this;
+    m_workers[i].index = i;
+    m_workers[i].deque = new Deque(nodes.size());
+    m_workers[i].steals = 0;
+  }
+}
+
+
+GraphScheduler::~GraphScheduler() {
+  stop();
+  for (unsigned i = 0; i < m_workers.size(); ++i)
+    delete m_workers[i].deque;
+  delete [] m_pending;
+}
+
+
+bool GraphScheduler::start(int priority, ThreadInit init, void* arg) {
+  
+  if (m_started)
+    return true;
+  
+  m_init = init;
+  m_init_arg = arg;
+  m_quit = false;
+  
+  for (unsigned i = 1; i < m_threads; ++i) {
+    
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (priority > 0) {
+      sched_param param;
+      memset(&param, 0, sizeof(param));
+      param.sched_priority = priority;
+      pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+      pthread_attr_setschedparam(&attr, &param);
+    }
+    
+    int result = pthread_create(&m_workers[i].thread, &attr, 
+				&GraphScheduler::worker_thread, &m_workers[i]);
+    if (result && priority > 0) {
+      DBG1("Could not start a realtime worker thread, trying without "
+	   "realtime scheduling");
+      result = pthread_create(&m_workers[i].thread, 0, 
+			      &GraphScheduler::worker_thread, &m_workers[i]);
+    }
+    pthread_attr_destroy(&attr);
+    
+    if (result) {
+      DBG0("Could not start worker thread "<<i);
+      m_threads = i;
+      break;
+    }
+  }
+  
+  m_started = true;
+  DBG2("Running the plugin graph with "<<m_threads<<" threads");
+  
+  return m_threads > 1;
+}
+
+
+void GraphScheduler::stop() {
+  if (!m_started)
+    return;
+  m_quit = true;
+  __sync_fetch_and_add(&m_generation, 1);
+  futex_wake(&m_generation);
+  for (unsigned i = 1; i < m_threads; ++i)
+    pthread_join(m_workers[i].thread, 0);
+  m_started = false;
+}
+
+
+void GraphScheduler::run(uint32_t nframes) {
+  
+  const vector<PluginGraph::Node>& nodes = m_graph.get_nodes();
+  
+  // the workers are all idle now, so plain stores are fine here, the
+  // barrier in the generation increment publishes them
+  for (unsigned n = 0; n < nodes.size(); ++n)
+    m_pending[n] = nodes[n].dependencies;
+  m_nframes = nframes;
+  m_remaining = nodes.size();
+  for (unsigned j = 0; j < m_roots.size(); ++j)
+    m_workers[0].deque->push(m_roots[j]);
+  
+  // wake up the workers
+  __sync_fetch_and_add(&m_generation, 1);
+  if (m_sleepers > 0)
+    futex_wake(&m_generation);
+  
+  work(0);
+}
+
+
+unsigned GraphScheduler::get_threads() const {
+  return m_threads;
+}
+
+
+uint64_t GraphScheduler::get_steals() const {
+  uint64_t steals = 0;
+  for (unsigned i = 0; i < m_workers.size(); ++i)
+    steals += m_workers[i].steals;
+  return steals;
+}
+
+
+void* GraphScheduler::worker_thread(void* arg) {
+  Worker* me = static_cast<Worker*>(arg);
+  if (me->scheduler->m_init)
+    me->scheduler->m_init(me->scheduler->m_init_arg);
+  me->scheduler->worker_loop(me->index);
+  return 0;
+}
+
+
+void GraphScheduler::worker_loop(unsigned index) {
+  
+  int seen = m_generation;
+  
+  while (!m_quit) {
+    
+    // spin for a while, then sleep until the next cycle
+    for (unsigned s = 0; s < SpinCount && m_generation == seen; ++s)
+      relax();
+    if (m_generation == seen) {
+      __sync_fetch_and_add(&m_sleepers, 1);
+      futex_wait(&m_generation, seen);
+      __sync_fetch_and_sub(&m_sleepers, 1);
+      continue;
+    }
+    
+    seen = m_generation;
+    if (m_quit)
+      break;
+    
+    RTCheck::enter();
+    work(index);
+    RTCheck::leave();
+  }
+}
+
+
+void GraphScheduler::work(unsigned index) {
+  while (m_remaining > 0) {
+    int node = take(index);
+    if (node < 0) {
+      relax();
+      continue;
+    }
+    m_graph.run_node(node, m_nframes);
+    finish(index, node);
+  }
+}
+
+
+int GraphScheduler::take(unsigned index) {
+  int node = m_workers[index].deque->pop();
+  if (node >= 0)
+    return node;
+  for (unsigned j = 1; j < m_threads; ++j) {
+    node = m_workers[(index + j) % m_threads].deque->steal();
+    if (node >= 0) {
+      ++m_workers[index].steals;
+      return node;
+    }
+  }
+  return -1;
+}
+
+
+void GraphScheduler::finish(unsigned index, unsigned node) {
+  const vector<unsigned>& succ = m_graph.get_nodes()[node].successors;
+  for (unsigned j = 0; j < succ.size(); ++j) {
+    if (__sync_sub_and_fetch(&m_pending[succ[j]], 1) == 0)
+      m_workers[index].deque->push(succ[j]);
+  }
+  __sync_sub_and_fetch(&m_remaining, 1);
+}
+
+
+void GraphScheduler::futex_wait(volatile int* addr, int value) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, 0, 0, 0);
+}
+
+
+void GraphScheduler::futex_wake(volatile int* addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+}
@@ -0,0 +1,164 @@
+/****************************************************************************
+    
+    scheduler.hpp - A work-stealing thread pool that runs a plugin graph
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <vector>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "graph.hpp"
+
+
+/** This class runs the nodes of a PluginGraph on several threads, one
+    cycle at a time. The thread that calls run() is worker 0 and the 
+    others are threads owned by the scheduler. Every node has a counter
+    of unfinished dependencies that is reset at the start of the cycle, and
+    the worker that finishes the last dependency of a node pushes it on its
+    own deque. Idle workers steal from the other deques. Between cycles the
+    workers spin for a short while and then sleep on a futex, so nothing 
+    blocks or allocates in run(), and run() returns when all nodes have
+    been run. */
+class GraphScheduler {
+public:
+  
+  /** The type of the function that is called in each new worker thread
+      before it starts working. */
+  typedef void (*ThreadInit)(void*);
+  
+  /** Create a scheduler with @c threads workers (including the thread
+      that calls run()) for a graph whose buffers were allocated for 
+      parallel processing. */
+  GraphScheduler(PluginGraph& graph, unsigned threads);
+  
+  ~GraphScheduler();
+  
+  /** Start the worker threads, with SCHED_FIFO and the given priority if
+      it is larger than 0. */
+  bool start(int priority = 0, ThreadInit init = 0, void* arg = 0);
+  
+  /** Stop the worker threads. */
+  void stop();
+  
+  /** Run all nodes in the graph once. This is realtime safe. */
+  void run(uint32_t nframes);
+  
+  /** Returns the number of workers, including the calling thread. */
+  unsigned get_threads() const;
+  
+  /** Returns the number of nodes that have been stolen from another 
+      worker's deque. */
+  uint64_t get_steals() const;
+  
+protected:
+  
+  /** A fixed size Chase-Lev deque of node indices. The owner pushes and
+      pops at the bottom and the other workers steal from the top. The 
+      indices are never reset, so a thief that is late from the last cycle
+      can never succeed with a stale index. */
+  class Deque {
+  public:
+    
+    Deque(unsigned capacity);
+    ~Deque();
+    
+    void push(int node);
+    
+    int pop();
+    
+    int steal();
+    
+  protected:
+    
+    // the thieves write m_top and the owner writes m_bottom, keep them on
+    // different cache lines
+    volatile long m_top;
+    char m_pad[64 - sizeof(long)];
+    volatile long m_bottom;
+    volatile int* m_nodes;
+    long m_mask;
+    
+  };
+  
+  struct Worker {
+    GraphScheduler* scheduler;
+    unsigned index;
+    pthread_t thread;
+    Deque* deque;
+    volatile uint64_t steals;
+  };
+  
+  static void* worker_thread(void* arg);
+  
+  /** Wait for new cycles and work on them until stop() is called. */
+  void worker_loop(unsigned index);
+  
+  /** Run nodes until all nodes in the current cycle have been run. */
+  void work(unsigned index);
+  
+  /** Get a node from the worker's own deque, or steal one. */
+  int take(unsigned index);
+  
+  /** Mark a node as finished and push the nodes that became ready. */
+  void finish(unsigned index, unsigned node);
+  
+  static void futex_wait(volatile int* addr, int value);
+  
+  static void futex_wake(volatile int* addr);
+  
+  static inline void relax();
+  
+  /** The number of times an idle worker polls before it goes to sleep. */
+  static const unsigned SpinCount = 20000;
+  
+  PluginGraph& m_graph;
+  unsigned m_threads;
+  std::vector<Worker> m_workers;
+  std::vector<unsigned> m_roots;
+  volatile int* m_pending;
+  
+  volatile int m_remaining;
+  char m_pad[64 - sizeof(int)];
+  volatile int m_generation;
+  volatile int m_sleepers;
+  volatile uint32_t m_nframes;
+  volatile bool m_quit;
+  ThreadInit m_init;
+  void* m_init_arg;
+  bool m_started;
+  
+};
+
+
+void GraphScheduler::relax() {
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+
+#endif
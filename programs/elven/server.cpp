@@ -0,0 +1,459 @@
+/****************************************************************************
+    
+    server.cpp - Many independent plugin instances in one JACK client
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+#include "server.hpp"
+
+
+using namespace std;
+using namespace sigc;
+
+
+HostServer::HostServer(jack_client_t* client, 
+		       Glib::RefPtr<Glib::MainLoop> loop)
+  : m_client(client),
+    m_loop(loop),
+    m_instances(new InstanceList),
+    m_cycles(0),
+    m_event_capacity(8192),
+    m_socket(-1) {
+  pthread_mutex_init(&m_mutex, 0);
+}
+
+
+HostServer::~HostServer() {
+  stop();
+  while (m_instances->size() > 0) {
+    string error;
+    remove(m_instances->back()->name, error);
+  }
+  delete m_instances;
+  pthread_mutex_destroy(&m_mutex);
+}
+
+
+bool HostServer::start(const std::string& path) {
+  
+  sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    DBG0("The socket path "<<path<<" is too long");
+    return false;
+  }
+  
+  // a socket left behind by an old server is removed, but nothing else
+  struct stat st;
+  if (!lstat(path.c_str(), &st)) {
+    if (!S_ISSOCK(st.st_mode)) {
+      DBG0(path<<" exists and is not a socket, will not replace it");
+      return false;
+    }
+    unlink(path.c_str());
+  }
+  else if (errno != ENOENT) {
+    DBG0("Could not check "<<path<<": "<<strerror(errno));
+    return false;
+  }
+  
+  m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (m_socket == -1) {
+    DBG0("Could not create the command socket: "<<strerror(errno));
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+  if (bind(m_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ||
+      listen(m_socket, 8)) {
+    DBG0("Could not listen on "<<path<<": "<<strerror(errno));
+    close(m_socket);
+    m_socket = -1;
+    return false;
+  }
+  
+  m_path = path;
+  m_accept_connection = Glib::signal_io().
+    connect(mem_fun(*this, &HostServer::on_accept), m_socket, Glib::IO_IN);
+  DBG2("Listening for commands on "<<path);
+  
+  return true;
+}
+
+
+void HostServer::stop() {
+  if (m_socket == -1)
+    return;
+  m_accept_connection.disconnect();
+  close(m_socket);
+  m_socket = -1;
+  unlink(m_path.c_str());
+  
+  // the client watches go away when they notice that the fds are closed
+  map<int, string>::iterator iter;
+  for (iter = m_clients.begin(); iter != m_clients.end(); ++iter)
+    shutdown(iter->first, SHUT_RDWR);
+}
+
+
+bool HostServer::add(const std::string& name, const std::string& uri,
+		     std::string& error) {
+  
+  if (name.empty() || name.find('.') != string::npos) {
+    error = "invalid name";
+    return false;
+  }
+  if (find(name)) {
+    error = "there is already a plugin called " + name;
+    return false;
+  }
+  
+  LV2Host* host = new LV2Host(uri, jack_get_sample_rate(m_client));
+  if (!host->is_valid()) {
+    delete host;
+    error = "could not load " + uri;
+    return false;
+  }
+  
+  Instance* instance = new Instance;
+  instance->name = name;
+  instance->host = host;
+  
+  // register JACK ports for all audio and MIDI ports
+  const vector<LV2Port>& ports = host->get_ports();
+  for (size_t p = 0; p < ports.size(); ++p) {
+    jack_port_t* port = 0;
+    if (ports[p].type == MidiType || ports[p].type == AudioType) {
+      string port_name = name + "." + ports[p].symbol;
+      port = jack_port_register(m_client, port_name.c_str(),
+				(ports[p].type == MidiType ?
+				 JACK_DEFAULT_MIDI_TYPE : 
+				 JACK_DEFAULT_AUDIO_TYPE),
+				(ports[p].direction == InputPort ?
+				 JackPortIsInput : JackPortIsOutput), 0);
+      if (!port) {
+	DBG0("Could not register the JACK port "<<port_name);
+	for (size_t q = 0; q < instance->ports.size(); ++q) {
+	  if (instance->ports[q])
+	    jack_port_unregister(m_client, instance->ports[q]);
+	}
+	delete instance;
+	delete host;
+	error = "could not register the JACK port " + port_name;
+	return false;
+      }
+    }
+    instance->ports.push_back(port);
+  }
+  
+  // the buffers must have the current size when the instance is published
+  pthread_mutex_lock(&m_mutex);
+  if (!host->allocate_buffers(m_event_capacity)) {
+    pthread_mutex_unlock(&m_mutex);
+    for (size_t q = 0; q < instance->ports.size(); ++q) {
+      if (instance->ports[q])
+	jack_port_unregister(m_client, instance->ports[q]);
+    }
+    delete instance;
+    delete host;
+    error = "could not allocate the port buffers";
+    return false;
+  }
+  if (host->get_presets().size() > 0)
+    host->set_program(host->get_presets().begin()->first);
+  host->activate();
+  
+  InstanceList* list = new InstanceList(*m_instances);
+  list->push_back(instance);
+  publish(list);
+  pthread_mutex_unlock(&m_mutex);
+  
+  DBG2("Added "<<name<<" ("<<host->get_plugin_uri()<<")");
+  
+  return true;
+}
+
+
+bool HostServer::remove(const std::string& name, std::string& error) {
+  
+  Instance* instance = find(name);
+  if (!instance) {
+    error = "there is no plugin called " + name;
+    return false;
+  }
+  
+  pthread_mutex_lock(&m_mutex);
+  InstanceList* list = new InstanceList;
+  for (size_t i = 0; i < m_instances->size(); ++i) {
+    if ((*m_instances)[i] != instance)
+      list->push_back((*m_instances)[i]);
+  }
+  publish(list);
+  pthread_mutex_unlock(&m_mutex);
+  
+  // the JACK thread can't see it any more
+  for (size_t p = 0; p < instance->ports.size(); ++p) {
+    if (instance->ports[p])
+      jack_port_unregister(m_client, instance->ports[p]);
+  }
+  instance->host->deactivate();
+  delete instance->host;
+  delete instance;
+  
+  DBG2("Removed "<<name);
+  
+  return true;
+}
+
+
+bool HostServer::set(const std::string& name, const std::string& symbol, 
+		     float value, std::string& error) {
+  
+  Instance* instance = find(name);
+  if (!instance) {
+    error = "there is no plugin called " + name;
+    return false;
+  }
+  
+  const vector<LV2Port>& ports = instance->host->get_ports();
+  for (uint32_t p = 0; p < ports.size(); ++p) {
+    if (ports[p].symbol == symbol) {
+      if (ports[p].type != ControlType || ports[p].direction != InputPort) {
+	error = symbol + " is not a control input";
+	return false;
+      }
+      instance->host->set_control(p, value);
+      return true;
+    }
+  }
+  
+  error = name + " has no port called " + symbol;
+  return false;
+}
+
+
+bool HostServer::program(const std::string& name, unsigned program,
+			 std::string& error) {
+  
+  Instance* instance = find(name);
+  if (!instance) {
+    error = "there is no plugin called " + name;
+    return false;
+  }
+  if (instance->host->get_presets().find(program) == 
+      instance->host->get_presets().end()) {
+    error = "there is no such program";
+    return false;
+  }
+  
+  instance->host->set_program(program);
+  return true;
+}
+
+
+bool HostServer::set_event_capacity(uint32_t event_capacity) {
+  bool ok = true;
+  pthread_mutex_lock(&m_mutex);
+  m_event_capacity = event_capacity;
+  for (size_t i = 0; i < m_instances->size(); ++i) {
+    Instance* instance = (*m_instances)[i];
+    if (!instance->host->resize_buffers(event_capacity)) {
+      DBG0("Could not resize the port buffers for "<<instance->name);
+      ok = false;
+    }
+  }
+  pthread_mutex_unlock(&m_mutex);
+  return ok;
+}
+
+
+void HostServer::set_frame_rate(unsigned long frame_rate) {
+  for (size_t i = 0; i < m_instances->size(); ++i)
+    (*m_instances)[i]->host->set_frame_rate(frame_rate);
+}
+
+
+bool HostServer::run_main() {
+  for (size_t i = 0; i < m_instances->size(); ++i)
+    (*m_instances)[i]->host->run_main();
+  return true;
+}
+
+
+void HostServer::handle_command(const std::string& line, std::string& reply) {
+  
+  istringstream iss(line);
+  string command, name, arg;
+  iss>>command;
+  
+  string error;
+  bool ok = false;
+  
+  if (command == "add") {
+    if (iss>>name>>arg)
+      ok = add(name, arg, error);
+    else
+      error = "usage: add NAME URI";
+  }
+  
+  else if (command == "remove") {
+    if (iss>>name)
+      ok = remove(name, error);
+    else
+      error = "usage: remove NAME";
+  }
+  
+  else if (command == "set") {
+    float value;
+    if (iss>>name>>arg>>value)
+      ok = set(name, arg, value, error);
+    else
+      error = "usage: set NAME SYMBOL VALUE";
+  }
+  
+  else if (command == "program") {
+    unsigned number;
+    if (iss>>name>>number)
+      ok = program(name, number, error);
+    else
+      error = "usage: program NAME PROGRAM";
+  }
+  
+  else if (command == "list") {
+    for (size_t i = 0; i < m_instances->size(); ++i) {
+      const Instance* instance = (*m_instances)[i];
+      reply += instance->name + " " + instance->host->get_plugin_uri() + "\n";
+    }
+    ok = true;
+  }
+  
+  else if (command == "quit") {
+    m_loop->quit();
+    ok = true;
+  }
+  
+  else if (command.empty())
+    return;
+  
+  else
+    error = "unknown command " + command;
+  
+  if (ok)
+    reply += "ok\n";
+  else
+    reply += "error " + error + "\n";
+}
+
+
+bool HostServer::on_accept(Glib::IOCondition) {
+  // replies are written without blocking, a client that doesn't read them
+  // must not stop the main loop
+  int fd = accept4(m_socket, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd == -1) {
+    DBG1("Could not accept a command connection: "<<strerror(errno));
+    return true;
+  }
+  m_clients[fd] = "";
+  Glib::signal_io().
+    connect(sigc::bind(mem_fun(*this, &HostServer::on_client), fd),
+	    fd, Glib::IO_IN | Glib::IO_HUP | Glib::IO_ERR);
+  return true;
+}
+
+
+bool HostServer::on_client(Glib::IOCondition, int fd) {
+  
+  char buffer[1024];
+  ssize_t n = read(fd, buffer, sizeof(buffer));
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return true;
+  if (n <= 0) {
+    m_clients.erase(fd);
+    close(fd);
+    return false;
+  }
+  
+  // handle all complete lines
+  string& input = m_clients[fd];
+  input.append(buffer, n);
+  string::size_type end;
+  while ((end = input.find('\n')) != string::npos) {
+    string reply;
+    handle_command(input.substr(0, end), reply);
+    input.erase(0, end + 1);
+    
+    // MSG_NOSIGNAL keeps a client that has gone away from killing us with
+    // SIGPIPE, and one that doesn't read its replies is disconnected
+    for (size_t written = 0; written < reply.size(); ) {
+      ssize_t w = send(fd, reply.data() + written, reply.size() - written,
+		       MSG_NOSIGNAL);
+      if (w == -1 && errno == EINTR)
+	continue;
+      if (w <= 0) {
+	DBG1("Could not write a reply, closing the command connection");
+	m_clients.erase(fd);
+	close(fd);
+	return false;
+      }
+      written += w;
+    }
+  }
+  
+  return true;
+}
+
+
+void HostServer::publish(InstanceList* list) {
+  
+  InstanceList* old = m_instances;
+  __sync_synchronize();
+  m_instances = list;
+  __sync_synchronize();
+  
+  // if the JACK thread is in a cycle it may have the old list, wait until
+  // that cycle is over (a new cycle will see the new list)
+  unsigned cycles = m_cycles;
+  if (cycles & 1) {
+    while (m_cycles == cycles)
+      usleep(500);
+  }
+  
+  delete old;
+}
+
+
+HostServer::Instance* HostServer::find(const std::string& name) const {
+  for (size_t i = 0; i < m_instances->size(); ++i) {
+    if ((*m_instances)[i]->name == name)
+      return (*m_instances)[i];
+  }
+  return 0;
+}
@@ -0,0 +1,163 @@
+/****************************************************************************
+    
+    server.hpp - Many independent plugin instances in one JACK client
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <glibmm.h>
+#include <jack/jack.h>
+#include <pthread.h>
+
+#include "lv2host.hpp"
+
+
+/** This class hosts any number of independent plugin instances in a single
+    JACK client, and lets other programs add and remove them while it is
+    running. The commands are read from a Unix domain socket, one per line,
+    and every command gets a reply that ends with a line that is "ok" or
+    starts with "error":
+    
+    @code
+    add NAME URI               load a plugin and call it NAME
+    remove NAME                remove a plugin
+    set NAME SYMBOL VALUE      set a control input
+    program NAME PROGRAM       select a program
+    list                       list the plugins, one "NAME URI" per line
+    quit                       stop the server
+    @endcode
+    
+    The JACK ports of a plugin are called NAME.SYMBOL. Everything except
+    the JACK process callback runs in the main thread. The process callback
+    reads the instance list without locking, and the main thread never 
+    changes a list that has been published - it publishes a new one and 
+    waits until the JACK thread is not in a cycle that could be using the
+    old one before it deletes that. The buffer size callback is the 
+    exception, it resizes the port buffers while holding a mutex that the
+    main thread holds when it publishes a new list. */
+class HostServer {
+public:
+  
+  /** A plugin instance and its JACK ports, indexed by LV2 port number
+      (0 for control ports). */
+  struct Instance {
+    std::string name;
+    LV2Host* host;
+    std::vector<jack_port_t*> ports;
+  };
+  
+  typedef std::vector<Instance*> InstanceList;
+  
+  HostServer(jack_client_t* client, Glib::RefPtr<Glib::MainLoop> loop);
+  
+  /** Removes all instances. */
+  ~HostServer();
+  
+  /** Start listening for commands on the socket @c path. */
+  bool start(const std::string& path);
+  
+  /** Stop listening for commands. */
+  void stop();
+  
+  /** Returns the current instance list, and marks the start of a cycle
+      that uses it. Only called in the JACK thread. */
+  inline const InstanceList& begin_cycle();
+  
+  /** Marks the end of the cycle. Only called in the JACK thread. */
+  inline void end_cycle();
+  
+  /** Add a plugin instance. */
+  bool add(const std::string& name, const std::string& uri, 
+	   std::string& error);
+  
+  /** Remove a plugin instance. */
+  bool remove(const std::string& name, std::string& error);
+  
+  /** Set a control input. */
+  bool set(const std::string& name, const std::string& symbol, float value,
+	   std::string& error);
+  
+  /** Select a program. */
+  bool program(const std::string& name, unsigned program, 
+	       std::string& error);
+  
+  /** Set the size of the event buffers of all instances, including the
+      ones that are added later. This is called in the JACK buffer size
+      callback. */
+  bool set_event_capacity(uint32_t event_capacity);
+  
+  /** Replace all instances with instances that run at @c frame_rate. */
+  void set_frame_rate(unsigned long frame_rate);
+  
+  /** Call LV2Host::run_main() for all instances. */
+  bool run_main();
+  
+protected:
+  
+  /** Handle a command line and write the reply. */
+  void handle_command(const std::string& line, std::string& reply);
+  
+  bool on_accept(Glib::IOCondition condition);
+  
+  bool on_client(Glib::IOCondition condition, int fd);
+  
+  /** Make @c list the current instance list and delete the old one when 
+      the JACK thread can no longer be using it. */
+  void publish(InstanceList* list);
+  
+  Instance* find(const std::string& name) const;
+  
+  jack_client_t* m_client;
+  Glib::RefPtr<Glib::MainLoop> m_loop;
+  
+  InstanceList* volatile m_instances;
+  // incremented at the start and the end of every cycle, so it is odd when
+  // the JACK thread is running a cycle
+  volatile unsigned m_cycles;
+  // held while the instance list or the buffer sizes change
+  pthread_mutex_t m_mutex;
+  uint32_t m_event_capacity;
+  
+  int m_socket;
+  std::string m_path;
+  sigc::connection m_accept_connection;
+  std::map<int, std::string> m_clients;
+  
+};
+
+
+const HostServer::InstanceList& HostServer::begin_cycle() {
+  __sync_fetch_and_add(&m_cycles, 1);
+  return *m_instances;
+}
+
+
+void HostServer::end_cycle() {
+  __sync_fetch_and_add(&m_cycles, 1);
+}
+
+
+#endif
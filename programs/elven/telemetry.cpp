@@ -0,0 +1,280 @@
+/****************************************************************************
+    
+    telemetry.cpp - DSP load and xrun statistics for Elven
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+#include "lv2host.hpp"
+#include "telemetry.hpp"
+
+
+using namespace std;
+
+
+LoadHistogram::LoadHistogram()
+  : count(0),
+    max(0) {
+  for (unsigned i = 0; i < Buckets; ++i)
+    buckets[i] = 0;
+}
+
+
+void LoadHistogram::add(float percent) {
+  unsigned b = (percent < Buckets - 1 ? unsigned(percent) : Buckets - 1);
+  buckets[b] = buckets[b] + 1;
+  count = count + 1;
+  if (percent > max)
+    max = percent;
+}
+
+
+float LoadHistogram::percentile(float fraction) const {
+  uint32_t total = 0;
+  uint32_t copy[Buckets];
+  for (unsigned i = 0; i < Buckets; ++i) {
+    copy[i] = buckets[i];
+    total += copy[i];
+  }
+  if (total == 0)
+    return 0;
+  uint32_t limit = uint32_t(fraction * total);
+  uint32_t sum = 0;
+  for (unsigned i = 0; i < Buckets; ++i) {
+    sum += copy[i];
+    if (sum > limit)
+      return i + 1;
+  }
+  return Buckets;
+}
+
+
+Telemetry::Telemetry()
+  : m_cycle_start(0),
+    m_phase_start(0),
+    m_period_ns(0),
+    m_period_frames(0),
+    m_xruns(0),
+    m_midi_overflows(0),
+    m_rate(0),
+    m_event_capacity(0),
+    m_host(0),
+    m_enabled(false),
+    m_socket(-1),
+    m_running(false) {
+
+}
+
+
+Telemetry::~Telemetry() {
+  stop_server();
+}
+
+
+bool Telemetry::start_server(const std::string& path, 
+			     unsigned long sample_rate, const LV2Host* host) {
+  
+  sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    DBG0("The socket path "<<path<<" is too long");
+    return false;
+  }
+  
+  m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (m_socket == -1) {
+    DBG0("Could not create the statistics socket: "<<strerror(errno));
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+  unlink(path.c_str());
+  if (bind(m_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ||
+      listen(m_socket, 8)) {
+    DBG0("Could not listen on "<<path<<": "<<strerror(errno));
+    close(m_socket);
+    m_socket = -1;
+    return false;
+  }
+  
+  m_path = path;
+  m_rate = sample_rate;
+  m_host = host;
+  m_running = true;
+  if (pthread_create(&m_thread, 0, &Telemetry::server_thread, this)) {
+    DBG0("Could not start the statistics thread");
+    m_running = false;
+    close(m_socket);
+    m_socket = -1;
+    unlink(path.c_str());
+    return false;
+  }
+  
+  m_enabled = true;
+  DBG2("Serving statistics on "<<path);
+  return true;
+}
+
+
+void Telemetry::stop_server() {
+  if (m_running) {
+    m_running = false;
+    pthread_join(m_thread, 0);
+  }
+  if (m_socket != -1) {
+    close(m_socket);
+    m_socket = -1;
+    unlink(m_path.c_str());
+  }
+  m_enabled = false;
+}
+
+
+void Telemetry::set_sample_rate(unsigned long sample_rate) {
+  m_rate = sample_rate;
+  // makes the JACK thread compute the period length again
+  m_period_frames = 0;
+}
+
+
+void Telemetry::set_event_capacity(uint32_t bytes) {
+  m_event_capacity = bytes;
+}
+
+
+bool Telemetry::is_enabled() const {
+  return m_enabled;
+}
+
+
+void Telemetry::begin_cycle(uint32_t nframes) {
+  if (!m_enabled)
+    return;
+  if (nframes != m_period_frames) {
+    m_period_frames = nframes;
+    m_period_ns = 1e9 * nframes / m_rate;
+  }
+  m_cycle_start = m_phase_start = now();
+}
+
+
+void Telemetry::end_phase(Phase phase) {
+  if (!m_enabled)
+    return;
+  uint64_t t = now();
+  m_phases[phase].add(100 * (t - m_phase_start) / m_period_ns);
+  m_phase_start = t;
+}
+
+
+void Telemetry::end_cycle() {
+  if (!m_enabled)
+    return;
+  m_cycle.add(100 * (now() - m_cycle_start) / m_period_ns);
+}
+
+
+void Telemetry::count_xrun() {
+  __sync_fetch_and_add(&m_xruns, 1);
+}
+
+
+void Telemetry::count_midi_overflow() {
+  __sync_fetch_and_add(&m_midi_overflows, 1);
+}
+
+
+void Telemetry::write_report(std::ostream& os) const {
+  
+  static const char* names[] = { "input", "run", "output" };
+  
+  os<<"sample_rate "<<m_rate<<"\n"
+    <<"period_frames "<<m_period_frames<<"\n"
+    <<"cycles "<<m_cycle.count<<"\n"
+    <<"xruns "<<m_xruns<<"\n"
+    <<"midi_overflows "<<m_midi_overflows<<"\n"
+    <<"event_buffer_bytes "<<m_event_capacity<<"\n";
+  if (m_host) {
+    os<<"dropped_events "<<m_host->get_dropped_events()<<"\n"
+      <<"lost_port_changes "<<m_host->get_lost_port_changes()<<"\n";
+  }
+  os<<"debug_messages_dropped "<<DebugInfo::queue().dropped<<"\n";
+  
+  // loads in percent of the period
+  os<<"cycle_p50 "<<m_cycle.percentile(0.5)<<"\n"
+    <<"cycle_p99 "<<m_cycle.percentile(0.99)<<"\n"
+    <<"cycle_max "<<m_cycle.max<<"\n";
+  for (unsigned i = 0; i < NumPhases; ++i) {
+    os<<names[i]<<"_p50 "<<m_phases[i].percentile(0.5)<<"\n"
+      <<names[i]<<"_p99 "<<m_phases[i].percentile(0.99)<<"\n"
+      <<names[i]<<"_max "<<m_phases[i].max<<"\n";
+  }
+}
+
+
+void* Telemetry::server_thread(void* arg) {
+  
+  Telemetry* me = static_cast<Telemetry*>(arg);
+  
+  while (me->m_running) {
+    
+    // wake up now and then to see if we should stop
+    pollfd pfd;
+    pfd.fd = me->m_socket;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 100) <= 0)
+      continue;
+    int client = accept(me->m_socket, 0, 0);
+    if (client == -1)
+      continue;
+    
+    ostringstream oss;
+    me->write_report(oss);
+    string report = oss.str();
+    size_t written = 0;
+    while (written < report.size()) {
+      ssize_t n = send(client, report.data() + written, 
+		       report.size() - written, MSG_NOSIGNAL);
+      if (n <= 0)
+	break;
+      written += n;
+    }
+    close(client);
+  }
+  
+  return 0;
+}
+
+
+uint64_t Telemetry::now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
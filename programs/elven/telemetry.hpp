@@ -0,0 +1,148 @@
+/****************************************************************************
+    
+    telemetry.hpp - DSP load and xrun statistics for Elven
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef TELEMETRY_HPP
+#define TELEMETRY_HPP
+
+#include <iostream>
+#include <string>
+
+#include <pthread.h>
+#include <stdint.h>
+
+
+class LV2Host;
+
+
+/** A histogram of the time something takes, as a percentage of the JACK
+    period. It has one writer (the JACK thread) and any number of readers
+    that may see slightly inconsistent values, which is fine for 
+    statistics. */
+struct LoadHistogram {
+  
+  /** The number of buckets. Bucket N counts the cycles that took N% of
+      the period, and the last one counts everything above that. */
+  static const unsigned Buckets = 201;
+  
+  LoadHistogram();
+  
+  /** Add a value (only called by the writer). */
+  void add(float percent);
+  
+  /** Returns the smallest load that @c fraction of the values are below,
+      with 1% resolution. */
+  float percentile(float fraction) const;
+  
+  volatile uint32_t buckets[Buckets];
+  volatile uint32_t count;
+  volatile float max;
+};
+
+
+/** Timing and overflow statistics for the JACK process callback. The 
+    JACK thread timestamps each phase of the callback with the monotonic
+    clock and adds the results to lock-free histograms. A separate thread
+    serves a plain text report on a Unix domain socket, one "key value" pair
+    per line, to anyone who connects to it. Nothing is measured unless
+    start_server() has been called. */
+class Telemetry {
+public:
+  
+  /** The phases of the process callback. */
+  enum Phase {
+    InputPhase,
+    RunPhase,
+    OutputPhase,
+    NumPhases
+  };
+  
+  Telemetry();
+  ~Telemetry();
+  
+  /** Start serving the statistics on a Unix domain socket at @c path. The
+      host is used for its overflow counters, and may be 0. */
+  bool start_server(const std::string& path, unsigned long sample_rate,
+		    const LV2Host* host);
+  
+  /** Stop the server thread and remove the socket. */
+  void stop_server();
+  
+  /** Change the sample rate that the load is computed for. */
+  void set_sample_rate(unsigned long sample_rate);
+  
+  /** Set the size of the MIDI input buffers, for the report. */
+  void set_event_capacity(uint32_t bytes);
+  
+  /** Returns true if the statistics are being collected. */
+  bool is_enabled() const;
+  
+  /** Start timing a cycle of @c nframes frames. */
+  void begin_cycle(uint32_t nframes);
+  
+  /** Mark the end of a phase that started where the previous one ended. */
+  void end_phase(Phase phase);
+  
+  /** Mark the end of the cycle. */
+  void end_cycle();
+  
+  /** Count an xrun. */
+  void count_xrun();
+  
+  /** Count a MIDI event that did not fit in a port buffer. */
+  void count_midi_overflow();
+  
+  /** Write the report. */
+  void write_report(std::ostream& os) const;
+  
+protected:
+  
+  static void* server_thread(void* arg);
+  
+  static uint64_t now();
+  
+  // written by the JACK thread
+  LoadHistogram m_cycle;
+  LoadHistogram m_phases[NumPhases];
+  uint64_t m_cycle_start;
+  uint64_t m_phase_start;
+  double m_period_ns;
+  volatile uint32_t m_period_frames;
+  
+  // written by any thread
+  volatile uint32_t m_xruns;
+  volatile uint32_t m_midi_overflows;
+  
+  volatile unsigned long m_rate;
+  volatile uint32_t m_event_capacity;
+  const LV2Host* m_host;
+  bool m_enabled;
+  
+  std::string m_path;
+  int m_socket;
+  volatile bool m_running;
+  pthread_t m_thread;
+  
+};
+
+
+#endif
@@ -0,0 +1,161 @@
+/****************************************************************************
+    
+    trace.cpp - Timeline traces of the JACK and GUI threads
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+#include "trace.hpp"
+
+
+using namespace std;
+
+
+bool Trace::s_enabled = false;
+TraceBuffer Trace::s_buffers[Trace::MaxThreads];
+volatile unsigned Trace::s_nbuffers = 0;
+__thread TraceBuffer* Trace::s_buffer = 0;
+
+
+namespace {
+  
+  const char* point_names[] = {
+    "MIDI in",
+    "controls",
+    "run",
+    "MIDI out",
+    "run_main",
+    "message run"
+  };
+  
+  const char* point_categories[] = {
+    "jack",
+    "plugin",
+    "plugin",
+    "jack",
+    "gui",
+    "plugin"
+  };
+  
+}
+
+
+void Trace::enable() {
+  s_enabled = true;
+}
+
+
+TraceBuffer* Trace::register_thread(const char* name) {
+  
+  if (!s_enabled || s_buffer)
+    return s_buffer;
+  
+  unsigned i = __sync_fetch_and_add(&s_nbuffers, 1);
+  if (i >= MaxThreads) {
+    DBG1("Too many threads, can not trace thread \""<<name<<"\"");
+    return 0;
+  }
+  
+  // touch all of the buffer so recording never causes page faults
+  TraceEvent* events = new TraceEvent[TraceBuffer::Size];
+  memset(events, 0, TraceBuffer::Size * sizeof(TraceEvent));
+  
+  TraceBuffer& buf = s_buffers[i];
+  buf.thread_name = name;
+  buf.count = 0;
+  __sync_synchronize();
+  buf.events = events;
+  s_buffer = &buf;
+  return s_buffer;
+}
+
+
+void Trace::use_buffer(TraceBuffer* buffer) {
+  s_buffer = buffer;
+}
+
+
+void Trace::record(TracePoint point, bool begin) {
+  TraceBuffer* buf = s_buffer;
+  if (!buf)
+    return;
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t count = buf->count;
+  TraceEvent& e = buf->events[count & (TraceBuffer::Size - 1)];
+  e.time = uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  e.point = point;
+  e.begin = begin;
+  __sync_synchronize();
+  buf->count = count + 1;
+}
+
+
+bool Trace::write(const std::string& filename) {
+  
+  ofstream ofs(filename.c_str());
+  if (!ofs.good()) {
+    DBG0("Could not open "<<filename<<" for writing");
+    return false;
+  }
+  
+  int pid = getpid();
+  unsigned nbuffers = s_nbuffers < MaxThreads ? s_nbuffers : MaxThreads;
+  bool first = true;
+  ofs<<"{\"traceEvents\":["<<fixed<<setprecision(3);
+  for (unsigned t = 0; t < nbuffers; ++t) {
+    
+    const TraceBuffer& buf = s_buffers[t];
+    if (!buf.events)
+      continue;
+    
+    if (!first)
+      ofs<<",";
+    first = false;
+    ofs<<"\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":"<<pid
+       <<",\"tid\":"<<(t + 1)<<",\"args\":{\"name\":\""<<buf.thread_name
+       <<"\"}}";
+    
+    // only the last Size events are still in the buffer
+    uint64_t end = buf.count;
+    uint64_t start = end > TraceBuffer::Size ? end - TraceBuffer::Size : 0;
+    for (uint64_t i = start; i < end; ++i) {
+      const TraceEvent& e = buf.events[i & (TraceBuffer::Size - 1)];
+      if (e.point >= NumTracePoints)
+	continue;
+      ofs<<",\n{\"name\":\""<<point_names[e.point]
+	 <<"\",\"cat\":\""<<point_categories[e.point]
+	 <<"\",\"ph\":\""<<(e.begin ? "B" : "E")
+	 <<"\",\"ts\":"<<(e.time / 1000.0)
+	 <<",\"pid\":"<<pid<<",\"tid\":"<<(t + 1)<<"}";
+    }
+  }
+  ofs<<"\n]}"<<endl;
+  
+  DBG2("Wrote trace to "<<filename);
+  return ofs.good();
+}
@@ -0,0 +1,124 @@
+/****************************************************************************
+    
+    trace.hpp - Timeline traces of the JACK and GUI threads
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <string>
+
+#include <stdint.h>
+
+
+/** The things that can be traced. */
+enum TracePoint {
+  TraceMidiIn,
+  TraceControls,
+  TraceRun,
+  TraceMidiOut,
+  TraceRunMain,
+  TraceMessageRun,
+  NumTracePoints
+};
+
+
+/** One begin or end event. */
+struct TraceEvent {
+  uint64_t time;
+  uint32_t point;
+  uint32_t begin;
+};
+
+
+/** The events recorded by one thread. The buffer is a ring, so when it is
+    full the oldest events are overwritten and the trace always shows the
+    last events before it was written. */
+struct TraceBuffer {
+  
+  /** The number of events in each buffer, must be a power of two. */
+  static const uint32_t Size = 65536;
+  
+  const char* thread_name;
+  TraceEvent* events;
+  volatile uint64_t count;
+};
+
+
+/** Begin/end tracing of the phases of the JACK process callback and the
+    GUI updates. Every thread that should be traced must call 
+    register_thread() before it records anything, which allocates its 
+    buffer. Recording is lock-free and never does any I/O, and when tracing
+    is not enabled trace_begin() and trace_end() only check a flag. The
+    trace is written in the Chrome trace event format, which can be viewed
+    in chrome://tracing or Perfetto. */
+struct Trace {
+  
+  /** The largest number of threads that can be traced. */
+  static const unsigned MaxThreads = 8;
+  
+  /** Start tracing. This must be called before any threads are 
+      registered. */
+  static void enable();
+  
+  /** Returns true if tracing has been enabled. */
+  static inline bool enabled() {
+    return s_enabled;
+  }
+  
+  /** Allocate a trace buffer for the calling thread. Returns the buffer,
+      or 0 if the thread can't be traced. */
+  static TraceBuffer* register_thread(const char* name);
+  
+  /** Make the calling thread record to a buffer that was registered by
+      another thread that has exited, so a thread that is restarted again
+      and again doesn't use up the buffers. */
+  static void use_buffer(TraceBuffer* buffer);
+  
+  /** Record an event in the calling thread's buffer. */
+  static void record(TracePoint point, bool begin);
+  
+  /** Write all buffers to a file. */
+  static bool write(const std::string& filename);
+  
+protected:
+  
+  static bool s_enabled;
+  static TraceBuffer s_buffers[MaxThreads];
+  static volatile unsigned s_nbuffers;
+  static __thread TraceBuffer* s_buffer;
+  
+};
+
+
+inline void trace_begin(TracePoint point) {
+  if (Trace::enabled())
+    Trace::record(point, true);
+}
+
+
+inline void trace_end(TracePoint point) {
+  if (Trace::enabled())
+    Trace::record(point, false);
+}
+
+
+#endif
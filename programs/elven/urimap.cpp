@@ -0,0 +1,136 @@
+/****************************************************************************
+    
+    urimap.cpp - An interned URI to ID map for the plugin and GUI hosts
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#include <cstring>
+
+#include "debug.hpp"
+#include "urimap.hpp"
+
+
+URIMap& URIMap::get() {
+  static URIMap urimap;
+  return urimap;
+}
+
+
+uint32_t URIMap::map(const char* uri) {
+
+  if (!uri)
+    return 0;
+
+  uint32_t h = hash(uri);
+  const Slot* slot = &probe(uri, h);
+  if (slot->uri) {
+    __sync_synchronize();
+    return slot->id;
+  }
+
+  // probe again with the lock, someone may have added it
+  pthread_mutex_lock(&m_mutex);
+  slot = &probe(uri, h);
+  if (slot->uri) {
+    pthread_mutex_unlock(&m_mutex);
+    return slot->id;
+  }
+  if (m_size == MaxURIs) {
+    pthread_mutex_unlock(&m_mutex);
+    DBG0("The URI map is full, can not map "<<uri);
+    return 0;
+  }
+
+  Slot* free_slot = const_cast<Slot*>(slot);
+  uint32_t id = m_size + 1;
+  const char* copy = strdup(uri);
+  free_slot->hash = h;
+  free_slot->id = id;
+  m_uris[id] = copy;
+  __sync_synchronize();
+  free_slot->uri = copy;
+  m_size = id;
+  pthread_mutex_unlock(&m_mutex);
+
+  DBG2("Mapped "<<uri<<" to "<<id);
+
+  return id;
+}
+
+
+uint32_t URIMap::find(const char* uri) const {
+  if (!uri)
+    return 0;
+  const Slot& slot = probe(uri, hash(uri));
+  if (!slot.uri)
+    return 0;
+  __sync_synchronize();
+  return slot.id;
+}
+
+
+const char* URIMap::unmap(uint32_t id) const {
+  if (id == 0 || id > MaxURIs)
+    return 0;
+  return m_uris[id];
+}
+
+
+uint32_t URIMap::size() const {
+  return m_size;
+}
+
+
+URIMap::URIMap()
+  : m_size(0) {
+
+  memset(m_slots, 0, sizeof(m_slots));
+  memset(const_cast<const char**>(m_uris), 0, sizeof(m_uris));
+  pthread_mutex_init(&m_mutex, 0);
+
+  // these get the IDs in the enum
+  map("http://lv2plug.in/ns/ext/midi#MidiEvent");
+  map("http://lv2plug.in/ns/ext/osc#OscEvent");
+}
+
+
+uint32_t URIMap::hash(const char* uri) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (const unsigned char* c =
+	 reinterpret_cast<const unsigned char*>(uri); *c; ++c) {
+    h ^= *c;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+const URIMap::Slot& URIMap::probe(const char* uri, uint32_t h) const {
+  for (uint32_t i = h & (Slots - 1); ; i = (i + 1) & (Slots - 1)) {
+    const Slot& slot = m_slots[i];
+    const char* s = slot.uri;
+    if (!s)
+      return slot;
+    __sync_synchronize();
+    if (slot.hash == h && !strcmp(s, uri))
+      return slot;
+  }
+}
@@ -0,0 +1,102 @@
+/****************************************************************************
+    
+    urimap.hpp - An interned URI to ID map for the plugin and GUI hosts
+    
+    Copyright (C) 2006-2007 Lars Luthman <mail@larsluthman.net>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA  02110-1301  USA
+
+****************************************************************************/
+
+#ifndef URIMAP_HPP
+#define URIMAP_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+
+
+/** Maps URIs to numeric IDs for the URI map extension. There is a single
+    map for the whole process, shared by all plugin and GUI hosts, so a
+    plugin and its GUI get the same ID for the same URI. IDs are handed out
+    in the order the URIs are first seen, starting with the event types
+    that Elven itself reads and writes. 0 is never a valid ID.
+
+    The URIs are kept in an open addressing hash table with a fixed number
+    of slots. A slot is never changed once it has been filled, so looking
+    up a URI that is already mapped takes no locks and is safe in the
+    realtime thread. Adding a new URI takes a mutex. The URI strings are
+    copied and kept until the program exits. */
+class URIMap {
+public:
+
+  /** The IDs of the URIs that are always mapped. */
+  enum {
+    MidiEvent = 1,
+    OscEvent = 2
+  };
+
+  /** The largest number of URIs that can be mapped. */
+  static const uint32_t MaxURIs = 4096;
+
+  /** Returns the map. */
+  static URIMap& get();
+
+  /** Returns the ID for @c uri, and maps it to a new ID if it isn't
+      mapped yet. Returns 0 if the map is full. */
+  uint32_t map(const char* uri);
+
+  /** Returns the ID for @c uri, or 0 if it isn't mapped. This never
+      blocks. */
+  uint32_t find(const char* uri) const;
+
+  /** Returns the URI for @c id, or 0 if nothing has that ID. This never
+      blocks. It is meant for debugging output. */
+  const char* unmap(uint32_t id) const;
+
+  /** Returns the number of mapped URIs. */
+  uint32_t size() const;
+
+protected:
+
+  /** The number of slots, a power of two that is large enough to keep the
+      table at most half full. */
+  static const uint32_t Slots = 2 * MaxURIs;
+
+  /** A slot in the hash table. @c uri is written last, so when it is set
+      the rest of the slot is valid. */
+  struct Slot {
+    const char* volatile uri;
+    uint32_t hash;
+    uint32_t id;
+  };
+
+  URIMap();
+
+  static uint32_t hash(const char* uri);
+
+  /** Returns the slot that has @c uri, or the empty slot where it would
+      be added. */
+  const Slot& probe(const char* uri, uint32_t h) const;
+
+  Slot m_slots[Slots];
+  const char* volatile m_uris[MaxURIs + 1];
+  volatile uint32_t m_size;
+  pthread_mutex_t m_mutex;
+
+};
+
+
+#endif